@@ -8,6 +8,9 @@
 #include "glm/gtx/io.hpp"
 
 #include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <limits>
 #include <ostream>
 
 // axis-aligned bounding box
@@ -192,31 +195,109 @@ inline bool containsTriangle(AABB const& outer, TrianglePos const& t) {
     return result;
 }
 
-// Does a ray intersect the BVH node? Returns distance to intersect, or INFINITY if no intersection
-// based on http://gamedev.stackexchange.com/questions/18436/most-efficient-aabb-vs-ray-collision-algorithms
-// and Physically Based Rendering (Pharr, Jakob, Humphreys) 3rd ed. pp 129
-// note this doesn't take a ray, as it needs 1/direction. Given that this function gets called repeatedly
-// for the same ray, better to do this at the call site.
-float rayIntersectsAABB(AABB const& a, glm::vec3 const& rayOrigin, glm::vec3 const& invDirection) {
-	float t1 = (a.low[0] - rayOrigin[0]) * invDirection[0];
-	float t2 = (a.high[0] - rayOrigin[0]) * invDirection[0];
+// The slab test's rounding must never reject a ray that really does graze a box, or hits right on its
+// faces would be lost. Each slab distance is plane * invDir - origin * invDir, which is off by:
+//  - a few ulps of the distance itself. The far distance is widened by SLAB_FAR_SCALE, 2 * gamma(3) as
+//    in PBRT 3rd ed. 3.9.2, which covers both sides.
+//  - a couple of ulps of origin * invDir, which can be far bigger than the distance when the ray starts
+//    a long way from the world origin. PrecomputedRay moves origin * invDir by SLAB_ORIGIN_SLACK of
+//    itself, per axis and side, so the slabs are widened by that up front, at no cost per box.
+float const SLAB_GAMMA3 = (3.0f * std::numeric_limits<float>::epsilon() * 0.5f) /
+                          (1.0f - 3.0f * std::numeric_limits<float>::epsilon() * 0.5f);
+float const SLAB_FAR_SCALE = 1.0f + 2.0f * SLAB_GAMMA3;
+float const SLAB_ORIGIN_SLACK = SLAB_GAMMA3;
+
+// Everything the slab test needs from a ray, worked out once per ray at the top of the tree walk.
+// With the origin pre-multiplied by 1/direction each slab is a single multiply-subtract, and picking
+// each axis's near and far plane by the sign of the direction up front (Williams et al, "An Efficient
+// and Robust Ray-Box Intersection Algorithm") means no min/max between the two planes per box.
+// [tmin, tmax] is the part of the ray still of interest - traversal pulls tmax in as it finds hits,
+// so anything beyond the closest hit so far is rejected by the box test itself.
+struct PrecomputedRay {
+    PrecomputedRay(Ray const& ray, float _tmin, float _tmax) : tmin(_tmin), tmax(_tmax) {
+        for(int axis = 0; axis < 3; axis++) {
+            // a zero component gives an infinite reciprocal, and inf - inf (or 0 * inf) in the slab
+            // test is a NaN. nudged off zero the reciprocal is huge but finite, which is still parallel
+            // as far as any real box is concerned
+            float d = ray.direction[axis];
+            if(std::abs(d) < 1e-20f)
+                d = std::copysign(1e-20f, d);
+
+            invDir[axis] = 1.0f / d;
+
+            // with the rounding of origin * invDir folded in, see SLAB_ORIGIN_SLACK
+            float const originInvDir = ray.origin[axis] * invDir[axis];
+            float const slack = SLAB_ORIGIN_SLACK * std::abs(originInvDir);
+            nearOriginInvDir[axis] = originInvDir + slack;
+            farOriginInvDir[axis] = originInvDir - slack;
+
+            // offsets into the box as 6 floats, low xyz then high xyz
+            nearOffset[axis] = invDir[axis] < 0.0f ? axis + 3 : axis;
+            farOffset[axis] = invDir[axis] < 0.0f ? axis : axis + 3;
+        }
+    }
 
-	float t3 = (a.low[1] - rayOrigin[1]) * invDirection[1];
-	float t4 = (a.high[1] - rayOrigin[1]) * invDirection[1];
+    glm::vec3 invDir;
+    glm::vec3 nearOriginInvDir, farOriginInvDir;    // origin * invDir, shifted to widen the slabs
+    int nearOffset[3], farOffset[3];
+    float tmin, tmax;
+};
 
-	float t5 = (a.low[2] - rayOrigin[2]) * invDirection[2];
-	float t6 = (a.high[2] - rayOrigin[2]) * invDirection[2];
+// the box's 6 planes as an array, for PrecomputedRay's offsets
+inline float const* aabbPlanes(AABB const& a) {
+    static_assert(offsetof(AABB, high) == 3 * sizeof(float), "AABB layout");
+    return &a.low.x;
+}
 
-	float tmin = std::max(std::max(std::min(t1, t2), std::min(t3, t4)), std::min(t5, t6));
-	float tmax = std::min(std::min(std::max(t1, t2), std::max(t3, t4)), std::max(t5, t6));
+// max/min written so a NaN in the first argument gives the second (which is how maxss/minss work,
+// so these compile to one instruction, no branches)
+inline float slabMax(float a, float b) {
+    return a > b ? a : b;
+}
+
+inline float slabMin(float a, float b) {
+    return a < b ? a : b;
+}
 
-	// if tmax < 0, ray (line) is intersecting AABB, but whole AABB is behind us
-	if (tmax < 0)
-    	return INFINITY;
 
-	// if tmin > tmax, ray doesn't intersect AABB
-	if (tmin > tmax)
-    	return INFINITY;
+// Does a ray intersect the BVH node within [tmin, tmax]? Returns the distance it enters the box
+// (tmin if it starts inside), or INFINITY if not.
+// This is the hottest function in every traversal, hence all the precomputation.
+inline float rayIntersectsAABB(AABB const& a, PrecomputedRay const& r) {
+    float const* const planes = aabbPlanes(a);
+
+    float const nearX = planes[r.nearOffset[0]] * r.invDir.x - r.nearOriginInvDir.x;
+    float const nearY = planes[r.nearOffset[1]] * r.invDir.y - r.nearOriginInvDir.y;
+    float const nearZ = planes[r.nearOffset[2]] * r.invDir.z - r.nearOriginInvDir.z;
+    float const farX = planes[r.farOffset[0]] * r.invDir.x - r.farOriginInvDir.x;
+    float const farY = planes[r.farOffset[1]] * r.invDir.y - r.farOriginInvDir.y;
+    float const farZ = planes[r.farOffset[2]] * r.invDir.z - r.farOriginInvDir.z;
+
+    float const tmin = slabMax(nearX, slabMax(nearY, slabMax(nearZ, r.tmin)));
+    float const tmax = slabMin(farX, slabMin(farY, slabMin(farZ, r.tmax))) * SLAB_FAR_SCALE;
+
+    return tmin <= tmax ? tmin : INFINITY;
+}
+
+// the same for both children of a node at once. the two are independent, so done side by side the
+// cpu can overlap them, and the node's work is one straight run of code with no branches
+inline void rayIntersectsAABBPair(AABB const& a, AABB const& b, PrecomputedRay const& r,
+                                  float& distA, float& distB) {
+    float const* const planesA = aabbPlanes(a);
+    float const* const planesB = aabbPlanes(b);
+
+    float tminA = r.tmin, tmaxA = r.tmax;
+    float tminB = r.tmin, tmaxB = r.tmax;
+    for(int axis = 0; axis < 3; axis++) {
+        float const inv = r.invDir[axis];
+        float const nearOInv = r.nearOriginInvDir[axis];
+        float const farOInv = r.farOriginInvDir[axis];
+        tminA = slabMax(planesA[r.nearOffset[axis]] * inv - nearOInv, tminA);
+        tminB = slabMax(planesB[r.nearOffset[axis]] * inv - nearOInv, tminB);
+        tmaxA = slabMin(planesA[r.farOffset[axis]] * inv - farOInv, tmaxA);
+        tmaxB = slabMin(planesB[r.farOffset[axis]] * inv - farOInv, tmaxB);
+    }
 
-    return tmin;
+    distA = tminA <= tmaxA * SLAB_FAR_SCALE ? tminA : INFINITY;
+    distB = tminB <= tmaxB * SLAB_FAR_SCALE ? tminB : INFINITY;
 }
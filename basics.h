@@ -15,13 +15,35 @@ typedef std::vector<unsigned int> TriangleMapping;
 
 const int STARTING_TTL = 10; // probably should be configurable or dynamically calculated
 
+// what a ray is for - only used for statistics
+enum class RayKind : unsigned char {
+    Primary,    // from the camera
+    Shadow,     // towards a light
+    Secondary,  // reflection or refraction
+    Diffuse,    // path tracer bounce
+    _MAX
+};
+
+const int RAY_KIND_COUNT = (int)RayKind::_MAX;
+
+inline const char* GetRayKindStr(RayKind k) {
+    switch(k) {
+        case RayKind::Primary:   return "primary";
+        case RayKind::Shadow:    return "shadow";
+        case RayKind::Secondary: return "secondary";
+        case RayKind::Diffuse:   return "diffuse";
+        default:                 return "unknown";
+    }
+}
+
 struct Ray{
-    Ray(glm::vec3 o, glm::vec3 d, int m, int t)
-        :origin(o), direction(d), mat(m), ttl(t) {};
+    Ray(glm::vec3 o, glm::vec3 d, int m, int t, RayKind k = RayKind::Primary)
+        :origin(o), direction(d), mat(m), ttl(t), kind(k) {};
 
     glm::vec3 origin, direction;
     int mat;
     int ttl;
+    RayKind kind;
 };
 
 typedef glm::vec3 Color;
@@ -1,32 +1,167 @@
 #pragma once
 
 #include "bvh_build_factory.h"
+#include "bvh_heat.h"
+#include "camera.h"
+#include "loader.h"
+#include "mem_stats.h"
 #include "output.h"
+#include "output_queue.h"
+#include "params.h"
+#include "profile.h"
 #include "render.h"
 #include "timer.h"
 #include "trace.h"
 #include "utils.h"
 
-int batchRender(Scene& s, std::string const& imgDir, int width, int height) {
-    Timer t;
+#include <string>
+#include <vector>
+
+// batch mode settings, filled in from the command line
+struct BatchOptions {
+    BatchOptions() :
+        width(640), height(640), spp(1), interpFrames(0), visMode(VisMode::Default),
+        triangleTest(TriangleTest::MollerTrumbore), shadingMode(ShadingMode::Immediate)
+    {}
+
+    int width, height;
+    int spp;            // samples (ie passes) per pixel. only used by progressive vis modes
+    int interpFrames;   // number of extra frames to interpolate between each pair of keyframes
+    VisMode visMode;
+    TriangleTest triangleTest;
+    ShadingMode shadingMode;
+    std::string cameraPathFile; // optional camera path file, overrides any path in the scene
+    std::string traceFile;      // if set, profile every frame and write a chrome trace here
+    std::string heatPrefix;     // if set, collect the bvh heat map over every frame and dump it here
+    BVHBuildOptions bvhOptions;
+};
+
+// expand a set of keyframes into the full list of frames to render
+std::vector<CameraPose> buildFramePath(std::vector<CameraPose> const& keys, int interpFrames) {
+    assert(keys.size() > 0);
+    assert(interpFrames >= 0);
+
+    std::vector<CameraPose> frames;
+    for(unsigned int i = 0; i + 1 < keys.size(); i++) {
+        for(int j = 0; j <= interpFrames; j++) {
+            float t = (float)j / (float)(interpFrames + 1);
+            frames.push_back(lerpPose(keys[i], keys[i + 1], t));
+        }
+    }
+    frames.push_back(keys.back());
+    return frames;
+}
+
+// render the scene without a window, and dump the frame(s) to imgDir.
+// with no camera path, we render a single frame from the scene's camera. with a path, every frame
+// is rendered using the same BVH (and omp thread pool), so we only pay for setup once.
+int batchRender(Scene& s, std::string const& imgDir, BatchOptions const& opts) {
+    Timer totalTimer, setupTimer;
     Params p;
+    p.setVisMode(opts.visMode);
+    p.triangleTest = opts.triangleTest;
+    p.shadingMode = opts.shadingMode;
+
+    std::vector<CameraPose> keys = s.cameraPath;
+    if(!opts.cameraPathFile.empty()) {
+        keys.clear();
+        if(!loadCameraPath(opts.cameraPathFile, keys))
+            return -1;
+    }
+
+    // no path, no problem - just use the starting camera
+    bool const sequence = !keys.empty();
+    if(!sequence)
+        keys.push_back(s.camera.pose());
+
+    std::vector<CameraPose> frames = buildFramePath(keys, opts.interpFrames);
+
+    ScreenBuffer screenBuffer, clampedScreenBuffer;
+    screenBuffer.resize(opts.width * opts.height);
+    clampedScreenBuffer.resize(opts.width * opts.height);
+    accountScreenBuffers({&screenBuffer, &clampedScreenBuffer});
+
+    s.camera.width = opts.width;
+    s.camera.height = opts.height;
+    BVH* bvh = buildBVH(s, p.bvhMethod, opts.bvhOptions);
+    p.autoSetVisScale((float)bvh->maxDepth);
 
-    ScreenBuffer screenBuffer;
-    screenBuffer.resize(width * height);
+    // extra passes don't change anything in the non-progressive modes
+    int const passes = IsProgressive(p.visMode) ? opts.spp : 1;
 
-    s.camera.width = width;
-    s.camera.height = height;
-    BVH* bvh = buildBVH(s, p.bvhMethod);
+    OutputQueue output;
+    std::string const fnameBase = MakeImageFilenameBase(imgDir);
 
-    std::cout << "starting batch render" << std::endl;
+    std::cout << "starting batch render - " << frames.size() << " frame(s) at ";
+    std::cout << opts.width << "x" << opts.height << " " << passes << " spp" << std::endl;
+    std::cout << "setup time " << setupTimer.sample() << " sec" << std::endl;
 
-    renderFrame(s, *bvh, p, screenBuffer, 0);
+    bool const profiling = profilingEnabled();
+    if(profiling)
+        profileEndFrame("setup");
+
+    if(!opts.heatPrefix.empty())
+        startNodeHeat(*bvh);
+
+    Timer frameTimer;
+    float renderTime = 0.0f;
+
+    for(unsigned int i = 0; i < frames.size(); i++) {
+        {
+            ProfileZone frameZone("frame");
+            s.camera.setPose(frames[i]);
+
+            ProfileCounters const countersBefore = totalProfileCounters();
+            frameTimer.sample();
+            for(int pass = 0; pass < passes; pass++)
+                renderFrame(s, *bvh, p, screenBuffer, pass);
+            float frameTime = frameTimer.sample();
+            renderTime += frameTime;
+            ProfileCounters const counters = totalProfileCounters().since(countersBefore);
+
+            float primaryRays = (float)opts.width * opts.height * passes;
+            std::cout << "frame " << i << " render time " << frameTime << " sec ";
+            std::cout << (primaryRays / frameTime) / 1e6f << " primary Mrays/s, ";
+            std::cout << counters.get(RayKind::Shadow) << " shadow rays, " << counters.shadowSkipped << " skipped" << std::endl;
+            if(IsPerfCounterMode(p.visMode))
+                printPerfFrameSummary(lastPerfFrame());
+
+            {
+                // progressive modes don't clamp per pixel, so do that before it hits the disk
+                ProfileZone clampZone("clamp");
+                for(unsigned int j = 0; j < screenBuffer.size(); j++)
+                    clampedScreenBuffer[j] = colorClamp(screenBuffer[j]);
+            }
+
+            {
+                // hand the frame to the writer thread - it's encoded and written while we render the next
+                // one. this only takes any time if the writer's fallen behind
+                ProfileZone pushZone("output push");
+                std::string fname = sequence ? MakeFrameFilename(fnameBase, i) : fnameBase + ".tga";
+                output.push(fname, opts.width, opts.height, clampedScreenBuffer);
+            }
+        }
+
+        if(profiling)
+            profileEndFrame("frame " + std::to_string(i));
+    }
+
+    bool ok = true;
+    if(!opts.heatPrefix.empty())
+        ok = dumpNodeHeat(opts.heatPrefix, *bvh, stopNodeHeat());
 
     delete bvh;
 
-    bool result = WriteTgaImage(imgDir, s.camera.width, s.camera.height, screenBuffer);
+    output.flush();
+
+    float totalRays = (float)opts.width * opts.height * passes * frames.size();
+    std::cout << "render time " << renderTime << " sec for " << frames.size() << " frame(s), ";
+    std::cout << (totalRays / renderTime) / 1e6f << " primary Mrays/s" << std::endl;
+    std::cout << "total time " << totalTimer.sample() << " sec" << std::endl;
 
-    std::cout << "render time " << t.sample() << " sec" << std::endl;
+    ok = output.ok() && ok;
+    if(profiling && !opts.traceFile.empty())
+        ok = writeChromeTrace(opts.traceFile) && ok;
 
-    return result ? 0 : -1;
+    return ok ? 0 : -1;
 }
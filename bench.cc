@@ -0,0 +1,143 @@
+#include "bench.h"
+#include "ray_replay.h"
+
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <string>
+
+void showUsage(const char* binary) {
+    BenchOptions defaults;
+    std::cout << "USAGE: " << binary << " [options] <input dir> <scene file> [scene file...]\n";
+    std::cout << "       " << binary << " -R <ray file> [options] <input dir> <scene file>\n";
+    std::cout << "       " << binary << " -P <ray file> [options] <input dir> <scene file>\n";
+    std::cout << "         -R  record every ray from a single render of the scene to a ray file\n";
+    std::cout << "         -P  replay a ray file through each bvh method, node format, traversal mode and triangle test\n";
+    std::cout << "options:\n";
+    std::cout << "         -r <width>x<height>  resolution (default " << defaults.width << "x" << defaults.height << ")\n";
+    std::cout << "         -s <spp>             samples per pixel, for progressive vis modes (default 1)\n";
+    std::cout << "         -n <runs>            timed runs per scene and bvh method (default " << defaults.runs << ")\n";
+    std::cout << "         -m <mode>            vis mode - interactive mode keys 0-9, c/i for F1/F2 (default 0)\n";
+    std::cout << "         -b <method>          bvh method to bench, may be repeated (default all)\n";
+    std::cout << "         -q <full|q16|q8>     bvh node format to bench, may be repeated (default full)\n";
+    std::cout << "         -w <moller|watertight> ray/triangle test to bench, may be repeated (default moller)\n";
+    std::cout << "         -f <json|csv>        output format (default json)\n";
+    std::cout << "         -o <file>            output file (default bench.json or bench.csv)\n";
+    std::cout << "         -T <iterations>      bvh treelet optimisation passes, 0 for none (default " << defaults.bvhOptions.treeletIterations << ")\n";
+    std::cout << "         -L <off|auto|cost>   bvh leaf collapsing, with measured or given triangle/node cost ratio (default auto)\n";
+    std::cout << "         -D <factor>          sbvh max triangle references, as a multiple of the triangle count (default " << defaults.bvhOptions.sbvhMaxDuplication << ")\n";
+    std::cout << "         -K <splits>          sbvh max spatial splits at any one depth, 0 for no limit (default 0)\n";
+    std::cout << "record uses the first bvh method and triangle test given. replay only uses -n, -b, -q, -w, -o and the\n";
+    std::cout << "bvh build options, and writes json\n";
+}
+
+// parse the flags off the front of args. returns false on a bad flag
+bool parseBenchOptions(std::deque<std::string>& args, BenchOptions& opts) {
+    while(!args.empty() && args.front().size() == 2 && args.front()[0] == '-') {
+        char flag = args.front()[1];
+        args.pop_front();
+
+        if(args.empty())
+            return false;
+
+        std::string val = args.front();
+        args.pop_front();
+
+        bool ok = false;
+        BVHMethod method;
+        NodeFormat format;
+        TriangleTest test;
+        switch(flag) {
+            case 'r':
+                ok = sscanf(val.c_str(), "%dx%d", &opts.width, &opts.height) == 2 &&
+                     opts.width > 0 && opts.height > 0;
+                break;
+            case 's': ok = parseCount(val, opts.spp, false); break;
+            case 'n': ok = parseCount(val, opts.runs, false); break;
+            case 'm': ok = ParseVisMode(val, opts.visMode); break;
+            case 'b':
+                ok = ParseBVHMethod(val, method);
+                if(ok)
+                    opts.methods.push_back(method);
+                break;
+            case 'q':
+                ok = ParseNodeFormat(val, format);
+                if(ok)
+                    opts.nodeFormats.push_back(format);
+                break;
+            case 'w':
+                ok = ParseTriangleTest(val, test);
+                if(ok)
+                    opts.triangleTests.push_back(test);
+                break;
+            case 'f':
+                ok = (val == "json" || val == "csv");
+                opts.csv = (val == "csv");
+                break;
+            case 'o': opts.outputFile = val; ok = true; break;
+            case 'T': ok = parseCount(val, opts.bvhOptions.treeletIterations, true); break;
+            case 'L': ok = parseLeafCollapse(val, opts.bvhOptions); break;
+            case 'D': ok = parseFactor(val, opts.bvhOptions.sbvhMaxDuplication); break;
+            case 'K': ok = parseCount(val, opts.bvhOptions.sbvhSpatialSplitsPerDepth, true); break;
+        }
+
+        if(!ok)
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    std::deque<std::string> args;
+    for(int i = 1; i < argc; i++)
+        args.push_back(argv[i]);
+
+    // record/replay ray files
+    std::string recordFile, replayFile;
+    if(args.size() >= 2 && args.front() == "-R") {
+        recordFile = args[1];
+        args.erase(args.begin(), args.begin() + 2);
+    } else if(args.size() >= 2 && args.front() == "-P") {
+        replayFile = args[1];
+        args.erase(args.begin(), args.begin() + 2);
+    }
+
+    BenchOptions opts;
+    if(!parseBenchOptions(args, opts) || args.size() < 2) {
+        showUsage(argv[0]);
+        return -1;
+    }
+
+    if(opts.methods.empty()) {
+        for(int i = 0; i < (int)BVHMethod::_MAX; i++)
+            opts.methods.push_back((BVHMethod)i);
+    }
+
+    if(opts.nodeFormats.empty())
+        opts.nodeFormats.push_back(NodeFormat::Full);
+
+    if(opts.triangleTests.empty())
+        opts.triangleTests.push_back(TriangleTest::MollerTrumbore);
+
+    if(opts.outputFile.empty())
+        opts.outputFile = opts.csv ? "bench.csv" : "bench.json";
+
+    std::string inputDir = args.front();
+    args.pop_front();
+
+    std::vector<std::string> scenes(args.begin(), args.end());
+
+    if(!recordFile.empty() || !replayFile.empty()) {
+        if(scenes.size() != 1 || opts.csv) {
+            showUsage(argv[0]);
+            return -1;
+        }
+
+        if(!recordFile.empty())
+            return recordRays(inputDir, scenes.front(), opts, recordFile);
+        else
+            return replayRayFile(inputDir, scenes.front(), opts, replayFile);
+    }
+
+    return benchmark(inputDir, scenes, opts);
+}
@@ -0,0 +1,307 @@
+#pragma once
+
+#include "bvh.h"
+#include "bvh_build_factory.h"
+#include "bvh_diag.h"
+#include "loader.h"
+#include "mem_stats.h"
+#include "params.h"
+#include "profile.h"
+#include "render.h"
+#include "scene.h"
+#include "timer.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Benchmark harness - renders a set of scenes with every BVH method, under fixed conditions (the
+// scene's starting camera, fixed resolution, spp and rng seed), and writes the numbers out as json
+// or csv so runs can be diffed between builds.
+
+struct BenchOptions {
+    BenchOptions() : width(640), height(480), spp(1), runs(5), visMode(VisMode::Default), csv(false) {}
+
+    int width, height;
+    int spp;            // passes per run. only used by progressive vis modes
+    int runs;           // timed runs per scene/method (after one warm up run)
+    VisMode visMode;
+    bool csv;           // csv rather than json output
+    std::string outputFile;
+    std::vector<BVHMethod> methods;
+    std::vector<NodeFormat> nodeFormats; // each method is benched with each of these
+    std::vector<TriangleTest> triangleTests; // and each of these
+    BVHBuildOptions bvhOptions;
+};
+
+// everything we measure for one scene + BVH method
+struct BenchResult {
+    BenchResult() :
+        method(BVHMethod::SBVH), nodeFormat(NodeFormat::Full), triangleTest(TriangleTest::MollerTrumbore), loaded(false), triangles(0), buildTime(0.0f), sahCost(0.0f),
+        nodeCount(0), maxDepth(0), references(0), median(0.0f), p95(0.0f), peakRSS(0)
+    {}
+
+    std::string scene;
+    BVHMethod method;
+    NodeFormat nodeFormat;
+    TriangleTest triangleTest;
+    bool loaded;            // false if the scene failed to load - nothing else is valid
+
+    unsigned int triangles;
+    float buildTime;        // seconds
+    float sahCost;
+    unsigned int nodeCount;
+    unsigned int maxDepth;
+    unsigned int references; // triangle refs in the leaves. more than triangles if the method duplicates
+
+    std::vector<float> runTimes; // seconds, per run
+    float median, p95;
+    ProfileCounters counters; // rays cast in a single run
+
+    MemoryStats memory;     // tracked allocations, for this scene and method
+    long peakRSS;           // bytes. process wide, so it never goes down between results
+};
+
+// nearest rank percentile (@pct in [0, 100]) of some samples
+inline float percentile(std::vector<float> samples, float pct) {
+    assert(!samples.empty());
+    std::sort(samples.begin(), samples.end());
+    int rank = (int)ceilf(pct / 100.0f * samples.size()) - 1;
+    return samples[clamp(rank, 0, (int)samples.size() - 1)];
+}
+
+// Mrays/s for a ray count, given the median run time
+inline float mraysPerSec(uint64_t count, float time) {
+    return time > 0.0f ? (float)(count / time / 1e6) : 0.0f;
+}
+
+// reflection/refraction and path tracer bounces, lumped together
+inline uint64_t secondaryRays(ProfileCounters const& rays) {
+    return rays.get(RayKind::Secondary) + rays.get(RayKind::Diffuse);
+}
+
+// bench a single BVH method on an already loaded scene
+inline BenchResult benchMethod(Scene& s, std::string const& sceneFile, BVHMethod method, NodeFormat format,
+                               TriangleTest test, BenchOptions const& opts) {
+    BenchResult res;
+    res.scene = sceneFile;
+    res.method = method;
+    res.nodeFormat = format;
+    res.triangleTest = test;
+    res.loaded = true;
+    res.triangles = s.primitives.pos.size();
+
+    Params p;
+    p.setVisMode(opts.visMode);
+    p.bvhMethod = method;
+    p.triangleTest = test;
+
+    // bvh peaks are per method
+    clearMemoryUsage(MemoryKind::BVHNodes);
+    clearMemoryUsage(MemoryKind::BVHIndicies);
+    clearMemoryUsage(MemoryKind::BVHQuantizedNodes);
+
+    BVHBuildOptions bvhOptions = opts.bvhOptions;
+    bvhOptions.nodeFormat = format;
+
+    Timer buildTimer;
+    BVH* bvh = buildBVH(s, method, bvhOptions);
+    res.buildTime = buildTimer.sample();
+    res.sahCost = calcSAHCost(*bvh);
+    res.nodeCount = bvh->nodeCount();
+    res.maxDepth = bvh->maxDepth;
+    res.references = bvh->indicies.size();
+
+    p.autoSetVisScale((float)bvh->maxDepth);
+
+    ScreenBuffer screenBuffer(s.camera.width * s.camera.height);
+    accountScreenBuffers({&screenBuffer});
+    int const passes = IsProgressive(p.visMode) ? opts.spp : 1;
+
+    // one untimed run first, to warm the caches and spin up the omp thread pool
+    for(int run = -1; run < opts.runs; run++) {
+        resetProfileCounters();
+
+        Timer t;
+        for(int pass = 0; pass < passes; pass++)
+            renderFrame(s, *bvh, p, screenBuffer, pass);
+        float time = t.sample();
+
+        if(run >= 0)
+            res.runTimes.push_back(time);
+    }
+
+    // the rng is seeded per row, so every run casts exactly the same rays
+    res.counters = totalProfileCounters();
+    res.median = percentile(res.runTimes, 50.0f);
+    res.p95 = percentile(res.runTimes, 95.0f);
+    res.memory = memoryStats();
+
+    delete bvh;
+
+    res.peakRSS = peakRSSBytes();
+    return res;
+}
+
+// one line summary, for the console
+inline void printBenchResult(BenchResult const& r) {
+    std::cout << "bench " << r.scene << " " << GetBVHMethodStr(r.method) << " " << GetNodeFormatStr(r.nodeFormat);
+    std::cout << " " << GetTriangleTestStr(r.triangleTest);
+    if(!r.loaded) {
+        std::cout << " FAILED TO LOAD" << std::endl;
+        return;
+    }
+
+    std::cout << " build " << r.buildTime << "s SAH " << r.sahCost << " nodes " << r.nodeCount;
+    std::cout << " median " << r.median << "s p95 " << r.p95 << "s";
+    std::cout << " primary " << mraysPerSec(r.counters.get(RayKind::Primary), r.median);
+    std::cout << " shadow " << mraysPerSec(r.counters.get(RayKind::Shadow), r.median);
+    std::cout << " secondary " << mraysPerSec(secondaryRays(r.counters), r.median) << " Mrays/s";
+    std::cout << " tracked " << r.memory.totalAllocated() / (1024 * 1024) << "MiB";
+    std::cout << " peak RSS " << r.peakRSS / (1024 * 1024) << "MiB" << std::endl;
+}
+
+inline void writeBenchJson(std::ostream& os, std::vector<BenchResult> const& results, BenchOptions const& opts) {
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+
+    os << "{\n";
+    os << "  \"width\" : " << opts.width << ", \"height\" : " << opts.height;
+    os << ", \"spp\" : " << opts.spp << ", \"runs\" : " << opts.runs;
+    os << ", \"vis_mode\" : \"" << GetVisModeStr(opts.visMode) << "\"";
+    os << ", \"seed\" : " << Params().seed << ", \"threads\" : " << threads << ",\n";
+    os << "  \"results\" : [\n";
+
+    for(unsigned int i = 0; i < results.size(); i++) {
+        BenchResult const& r = results[i];
+        os << "    {\"scene\" : \"" << r.scene << "\", \"bvh\" : \"" << GetBVHMethodStr(r.method) << "\"";
+        os << ", \"node_format\" : \"" << GetNodeFormatStr(r.nodeFormat) << "\"";
+        os << ", \"triangle_test\" : \"" << GetTriangleTestStr(r.triangleTest) << "\"";
+        os << ", \"loaded\" : " << (r.loaded ? "true" : "false");
+
+        if(r.loaded) {
+            os << ", \"triangles\" : " << r.triangles;
+            os << ", \"build_time\" : " << r.buildTime;
+            os << ", \"sah_cost\" : " << r.sahCost;
+            os << ", \"node_count\" : " << r.nodeCount;
+            os << ", \"max_depth\" : " << r.maxDepth;
+            os << ", \"references\" : " << r.references;
+
+            os << ", \"run_times\" : [";
+            for(unsigned int j = 0; j < r.runTimes.size(); j++)
+                os << (j ? ", " : "") << r.runTimes[j];
+            os << "]";
+
+            os << ", \"median\" : " << r.median << ", \"p95\" : " << r.p95;
+
+            os << ", \"rays\" : {";
+            for(int k = 0; k < RAY_KIND_COUNT; k++)
+                os << (k ? ", " : "") << "\"" << GetRayKindStr((RayKind)k) << "\" : " << r.counters.rays[k];
+            os << "}";
+
+            os << ", \"mrays_per_sec\" : {";
+            os << "\"primary\" : " << mraysPerSec(r.counters.get(RayKind::Primary), r.median);
+            os << ", \"shadow\" : " << mraysPerSec(r.counters.get(RayKind::Shadow), r.median);
+            os << ", \"secondary\" : " << mraysPerSec(secondaryRays(r.counters), r.median);
+            os << ", \"total\" : " << mraysPerSec(r.counters.totalRays(), r.median) << "}";
+
+            os << ", \"memory\" : ";
+            writeMemoryJson(os, r.memory);
+            os << ", \"peak_rss\" : " << r.peakRSS;
+        }
+        os << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+
+    os << "  ]\n";
+    os << "}\n";
+}
+
+inline void writeBenchCsv(std::ostream& os, std::vector<BenchResult> const& results, BenchOptions const& opts) {
+    os << "scene,bvh,node_format,triangle_test,width,height,spp,runs,triangles,build_time,sah_cost,node_count,max_depth,references,";
+    os << "median,p95,primary_rays,shadow_rays,secondary_rays,";
+    os << "primary_mrays,shadow_mrays,secondary_mrays,total_mrays,";
+    os << "primitives_bytes,bvh_nodes_bytes,bvh_indicies_bytes,bvh_quantized_nodes_bytes,tracked_peak_bytes,peak_rss\n";
+
+    for(auto const& r : results) {
+        if(!r.loaded)
+            continue;
+
+        os << r.scene << "," << GetBVHMethodStr(r.method) << "," << GetNodeFormatStr(r.nodeFormat) << ",";
+        os << GetTriangleTestStr(r.triangleTest) << ",";
+        os << opts.width << "," << opts.height << "," << opts.spp << "," << opts.runs << ",";
+        os << r.triangles << "," << r.buildTime << "," << r.sahCost << "," << r.nodeCount << ",";
+        os << r.maxDepth << "," << r.references << "," << r.median << "," << r.p95 << ",";
+        os << r.counters.get(RayKind::Primary) << "," << r.counters.get(RayKind::Shadow) << ",";
+        os << secondaryRays(r.counters) << ",";
+        os << mraysPerSec(r.counters.get(RayKind::Primary), r.median) << ",";
+        os << mraysPerSec(r.counters.get(RayKind::Shadow), r.median) << ",";
+        os << mraysPerSec(secondaryRays(r.counters), r.median) << ",";
+        os << mraysPerSec(r.counters.totalRays(), r.median) << ",";
+
+        uint64_t trackedPeak = 0;
+        for(auto const& u : r.memory.usage)
+            trackedPeak += u.peak;
+        os << r.memory.get(MemoryKind::Primitives).allocated << ",";
+        os << r.memory.get(MemoryKind::BVHNodes).allocated << ",";
+        os << r.memory.get(MemoryKind::BVHIndicies).allocated << ",";
+        os << r.memory.get(MemoryKind::BVHQuantizedNodes).allocated << ",";
+        os << trackedPeak << "," << r.peakRSS << "\n";
+    }
+}
+
+// run the whole suite. returns non zero if any scene failed to load, or the output couldn't be written
+int benchmark(std::string const& inputDir, std::vector<std::string> const& scenes, BenchOptions const& opts) {
+    std::vector<BenchResult> results;
+    bool failed = false;
+
+    for(auto const& sceneFile : scenes) {
+        resetMemoryStats();
+
+        Scene s;
+        if(!setupScene(inputDir, sceneFile, s) || s.primitives.pos.size() == 0) {
+            std::cout << "ERROR: failed to setup scene " << sceneFile << std::endl;
+            BenchResult res;
+            res.scene = sceneFile;
+            results.push_back(res);
+            failed = true;
+            continue;
+        }
+
+        // always the scene's starting camera
+        s.camera.width = opts.width;
+        s.camera.height = opts.height;
+        s.camera.resetView();
+
+        for(BVHMethod method : opts.methods) {
+            for(NodeFormat format : opts.nodeFormats) {
+                for(TriangleTest test : opts.triangleTests) {
+                    results.push_back(benchMethod(s, sceneFile, method, format, test, opts));
+                    printBenchResult(results.back());
+                }
+            }
+        }
+    }
+
+    std::ofstream out(opts.outputFile);
+    if(opts.csv)
+        writeBenchCsv(out, results, opts);
+    else
+        writeBenchJson(out, results, opts);
+
+    if(!out) {
+        std::cout << "ERROR: couldn't write " << opts.outputFile << std::endl;
+        return -1;
+    }
+
+    std::cout << "wrote " << results.size() << " result(s) to " << opts.outputFile << std::endl;
+    return failed ? -1 : 0;
+}
@@ -3,18 +3,41 @@
 #include "aabb.h"
 #include "primitive.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <string>
 #include <vector>
 
 // this file contains the core BVH machinery for storage 
 // It doesn't contain any BVH building or traversal code
 
+// inner nodes have no triangles, so their count holds the axis they were split on instead, flagged with
+// the top bit so it can't be taken for a triangle count. ordered traversal reads the axis from there,
+// so knowing it costs no extra memory
+unsigned int const BVH_INNER_NODE = 0x80000000u;
+
 // BVHNode
 struct BVHNode {
     BVHNode(): leftFirst(0), count(0) {}
     BVHNode(unsigned int _leftFirst, unsigned int _count): leftFirst(_leftFirst), count(_count) {}
 
     bool isLeaf() const {
-        return count > 0;
+        return (count & BVH_INNER_NODE) == 0;
+    }
+
+    // make this an inner node, with children at @left and @left+1, split on @axis with the left child
+    // on the low side
+    void setInner(unsigned int left, unsigned int axis) {
+        assert(axis < 3);
+        leftFirst = left;
+        count = BVH_INNER_NODE | axis;
+    }
+
+    // only valid for non-leaves
+    unsigned int splitAxis() const {
+        assert(!isLeaf());
+        return count & ~BVH_INNER_NODE;
     }
 
     // only valid for non-leaves
@@ -43,15 +66,102 @@ struct BVHNode {
 // check sizes are as expected - prevent accidental cache performance degredation
 static_assert(sizeof(BVHNode) == 32, "BVHNode size");
 
+// which node array traversal reads. the quantized formats are made from the full nodes after the build
+// (see bvh_quantize.h), and the full nodes are kept for everything else (stats, heat maps, etc)
+enum class NodeFormat {
+    Full,           // BVHNode, 32 bytes
+    Quantized16,    // QuantizedBVHNode<uint16_t>, 20 bytes
+    Quantized8,     // QuantizedBVHNode<uint8_t>, 16 bytes
+    _MAX
+};
+
+inline const char* GetNodeFormatStr(NodeFormat f) {
+    switch(f) {
+        case NodeFormat::Full:        return "full";
+        case NodeFormat::Quantized16: return "q16";
+        case NodeFormat::Quantized8:  return "q8";
+        default:                      return "unknown";
+    }
+}
+
+// parse a node format, per GetNodeFormatStr(). returns false if the string isn't recognised
+inline bool ParseNodeFormat(std::string const& str, NodeFormat& f) {
+    for(int i = 0; i < (int)NodeFormat::_MAX; i++) {
+        if(str == GetNodeFormatStr((NodeFormat)i)) {
+            f = (NodeFormat)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// a node with its bounds quantized to @Q relative to its parent's (dequantized) bounds, rounded
+// outwards so the result always contains the real bounds. lo is applied from the parent's low corner
+// and hi (as LEVELS - hi) from its high corner, so both ends of the parent's range are exact.
+// leftFirst and count are as in BVHNode. the root's bounds are kept in full, see QuantizedNodes
+template<class Q>
+struct QuantizedBVHNode {
+    static constexpr unsigned int LEVELS = std::numeric_limits<Q>::max();
+
+    Q lo[3], hi[3];
+    unsigned int leftFirst;
+    unsigned int count;
+
+    bool isLeaf() const {
+        return (count & BVH_INNER_NODE) == 0;
+    }
+
+    unsigned int splitAxis() const {
+        assert(!isLeaf());
+        return count & ~BVH_INNER_NODE;
+    }
+
+    unsigned int leftIndex() const {
+        assert(!isLeaf());
+        return leftFirst;
+    }
+
+    unsigned int rightIndex() const {
+        assert(!isLeaf());
+        return leftFirst + 1;
+    }
+
+    unsigned int first() const {
+        assert(isLeaf());
+        return leftFirst;
+    }
+
+    // @parent must be exactly what traversal will use, ie the parent's own dequantized bounds
+    AABB dequantize(AABB const& parent) const {
+        glm::vec3 const scale = (parent.high - parent.low) * (1.0f / LEVELS);
+        glm::vec3 const qlo(lo[0], lo[1], lo[2]);
+        glm::vec3 const qhi(LEVELS - hi[0], LEVELS - hi[1], LEVELS - hi[2]);
+        return AABB(parent.low + qlo * scale, parent.high - qhi * scale);
+    }
+};
+
+static_assert(sizeof(QuantizedBVHNode<uint16_t>) == 20, "QuantizedBVHNode<uint16_t> size");
+static_assert(sizeof(QuantizedBVHNode<uint8_t>) == 16, "QuantizedBVHNode<uint8_t> size");
+
+template<class Q>
+struct QuantizedNodes {
+    AABB rootBounds;
+    std::vector<QuantizedBVHNode<Q>> nodes; // same indices as BVH::nodes
+};
+
 struct BVH {
-    BVH() : nextFree(2), objectSplits(0), spatialSplits(0), maxDepth(0) {
+    BVH() : nextFree(2), nodeFormat(NodeFormat::Full), objectSplits(0), spatialSplits(0), maxDepth(0) {
         nodes.resize(1); // ensure at least root exists
     } 
 
-    BVH(unsigned int triangleCount) : nextFree(2), objectSplits(0), spatialSplits(0), maxDepth(0) {
-        // FIXME:should we be smarter here?
-        nodes.resize(triangleCount* 3); 
-        //indicies.resize(triangleCount);
+    // sized for a build over @triangleCount triangles. Without duplicated triangles a tree can't
+    // have more than 2*count-1 nodes (plus the unused node 1), so that's reserved up front. A build
+    // that duplicates triangles (ie SBVH) may need more, in which case nodes grows as needed.
+    // call shrinkToFit() once the build is done
+    BVH(unsigned int triangleCount) : nextFree(2), nodeFormat(NodeFormat::Full), objectSplits(0), spatialSplits(0), maxDepth(0) {
+        nodes.reserve(std::max(triangleCount, 1u) * 2);
+        nodes.resize(2); // root, and the unused node 1
+        indicies.reserve(triangleCount);
     } 
 
     BVHNode const& getNode(unsigned int index) const {
@@ -71,9 +181,17 @@ struct BVH {
         return nodes[0];
     }
 
-    BVHNode& allocNextNode() {
-        assert(nextFree < nodes.size());
-        return nodes[nextFree++];
+    // returns the new node's index. may grow nodes, so invalidates any node references held
+    unsigned int allocNextNode() {
+        assert(nextFree == nodes.size());
+        nodes.emplace_back();
+        return nextFree++;
+    }
+
+    // drop any spare capacity left over from building
+    void shrinkToFit() {
+        nodes.shrink_to_fit();
+        indicies.shrink_to_fit();
     }
 
     unsigned int nodeCount() const {
@@ -84,6 +202,11 @@ struct BVH {
     std::vector<BVHNode> nodes;
     TriangleMapping indicies;
     unsigned int nextFree;
+
+    // what traversal uses. the quantized node arrays are empty unless that format's been made
+    NodeFormat nodeFormat;
+    QuantizedNodes<uint16_t> quantized16;
+    QuantizedNodes<uint8_t> quantized8;
     
     // a few stats
     unsigned int objectSplits;
@@ -23,12 +23,16 @@ struct CentroidSAHSplitter {
             TrianglePosSet const& triangles,  // in: master triangle array
             TriangleMapping const& indicies,  // in: set of triangle indicies to split 
             AABB const& bounds,               // in: bounds of this set of triangles
+            unsigned int depth,               // in: depth of this node
             TriangleMapping& leftIndicies,    // out: resultant left set
-            TriangleMapping& rightIndicies) { // out: resultant right set
+            TriangleMapping& rightIndicies,   // out: resultant right set
+            unsigned int& axis) {             // out: axis split on, left being the low side
 
         bounds.sanityCheck();
 
-        if(indicies.size() <= 3) 
+        // no fixed leaf size - split as far as the SAH below allows, and let collapseLeaves() size the
+        // leaves afterwards with the real costs
+        if(indicies.size() <= 1) 
             return false;
 
         // get an AABB around all triangle centroids
@@ -41,7 +45,7 @@ struct CentroidSAHSplitter {
         assert(containsAABB(bounds, centroidBounds));
 
         // find longest axis
-        unsigned int axis = centroidBounds.longestAxis();
+        axis = centroidBounds.longestAxis();
 
         // slice parent bounding box into slices along the longest axis
         // and count the triangle centroids in it
@@ -50,7 +54,9 @@ struct CentroidSAHSplitter {
         // for chosen Axis, get high/low coords
         const float low = centroidBounds.low[axis];
         const float high = centroidBounds.high[axis];
-        assert(low < high);
+        // every centroid in the same place (eg duplicated triangles) - nothing to split on
+        if(!(low < high))
+            return false;
         const float sliceWidth = high - low;
 
         for(int const idx : indicies){
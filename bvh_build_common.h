@@ -3,32 +3,88 @@
 #include "aabb.h"
 #include "bvh.h"
 #include "bvh_diag.h"
+#include "mem_stats.h"
 #include "scene.h"
 #include "timer.h"
 
 #include <array>
+#include <cstdlib>
+#include <string>
 
 // this is the common library for building BVHes - the specific builders are now in their own file
 
+// knobs that apply to every build method
+struct BVHBuildOptions {
+    BVHBuildOptions() :
+        treeletIterations(3), collapseLeaves(true), intersectCost(0.0f),
+        sbvhMaxDuplication(2.0f), sbvhSpatialSplitsPerDepth(0), nodeFormat(NodeFormat::Full)
+    {}
+
+    int treeletIterations;          // treelet restructuring passes after the build, 0 for none. see bvh_optimize.h
+    bool collapseLeaves;            // SAH leaf collapsing after that. see bvh_collapse.h
+    float intersectCost;            // triangle test cost relative to a node visit for collapsing, 0 to measure it
+
+    // SBVH only. see SBVHSplitter
+    float sbvhMaxDuplication;       // max triangle references, as a multiple of the triangle count
+    int sbvhSpatialSplitsPerDepth;  // max spatial splits at any one depth, 0 for no limit
+
+    NodeFormat nodeFormat;          // node array traversal uses. see bvh_quantize.h
+};
+
+// parse a multiplier >= 1, eg a duplication factor. returns false if it isn't one
+inline bool parseFactor(std::string const& str, float& val) {
+    char* end = nullptr;
+    float res = strtof(str.c_str(), &end);
+    if(str.empty() || *end != '\0' || !(res >= 1.0f) || res > 1000.0f)
+        return false;
+    val = res;
+    return true;
+}
+
+// parse a leaf collapse setting into @opts: "off", "auto" (measure the costs) or a triangle test cost.
+// returns false if the string isn't one of those
+inline bool parseLeafCollapse(std::string const& str, BVHBuildOptions& opts) {
+    if(str == "off" || str == "auto") {
+        opts.collapseLeaves = (str == "auto");
+        opts.intersectCost = 0.0f;
+        return true;
+    }
+
+    char* end = nullptr;
+    float cost = strtof(str.c_str(), &end);
+    if(str.empty() || *end != '\0' || !(cost > 0.0f) || cost > 1000.0f)
+        return false;
+    opts.collapseLeaves = true;
+    opts.intersectCost = cost;
+    return true;
+}
+
 // general purpose recursive BVH subdivider function
-// @Splitter defines the particular constuction algorithm
+// @Splitter defines the particular constuction algorithm. @splitter is passed along so splitters can
+// keep state (eg budgets) over the whole build
 template <class Splitter>
 void subdivide(
         TrianglePosSet const& triangles, 
         BVH& bvh, 
-        BVHNode& node, 
+        Splitter& splitter,
+        unsigned int nodeIndex, 
+        unsigned int depth,
         TriangleMapping const& fromIndicies) {
     assert(fromIndicies.size() > 0);
 
+    // nodes can grow as children are allocated, so only hold onto this until then
+    BVHNode& node = bvh.nodes[nodeIndex];
+
 //    std::cout << "subdiv total count " << fromIndicies.size();
 
     // the set of triangles in this node is already known, so calculate the bounds now before subdividing
     node.bounds = buildAABBExtrema(triangles, fromIndicies, 0, fromIndicies.size());
 
     TriangleMapping leftIndicies, rightIndicies;
+    unsigned int axis = 0;
 
     // call into the specific splitter function
-    bool didSplit = Splitter::TrySplit(bvh, triangles, fromIndicies, node.bounds, leftIndicies, rightIndicies);
+    bool didSplit = splitter.TrySplit(bvh, triangles, fromIndicies, node.bounds, depth, leftIndicies, rightIndicies, axis);
 
     // if the splitter didn't split, we are creating a leaf.
     if(!didSplit) {
@@ -79,24 +135,34 @@ void subdivide(
         assert(rightIndicies.size() < fromIndicies.size());
 
         // alloc child nodes
-        node.leftFirst = bvh.nextFree;
-        BVHNode& left = bvh.allocNextNode();
-        BVHNode& right = bvh.allocNextNode();
+        unsigned int left = bvh.allocNextNode();
+        unsigned int right = bvh.allocNextNode();
+        bvh.nodes[nodeIndex].setInner(left, axis);
+        assert(right == left + 1);
 
         // recurse
-        subdivide<Splitter>(triangles, bvh, left, leftIndicies);
-        subdivide<Splitter>(triangles, bvh, right, rightIndicies);
+        subdivide<Splitter>(triangles, bvh, splitter, left, depth + 1, leftIndicies);
+        subdivide<Splitter>(triangles, bvh, splitter, right, depth + 1, rightIndicies);
     }
 
     // now we're done, node should be fully setup. check
-    assert(surfaceAreaAABB(node.bounds) > 0.0f);
-    if(node.isLeaf()){
-        assert((node.leftFirst + node.count) <= bvh.indicies.size());
+    assert(surfaceAreaAABB(bvh.nodes[nodeIndex].bounds) > 0.0f);
+    if(bvh.nodes[nodeIndex].isLeaf()){
+        assert((bvh.nodes[nodeIndex].leftFirst + bvh.nodes[nodeIndex].count) <= bvh.indicies.size());
     }
 }
 
+inline void accountBVH(BVH const& bvh) {
+    // nodes past nextFree are allocated but unused
+    setMemoryUsage(MemoryKind::BVHNodes, allocatedBytes(bvh.nodes), (uint64_t)bvh.nextFree * sizeof(BVHNode));
+    setMemoryUsage(MemoryKind::BVHIndicies, allocatedBytes(bvh.indicies), usedBytes(bvh.indicies));
+    setMemoryUsage(MemoryKind::BVHQuantizedNodes,
+                   allocatedBytes(bvh.quantized16.nodes) + allocatedBytes(bvh.quantized8.nodes),
+                   usedBytes(bvh.quantized16.nodes) + usedBytes(bvh.quantized8.nodes));
+}
+
 template<class Splitter>
-inline BVH* buildBVH(Scene& s) {
+inline BVH* buildBVH(Scene& s, Splitter& splitter) {
     BVH* bvh = new BVH(s.primitives.pos.size());
 
     // setup "from" index map
@@ -105,8 +171,18 @@ inline BVH* buildBVH(Scene& s) {
         indicies[i] = i;
 
     // recurse and subdivide
-    subdivide<Splitter>(s.primitives.pos, *bvh, bvh->root(), indicies);
+    subdivide<Splitter>(s.primitives.pos, *bvh, splitter, 0, 0, indicies);
+
+    // record the build's peak before giving back any spare
+    accountBVH(*bvh);
+    bvh->shrinkToFit();
+    accountBVH(*bvh);
     return bvh;
 }
 
-
+// for splitters with no state
+template<class Splitter>
+inline BVH* buildBVH(Scene& s) {
+    Splitter splitter;
+    return buildBVH(s, splitter);
+}
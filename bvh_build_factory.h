@@ -4,33 +4,62 @@
 #include "bvh_build_stupid.h"
 #include "bvh_build_centroid_sah.h"
 #include "bvh_build_sbvh.h"
+#include "bvh_collapse.h"
 #include "bvh_diag.h"
+#include "bvh_optimize.h"
+#include "bvh_quantize.h"
+#include "mem_stats.h"
 
 #include "params.h"
+#include "profile.h"
 #include "timer.h"
 
 #include <iostream>
 
-inline BVH* buildBVH(Scene& s, BVHMethod method) {
+inline BVH* buildBVH(Scene& s, BVHMethod method, BVHBuildOptions const& opts = BVHBuildOptions()) {
     // empty scenes should already be caught
     assert(s.primitives.pos.size() > 0);
     assert(s.primitives.pos.size() == s.primitives.extra.size());
 
+    ProfileZone zone("bvh build");
     Timer t;
     BVH* bvh = nullptr;
 
     switch(method) {
         case BVHMethod::STUPID:       bvh = buildStupidBVH(s);      break;
         case BVHMethod::CENTROID_SAH: bvh = buildCentroidSAHBVH(s); break;
-        case BVHMethod::SBVH:         bvh = buildSBVH(s);           break;
+        case BVHMethod::SBVH:         bvh = buildSBVH(s, opts);     break;
         case BVHMethod::_MAX: assert(false); break; // shouldn't happen
     };
 
     std::cout << "world triangle count " << s.primitives.pos.size() << std::endl;
     std::cout << "BVH build time " << t.sample() << std::endl;
 
-    sanityCheckBVH(*bvh, s.primitives.pos);
-    dumpBVHStats(*bvh, s.primitives.pos);
+    if(opts.treeletIterations > 0)
+        printTreeletStats(optimizeTreelets(*bvh, opts.treeletIterations));
+
+    if(opts.collapseLeaves) {
+        // only measure when there's no cost given
+        TraversalCosts costs;
+        if(opts.intersectCost > 0.0f)
+            costs.intersect = opts.intersectCost;
+        else
+            costs = measuredTraversalCosts();
+        printCollapseStats(collapseLeaves(*bvh, costs));
+        accountBVH(*bvh);
+    }
+
+    // last, as it's a copy of the finished nodes
+    if(opts.nodeFormat != NodeFormat::Full)
+        printQuantizeStats(quantizeBVH(*bvh, opts.nodeFormat));
+
+    {
+        ProfileZone statsZone("bvh stats");
+        sanityCheckBVH(*bvh, s.primitives.pos);
+        dumpBVHStats(*bvh, s.primitives.pos);
+    }
+
+    printMemoryReport("after buildBVH");
 
     return bvh;
 }
@@ -1,9 +1,21 @@
 #pragma once
 
+#include "aabb.h"
+#include "bvh.h"
+#include "bvh_build_common.h"
+#include "utils.h"
+
+#include <array>
+#include <cstdio>
+#include <vector>
+
 // max number of slices (buckets) to test when splitting
-constexpr int SLICES_PER_AXIS = 8;
+constexpr int SLICES_PER_AXIS = 16;
 // alpha value used with excluding spatial splits per section 4.5 of the paper
 constexpr float SBVH_ALPHA = 10e-8f;
+// nodes with at least this many triangle refs evaluate their split axes in parallel. below this it's
+// not worth the thread wakeups
+constexpr unsigned int SBVH_PARALLEL_MIN_REFS = 4096;
 
 enum SplitKind {
     OBJECT,
@@ -92,7 +104,51 @@ std::ostream& operator<<(std::ostream& os, const SplitDecision& d) {
 }
 
 // build an SBVH - that is a Split Bounding Volume Hierachy
+// Spatial splits duplicate triangle references, which on some scenes (eg hair) blows up memory and
+// build time. So they're on a budget: a cap on total references (as a multiple of the triangle
+// count), and optionally a cap on spatial splits at each depth. Once a budget is spent, nodes fall
+// back to object splits. The build is depth first, so a spent reference budget starves the
+// right-hand side of the tree first.
 struct SBVHSplitter {
+    SBVHSplitter(unsigned int triangleCount, BVHBuildOptions const& opts) :
+        triangles(triangleCount),
+        references(triangleCount),
+        maxReferences((uint64_t)(std::max(opts.sbvhMaxDuplication, 1.0f) * triangleCount)),
+        spatialSplitsPerDepth(std::max(opts.sbvhSpatialSplitsPerDepth, 0)),
+        deniedByDuplication(0),
+        deniedByDepth(0)
+    {}
+
+    unsigned int triangles;
+    uint64_t references;                // triangle refs so far, ie triangles + duplicates
+    uint64_t maxReferences;
+    unsigned int spatialSplitsPerDepth; // 0 for no limit
+    std::vector<unsigned int> spatialSplitsAtDepth;
+    unsigned int deniedByDuplication;   // spatial splits that won, but didn't fit the reference budget
+    unsigned int deniedByDepth;         // nodes not offered spatial splits, because their depth's budget was spent
+
+    // can a node at @depth still try a spatial split? not once the reference budget is spent
+    bool spatialAllowed(unsigned int depth) {
+        if(references >= maxReferences)
+            return false;
+        if(spatialSplitsPerDepth > 0 && depth < spatialSplitsAtDepth.size() &&
+           spatialSplitsAtDepth[depth] >= spatialSplitsPerDepth) {
+            deniedByDepth++;
+            return false;
+        }
+        return true;
+    }
+
+    void printStats(BVH const& bvh) const {
+        uint64_t const duplicates = references - triangles;
+        printf("SBVH: %u triangles, %llu references (%llu duplicated, %.3fx, cap %.3fx), %u spatial splits, "
+               "%u object splits\n", triangles, (unsigned long long)references, (unsigned long long)duplicates,
+               triangles ? (double)references / triangles : 0.0, triangles ? (double)maxReferences / triangles : 0.0,
+               bvh.spatialSplits, bvh.objectSplits);
+        printf("SBVH: spatial splits denied - %u over the duplication cap, %u over a depth budget\n",
+               deniedByDuplication, deniedByDepth);
+        std::cout << std::flush;
+    }
 
     // Slice (or bucket) used when trying an Object split
     struct Slice{
@@ -146,8 +202,15 @@ struct SBVHSplitter {
         for(int const idx : indicies) {
             const TrianglePos& tri = triangles[idx];
 
+            // only walk the slices this triangle could be in. float rounding can put that a slice
+            // out either way, so allow one extra each side - the tests below are the real ones
+            int firstSlice = (int)((tri.getMinCoord(axis) - low) / sliceWidth) - 1;
+            int lastSlice = (int)((tri.getMaxCoord(axis) - low) / sliceWidth) + 1;
+            firstSlice = clamp(firstSlice, 0, SLICES_PER_AXIS - 1);
+            lastSlice = clamp(lastSlice, 0, SLICES_PER_AXIS - 1);
+
             // walk across the slices
-            for(int sliceNo = 0; sliceNo < SLICES_PER_AXIS; sliceNo++) {
+            for(int sliceNo = firstSlice; sliceNo <= lastSlice; sliceNo++) {
                 float sliceLow = ((float)sliceNo * sliceWidth) + low;
                 float sliceHigh = sliceLow + sliceWidth;
                 assert(sliceHigh <= (high + EPSILON));
@@ -508,13 +571,15 @@ struct SBVHSplitter {
     }
 
     // main splitter entry point
-    static bool TrySplit(
+    bool TrySplit(
             BVH& bvh,                         // in: bvh root
             TrianglePosSet const& triangles,  // in: master triangle array
             TriangleMapping const& indicies,  // in: set of triangle indicies to split 
             AABB const& extremaBounds,        // in: bounds of this set of triangles
+            unsigned int depth,               // in: depth of this node
             TriangleMapping& leftIndicies,    // out: resultant left set
-            TriangleMapping& rightIndicies) { // out: resultant right set
+            TriangleMapping& rightIndicies,   // out: resultant right set
+            unsigned int& axis) {             // out: axis split on, left being the low side
 
         extremaBounds.sanityCheck();
 
@@ -530,28 +595,38 @@ struct SBVHSplitter {
 
         centroidBounds.sanityCheck();
 
-        SplitDecision bestSpatial;
-
-        // walk the 3 axis, find the lowest cost split
-        // ... give spatial splits a go.
-        for(int axis = 0; axis < 3; axis++) {
-            TrySpatialSplits(triangles, indicies, boundingArea, extremaBounds, axis, bestSpatial);
-        }
+        bool const trySpatial = spatialAllowed(depth);
 
-        bestSpatial.sanityCheck();
+        // walk the 3 axis, find the lowest cost split - spatial splits for jobs 0-2, object splits 
+        // for 3-5. each job has its own decision, and they're merged in order afterwards, so the
+        // result is the same however many threads there are
+        std::array<SplitDecision, 6> decisions;
 
-        SplitDecision bestObject;
+        #pragma omp parallel for schedule(dynamic, 1) if(indicies.size() >= SBVH_PARALLEL_MIN_REFS)
+        for(int job = 0; job < 6; job++) {
+            if(job < 3) {
+                if(trySpatial)
+                    TrySpatialSplits(triangles, indicies, boundingArea, extremaBounds, job, decisions[job]);
+            } else {
+                TryObjectSplits(triangles, indicies, boundingArea, centroidBounds, job - 3, decisions[job]);
+            }
+        }
 
-        // ... try object splits
-        for(int axis = 0; axis < 3; axis++) { 
-            TryObjectSplits(triangles, indicies, boundingArea, centroidBounds, axis, bestObject);
+        SplitDecision bestSpatial, bestObject;
+        for(int job = 0; job < 6; job++) {
+            // a zero length axis leaves its decision empty
+            if(decisions[job].minCost < INFINITY)
+                (job < 3 ? bestSpatial : bestObject).merge(decisions[job]);
         }
 
+        if(trySpatial)
+            bestSpatial.sanityCheck();
         bestObject.sanityCheck();
 
         // find ultimate best split decision..
         SplitDecision best;
-        best.merge(bestSpatial);
+        if(trySpatial)
+            best.merge(bestSpatial);
         best.merge(bestObject);
 
         // check termination heurisic...
@@ -574,8 +649,21 @@ struct SBVHSplitter {
 
             if(ratio > SBVH_ALPHA) {
                 if(DoSpatialSplit(best, extremaBounds, triangles, indicies, leftIndicies, rightIndicies)) {
-                    bvh.spatialSplits++;
-                    return true;
+                    // unsplitting means we only know the real duplication now
+                    uint64_t const added = leftIndicies.size() + rightIndicies.size() - indicies.size();
+                    if(references + added <= maxReferences) {
+                        references += added;
+                        if(depth >= spatialSplitsAtDepth.size())
+                            spatialSplitsAtDepth.resize(depth + 1, 0);
+                        spatialSplitsAtDepth[depth]++;
+                        bvh.spatialSplits++;
+                        axis = best.chosenAxis;
+                        return true;
+                    }
+
+                    deniedByDuplication++;
+                    leftIndicies.clear();
+                    rightIndicies.clear();
                 }
             }
         }
@@ -583,14 +671,17 @@ struct SBVHSplitter {
         bvh.objectSplits++;
 
         DoObjectSplit(bestObject, centroidBounds, triangles, indicies, leftIndicies, rightIndicies);
+        axis = bestObject.chosenAxis;
 
         return true; // yes, we split!
     }
 };
 
-BVH* buildSBVH(Scene& s){
+BVH* buildSBVH(Scene& s, BVHBuildOptions const& opts){
     std::cout << "building SBVH" << std::endl;
-    BVH* bvh = buildBVH<SBVHSplitter>(s);
+    SBVHSplitter splitter(s.primitives.pos.size(), opts);
+    BVH* bvh = buildBVH(s, splitter);
+    splitter.printStats(*bvh);
     return bvh;
 }
 
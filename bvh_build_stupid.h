@@ -13,8 +13,10 @@ struct StupidSplitter {
             TrianglePosSet const& triangles,    // in: master triangle array
             TriangleMapping const& indicies,    // in: set of triangle indicies to split 
             AABB const& bounds,                 // in: bounds of this set of triangles
+            unsigned int depth,                 // in: depth of this node
             TriangleMapping& leftIndicies,      // out: resultant left set
-            TriangleMapping& rightIndicies) {   // out: resultant right set
+            TriangleMapping& rightIndicies,     // out: resultant right set
+            unsigned int& axis) {               // out: axis split on, left being the low side
 
         return false; // stop splitting
     }
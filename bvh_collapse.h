@@ -0,0 +1,231 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh.h"
+#include "bvh_diag.h"
+#include "primitive.h"
+#include "profile.h"
+#include "timer.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+
+// SAH optimal leaf sizing. The builders stop splitting on fixed rules (eg CentroidSAH's 3 triangle
+// minimum), which know nothing about what a node visit costs against a triangle test on this machine.
+// collapseLeaves() walks the finished tree bottom up, and turns any subtree into a single leaf where
+// the SAH says testing all its triangles is cheaper than traversing it - using costs measured by a
+// microbenchmark of the real box and triangle tests, see measuredTraversalCosts().
+
+// leaves bigger than this are never made, whatever the costs say. the leaf loop is scalar, so there's
+// no SIMD width to round to, but a cap stops a cheap triangle test from building huge leaves
+unsigned int const LEAF_COLLAPSE_MAX_TRIANGLES = 16;
+
+// SAH costs, relative to a node visit
+struct TraversalCosts {
+    TraversalCosts() : traversal(1.0f), intersect(1.0f) {}
+
+    float traversal;    // visiting an inner node, ie testing both its children's bounds
+    float intersect;    // testing one triangle
+};
+
+// time box and triangle tests on a small, cache resident set of random rays, boxes and triangles.
+// the best of a few runs is used, to dodge interruptions.
+// Only moller_trumbore is timed, whichever triangle test renders - the tree is built before that's
+// known, and it can be switched afterwards. watertight's cost isn't the same, so neither are its best
+// leaves - use -L <cost> to build for it specifically
+inline TraversalCosts calibrateTraversalCosts() {
+    int const RAYS = 64;
+    int const PRIMS = 256;
+    int const RUNS = 5;
+
+    Rng rng(1337);
+    auto point = [&rng]() { return glm::vec3(rng.floatRange(-1, 1), rng.floatRange(-1, 1), rng.floatRange(-1, 1)); };
+
+    std::vector<Ray> rays;
+    std::vector<PrecomputedRay> rayData;
+    for(int i = 0; i < RAYS; i++) {
+        glm::vec3 dir = glm::normalize(point() + glm::vec3(0.01f));
+        rays.emplace_back(point() * 4.0f, dir, 0, 0);
+        rayData.emplace_back(rays.back(), 0.0f, INFINITY);
+    }
+
+    std::vector<AABB> boxes;
+    std::vector<TrianglePos> tris;
+    for(int i = 0; i < PRIMS; i++) {
+        glm::vec3 a = point(), b = point() * 0.3f;
+        boxes.push_back(AABB(glm::min(a, a + b), glm::max(a, a + b)));
+        tris.emplace_back(a, a + point() * 0.3f, a + point() * 0.3f);
+    }
+
+    // something the optimiser can't see through
+    volatile float sink = 0.0f;
+    float boxTime = INFINITY, triTime = INFINITY;
+
+    for(int run = 0; run < RUNS; run++) {
+        float sum = 0.0f;
+        Timer t;
+        for(int r = 0; r < RAYS; r++)
+            for(auto const& box : boxes)
+                sum += rayIntersectsAABB(box, rayData[r]) < INFINITY ? 1.0f : 0.0f;
+        boxTime = std::min(boxTime, t.sample());
+
+        for(int r = 0; r < RAYS; r++)
+            for(auto const& tri : tris)
+                sum += moller_trumbore(tri, rays[r]) < INFINITY ? 1.0f : 0.0f;
+        triTime = std::min(triTime, t.sample());
+        sink = sink + sum;
+    }
+
+    TraversalCosts res;
+    // a timer too coarse to see either leaves the 1:1 default
+    if(boxTime > 0.0f && triTime > 0.0f) {
+        // a node visit is two box tests
+        res.intersect = clamp(triTime / (2.0f * boxTime), 0.1f, 10.0f);
+    }
+    return res;
+}
+
+// calibrated on first use, then the same for the rest of the run so every build agrees
+inline TraversalCosts const& measuredTraversalCosts() {
+    static TraversalCosts const costs = []() {
+        TraversalCosts c = calibrateTraversalCosts();
+        printf("calibrated SAH costs: traversal %.3f intersect %.3f\n", c.traversal, c.intersect);
+        return c;
+    }();
+    return costs;
+}
+
+struct CollapseStats {
+    CollapseStats() : collapsed(0), nodesBefore(0), nodesAfter(0), sahBefore(0.0f), sahAfter(0.0f), time(0.0f) {}
+
+    unsigned int collapsed;     // subtrees turned into leaves
+    unsigned int nodesBefore, nodesAfter;
+    float sahBefore, sahAfter;  // with the costs collapsed with
+    float time;                 // seconds
+};
+
+// append the triangles of every leaf under @index to @out
+inline void gatherSubtreeTriangles(BVH const& bvh, unsigned int index, TriangleMapping& out) {
+    BVHNode const& node = bvh.getNode(index);
+    if(node.isLeaf()) {
+        out.insert(out.end(), bvh.indicies.begin() + node.first(), bvh.indicies.begin() + node.first() + node.count);
+    } else {
+        gatherSubtreeTriangles(bvh, node.leftIndex(), out);
+        gatherSubtreeTriangles(bvh, node.rightIndex(), out);
+    }
+}
+
+// copy the subtree at @from in @bvh into @to, allocating nodes and indicies depth first like a build
+inline void emitCollapsed(BVH const& bvh, std::vector<bool> const& collapse, unsigned int from,
+                          BVH& to, unsigned int toIndex) {
+    BVHNode const& node = bvh.getNode(from);
+    to.nodes[toIndex].bounds = node.bounds;
+
+    if(node.isLeaf() || collapse[from]) {
+        TriangleMapping tris;
+        gatherSubtreeTriangles(bvh, from, tris);
+        // a split triangle (SBVH) can be in several of the leaves
+        std::sort(tris.begin(), tris.end());
+        tris.erase(std::unique(tris.begin(), tris.end()), tris.end());
+
+        to.nodes[toIndex].leftFirst = to.indicies.size();
+        to.nodes[toIndex].count = tris.size();
+        to.indicies.insert(to.indicies.end(), tris.begin(), tris.end());
+        return;
+    }
+
+    unsigned int left = to.allocNextNode();
+    unsigned int right = to.allocNextNode();
+    assert(right == left + 1);
+    to.nodes[toIndex].setInner(left, node.splitAxis());
+
+    emitCollapsed(bvh, collapse, node.leftIndex(), to, left);
+    emitCollapsed(bvh, collapse, node.rightIndex(), to, right);
+}
+
+// collapse every subtree that's cheaper as a leaf, by the SAH with @costs. the tree is rewritten in
+// depth first order, with no gaps
+inline CollapseStats collapseLeaves(BVH& bvh, TraversalCosts const& costs,
+                                    unsigned int maxLeafSize = LEAF_COLLAPSE_MAX_TRIANGLES) {
+    ProfileZone zone("bvh leaf collapse");
+    Timer t;
+
+    CollapseStats stats;
+    stats.nodesBefore = bvh.nodeCount();
+    stats.sahBefore = calcSAHCost(bvh, costs.traversal, costs.intersect);
+
+    // breadth first order, so walking it backwards sees children before parents
+    std::vector<unsigned int> order(1, 0);
+    for(unsigned int i = 0; i < order.size(); i++) {
+        BVHNode const& node = bvh.getNode(order[i]);
+        if(!node.isLeaf()) {
+            order.push_back(node.leftIndex());
+            order.push_back(node.rightIndex());
+        }
+    }
+
+    // per node: triangle refs under it, and its SAH cost (unnormalised) as things stand
+    std::vector<unsigned int> refs(bvh.nodes.size(), 0);
+    std::vector<float> cost(bvh.nodes.size(), 0.0f);
+    std::vector<bool> collapse(bvh.nodes.size(), false);
+
+    for(auto it = order.rbegin(); it != order.rend(); ++it) {
+        BVHNode const& node = bvh.getNode(*it);
+        float const area = surfaceAreaAABB(node.bounds);
+
+        if(node.isLeaf()) {
+            refs[*it] = node.count;
+            cost[*it] = area * costs.intersect * node.count;
+            continue;
+        }
+
+        // refs counts split triangles more than once, so this can only underestimate the benefit
+        refs[*it] = refs[node.leftIndex()] + refs[node.rightIndex()];
+        cost[*it] = area * costs.traversal + cost[node.leftIndex()] + cost[node.rightIndex()];
+
+        float const leafCost = area * costs.intersect * refs[*it];
+        if(refs[*it] <= maxLeafSize && leafCost <= cost[*it]) {
+            collapse[*it] = true;
+            cost[*it] = leafCost;
+        }
+    }
+
+    // count only the topmost collapses - the ones under them go with them
+    std::vector<unsigned int> stack(1, 0);
+    while(!stack.empty()) {
+        unsigned int const index = stack.back();
+        stack.pop_back();
+
+        BVHNode const& node = bvh.getNode(index);
+        if(collapse[index]) {
+            stats.collapsed++;
+        } else if(!node.isLeaf()) {
+            stack.push_back(node.leftIndex());
+            stack.push_back(node.rightIndex());
+        }
+    }
+
+    if(stats.collapsed > 0) {
+        BVH collapsed(bvh.indicies.size());
+        emitCollapsed(bvh, collapse, 0, collapsed, 0);
+
+        bvh.nodes.swap(collapsed.nodes);
+        bvh.indicies.swap(collapsed.indicies);
+        bvh.nextFree = collapsed.nextFree;
+        bvh.shrinkToFit();
+    }
+
+    stats.nodesAfter = bvh.nodeCount();
+    stats.sahAfter = calcSAHCost(bvh, costs.traversal, costs.intersect);
+    stats.time = t.sample();
+    return stats;
+}
+
+inline void printCollapseStats(CollapseStats const& s) {
+    printf("leaf collapse: %u subtrees collapsed, nodes %u -> %u, SAH %.3f -> %.3f in %.3fs\n",
+           s.collapsed, s.nodesBefore, s.nodesAfter, s.sahBefore, s.sahAfter, s.time);
+    std::cout << std::flush;
+}
@@ -4,6 +4,7 @@
 #include "primitive.h"
 
 #include <iostream>
+#include <string>
 #include <vector>
 
 struct BVHStatsPerLeaf {
@@ -75,85 +76,127 @@ void dumpBVHStats(BVH& bvh, TrianglePosSet const& triangles){
     std::cout << "=========================================================================================\n";
 }
 
-#ifndef NDEBUG
-// recursively check that every node fully contains its child bounds
-void sanityCheckAABBRecurse(BVH const& bvh, BVHNode const& node, TrianglePosSet const& triangles) {
-    if(node.isLeaf()) {
-        // ensure all triangles are inside aabb
-        for(unsigned int i = node.first(); i < (node.first() + node.count); i++) {
-            TrianglePos const& t = triangles[bvh.indicies[i]];
-            assert(containsTriangle(node.bounds, t));
+// SAH cost of the finished tree, ie the expected cost of tracing a random ray that hits the root.
+// Each node costs its traversal (or intersection) cost, weighted by the chance a ray hitting the root
+// also hits the node - ie SA(node)/SA(root). Same unit costs as the builders use (1 per node, 1 per
+// triangle), so the number is comparable between build methods.
+inline float calcSAHCost(BVH const& bvh, float traversalCost = 1.0f, float intersectCost = 1.0f) {
+    float const rootArea = surfaceAreaAABB(bvh.root().bounds);
+    if(rootArea <= 0.0f)
+        return 0.0f;
+
+    float cost = 0.0f;
+    std::vector<unsigned int> stack(1, 0);
+    while(!stack.empty()) {
+        BVHNode const& node = bvh.getNode(stack.back());
+        stack.pop_back();
+
+        float const area = surfaceAreaAABB(node.bounds);
+        if(node.isLeaf()) {
+            cost += area * intersectCost * node.count;
+        } else {
+            cost += area * traversalCost;
+            stack.push_back(node.leftIndex());
+            stack.push_back(node.rightIndex());
         }
     }
-    else {
-        auto const& left = bvh.getNode(node.leftIndex());
-        auto const& right = bvh.getNode(node.rightIndex());
-
-        // check both immediate child bounds fit in our bounds
-        assert(containsAABB(node.bounds, left.bounds));
-        assert(containsAABB(node.bounds, right.bounds));
-
-        sanityCheckAABBRecurse(bvh, left, triangles);
-        sanityCheckAABBRecurse(bvh, right, triangles);
-    }
+    return cost / rootArea;
 }
 
-// walk the whole BVH, explode if the bvh is insane. 
-// should compile out on release builds
-// this is debug only code, it's certainly not especially efficient
-// see also sanityCheck() below for a version that automatically compiles out 
-void doSanityCheckBVH(BVH& bvh, TrianglePosSet const& triangles) {
-    std::cout << "sanity check starting" <<std::endl;
+// check the BVH is sane - triangle refs in range, every triangle referenced, every node reachable
+// exactly once, and every node's bounds containing its children (or its triangles).
+// Each problem found is written to @errors. Unlike sanityCheckBVH() below this is always compiled in,
+// so the tests can run it on release builds.
+inline bool validateBVH(BVH const& bvh, TrianglePosSet const& triangles, std::ostream& errors) {
+    bool ok = true;
+    auto fail = [&](std::string const& what, unsigned int nodeIndex) {
+        errors << "BVH invalid: " << what << " at node " << nodeIndex << "\n";
+        ok = false;
+    };
 
-    // check triangle refs are sane
     for(unsigned int i : bvh.indicies) {
-        assert(i < triangles.size());
+        if(i >= triangles.size()) {
+            fail("triangle ref " + std::to_string(i) + " out of range", 0);
+            return false;
+        }
     }
 
-    assert(bvh.nodes.size() >= bvh.nodeCount() + 1);
-
-    // check root node
-    if (bvh.root().isLeaf()) {
-        assert(bvh.nodeCount() == 1);
+    if(bvh.nodes.size() < bvh.nodeCount() + 1) {
+        fail("node count past the end of the node array", 0);
+        return false;
     }
-    else {
-        // first non-root node should be at 2
-        assert(bvh.root().leftFirst == 2);
-
-        unsigned int triangleCount = 0;
-        // walk nodes
-        for(unsigned int i = 2; i < bvh.nodeCount() + 1; i++) {
-            auto const& node = bvh.getNode(i);
-
-            if(node.isLeaf()) {
-                triangleCount += node.count;
-                assert(node.leftFirst < bvh.indicies.size());
-                assert(node.leftFirst + node.count <= bvh.indicies.size());
-            } 
-            else {
-                assert(node.leftFirst > i);
-                assert(node.leftFirst < bvh.nodeCount() + 2);
+
+    if(bvh.root().isLeaf() && bvh.nodeCount() != 1)
+        fail("leaf root, but more than one node", 0);
+    if(!bvh.root().isLeaf() && bvh.root().leftFirst != 2)
+        fail("first non-root node isn't at 2", 0);
+
+    // walk everything reachable from the root
+    std::vector<bool> seen(bvh.nodes.size(), false);
+    std::vector<bool> referenced(triangles.size(), false);
+    std::vector<unsigned int> stack(1, 0);
+
+    while(!stack.empty()) {
+        unsigned int const index = stack.back();
+        stack.pop_back();
+
+        if(seen[index]) {
+            fail("node reachable twice", index);
+            continue;
+        }
+        seen[index] = true;
+
+        BVHNode const& node = bvh.getNode(index);
+        if(node.isLeaf()) {
+            if(node.first() + node.count > bvh.indicies.size()) {
+                fail("leaf triangle range out of range", index);
+                continue;
+            }
+
+            for(unsigned int i = node.first(); i < node.first() + node.count; i++) {
+                referenced[bvh.indicies[i]] = true;
+
+                // spatial splits clip triangles to their leaf, so this only holds for object splits
+                if(bvh.spatialSplits == 0 && !containsTriangle(node.bounds, triangles[bvh.indicies[i]]))
+                    fail("triangle " + std::to_string(bvh.indicies[i]) + " outside leaf bounds", index);
+            }
+        } else {
+            // children don't have to come after their parent (see optimizeTreelets), but the reachable
+            // twice check above still catches cycles
+            if(node.leftIndex() < 2 || node.rightIndex() > bvh.nodeCount()) {
+                fail("child index out of range", index);
+                continue;
+            }
+
+            if(node.splitAxis() > 2)
+                fail("split axis out of range", index);
+
+            for(unsigned int child : {node.leftIndex(), node.rightIndex()}) {
+                if(!containsAABB(node.bounds, bvh.getNode(child).bounds))
+                    fail("child " + std::to_string(child) + " outside bounds", index);
+                stack.push_back(child);
             }
         }
-        // triangles can be accounted for than once in the bvh. This assert will blow if there's 
-        // some missing. but it's no longer actually sufficient. A triangle could be missing all together and
-        // another double-counted, and this wouldn't find it. Really need to walk the triangle array, and 
-        // search the BVH for every triangle
-        assert(triangleCount >= triangles.size());
-        std::cout << "bvh triangle count " << triangleCount << " triangles " << triangles.size() << std::endl;
     }
 
-    std::cout << "sanity check recursing " <<std::endl;
-
-    sanityCheckAABBRecurse(bvh, bvh.root(), triangles);
+    for(unsigned int i = 0; i < triangles.size(); i++) {
+        if(!referenced[i]) {
+            fail("triangle " + std::to_string(i) + " not in any leaf", 0);
+            break; // one is plenty
+        }
+    }
 
-    std::cout << "sanity check OK" <<std::endl;
+    return ok;
 }
-#endif
 
+// walk the whole BVH, explode if the bvh is insane. 
+// compiles out on release builds - see validateBVH() for a version that doesn't
 void sanityCheckBVH(BVH& bvh, TrianglePosSet const& triangles) {
 #ifndef NDEBUG
-    doSanityCheckBVH(bvh, triangles);
+    std::cout << "sanity check starting" << std::endl;
+    bool ok = validateBVH(bvh, triangles, std::cout);
+    assert(ok);
+    std::cout << "sanity check OK" << std::endl;
 #endif
 }
 
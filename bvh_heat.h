@@ -0,0 +1,299 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// BVH heat map - how often each node is actually visited at render time.
+// While collection is running, the traversal (via NodeHeatCollector, see bvh_traverse.h) counts per node:
+//   visits: the ray's traversal entered the node (ie the parent's bounds test on it passed)
+//   hits:   the ray found an intersection somewhere in the node's subtree
+// Counts go into per-thread arrays (no sharing between threads), which are merged when collection
+// stops. Collection piggybacks on profiling, so profiling has to be switched on too.
+
+struct NodeHeatState {
+    NodeHeatState() : enabled(false), generation(0), nodeCount(0) {}
+
+    bool enabled;
+    unsigned int generation;  // bumped every time collection starts, so threads know to clear
+    size_t nodeCount;
+
+    std::mutex mutex;
+    std::vector<struct ThreadNodeHeat*> live;
+};
+
+inline NodeHeatState& nodeHeatState() {
+    static NodeHeatState state;
+    return state;
+}
+
+struct ThreadNodeHeat {
+    ThreadNodeHeat() : generation(0) {
+        NodeHeatState& s = nodeHeatState();
+        std::unique_lock<std::mutex> lock(s.mutex);
+        s.live.push_back(this);
+    }
+
+    ~ThreadNodeHeat() {
+        // counts from threads that exit mid collection are lost. omp threads stick around, so in
+        // practice this only happens at exit
+        NodeHeatState& s = nodeHeatState();
+        std::unique_lock<std::mutex> lock(s.mutex);
+        s.live.erase(std::find(s.live.begin(), s.live.end(), this));
+    }
+
+    unsigned int generation;
+    std::vector<uint64_t> visits, hits;
+};
+
+inline bool nodeHeatEnabled() {
+    return nodeHeatState().enabled;
+}
+
+// this thread's counts for the current collection
+inline ThreadNodeHeat& threadNodeHeat() {
+    thread_local ThreadNodeHeat heat;
+
+    NodeHeatState const& s = nodeHeatState();
+    if(heat.generation != s.generation) {
+        heat.visits.assign(s.nodeCount, 0);
+        heat.hits.assign(s.nodeCount, 0);
+        heat.generation = s.generation;
+    }
+    return heat;
+}
+
+// merged counts for a whole collection
+struct BVHHeatMap {
+    std::vector<uint64_t> visits, hits;
+};
+
+// only between frames
+inline void startNodeHeat(BVH const& bvh) {
+    NodeHeatState& s = nodeHeatState();
+    std::unique_lock<std::mutex> lock(s.mutex);
+    s.generation++;
+    s.nodeCount = bvh.nodes.size();
+    s.enabled = true;
+}
+
+inline BVHHeatMap stopNodeHeat() {
+    NodeHeatState& s = nodeHeatState();
+    std::unique_lock<std::mutex> lock(s.mutex);
+    s.enabled = false;
+
+    BVHHeatMap res;
+    res.visits.assign(s.nodeCount, 0);
+    res.hits.assign(s.nodeCount, 0);
+
+    for(auto t : s.live) {
+        if(t->generation != s.generation)
+            continue; // didn't take part
+        for(size_t i = 0; i < s.nodeCount; i++) {
+            res.visits[i] += t->visits[i];
+            res.hits[i] += t->hits[i];
+        }
+    }
+    return res;
+}
+
+// per node facts that don't come from the heat map, ie from the tree itself
+struct NodeInfo {
+    NodeInfo() : depth(0), parent(0), subtreeWork(0) {}
+
+    unsigned int depth;
+    unsigned int parent;
+    uint64_t subtreeWork;  // node visits + triangle tests in this subtree
+};
+
+// fills in depth/parent for every reachable node, and subtree work from the heat map
+inline std::vector<NodeInfo> buildNodeInfo(BVH const& bvh, BVHHeatMap const& heat) {
+    std::vector<NodeInfo> info(bvh.nodes.size());
+
+    // breadth first order, so a forward walk sees parents first, and a backward walk sees children first
+    std::vector<unsigned int> order(1, 0);
+    for(unsigned int i = 0; i < order.size(); i++) {
+        BVHNode const& node = bvh.getNode(order[i]);
+        if(node.isLeaf())
+            continue;
+        for(unsigned int child : {node.leftIndex(), node.rightIndex()}) {
+            info[child].depth = info[order[i]].depth + 1;
+            info[child].parent = order[i];
+            order.push_back(child);
+        }
+    }
+
+    for(auto it = order.rbegin(); it != order.rend(); ++it) {
+        BVHNode const& node = bvh.getNode(*it);
+        NodeInfo& ni = info[*it];
+        ni.subtreeWork += heat.visits[*it];
+        if(node.isLeaf())
+            ni.subtreeWork += heat.visits[*it] * node.count;
+        else
+            ni.subtreeWork += info[node.leftIndex()].subtreeWork + info[node.rightIndex()].subtreeWork;
+    }
+
+    return info;
+}
+
+// one line per node: what the SAH expected vs what actually happened
+inline bool writeNodeHeatCsv(std::string const& fname, BVH const& bvh, BVHHeatMap const& heat,
+                             std::vector<NodeInfo> const& info) {
+    std::ofstream out(fname);
+    out << "node,depth,leaf,triangles,surface_area,sah_probability,visits,hits,visit_probability,subtree_work\n";
+
+    float const rootArea = surfaceAreaAABB(bvh.root().bounds);
+    double const rays = std::max<uint64_t>(heat.visits[0], 1);
+
+    for(unsigned int i = 0; i < bvh.nodes.size(); i++) {
+        if(i == 1 || i > bvh.nodeCount())
+            continue; // never allocated
+        BVHNode const& node = bvh.getNode(i);
+        float area = surfaceAreaAABB(node.bounds);
+
+        out << i << "," << info[i].depth << "," << (node.isLeaf() ? 1 : 0) << ",";
+        out << (node.isLeaf() ? node.count : 0) << "," << area << "," << area / rootArea << ",";
+        out << heat.visits[i] << "," << heat.hits[i] << "," << heat.visits[i] / rays << ",";
+        out << info[i].subtreeWork << "\n";
+    }
+
+    if(!out) {
+        std::cout << "ERROR: couldn't write " << fname << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// histogram of visit counts (log2 buckets), and the SAH's predicted cost against the actual cost per
+// ray - in total, and per depth
+inline void printHeatSummary(BVH const& bvh, BVHHeatMap const& heat, std::vector<NodeInfo> const& info) {
+    uint64_t const rays = heat.visits[0];
+    if(rays == 0) {
+        std::cout << "bvh heat: no rays hit the root" << std::endl;
+        return;
+    }
+
+    float const rootArea = surfaceAreaAABB(bvh.root().bounds);
+
+    std::vector<unsigned int> histogram(65, 0);
+    std::vector<double> expectedByDepth, actualByDepth;
+    double expected = 0.0, actual = 0.0;
+    unsigned int coldNodes = 0;
+
+    for(unsigned int i = 0; i <= bvh.nodeCount(); i++) {
+        if(i == 1)
+            continue;
+        BVHNode const& node = bvh.getNode(i);
+
+        // cost in SAH units - 1 per node, 1 per triangle
+        double const cost = node.isLeaf() ? 1.0 + node.count : 1.0;
+        double const e = cost * surfaceAreaAABB(node.bounds) / rootArea;
+        double const a = cost * heat.visits[i] / (double)rays;
+
+        unsigned int const depth = info[i].depth;
+        if(depth >= expectedByDepth.size()) {
+            expectedByDepth.resize(depth + 1, 0.0);
+            actualByDepth.resize(depth + 1, 0.0);
+        }
+        expectedByDepth[depth] += e;
+        actualByDepth[depth] += a;
+        expected += e;
+        actual += a;
+
+        int bucket = 0;
+        for(uint64_t v = heat.visits[i]; v; v >>= 1)
+            bucket++;
+        histogram[bucket]++;
+        if(heat.visits[i] == 0)
+            coldNodes++;
+    }
+
+    std::cout << "bvh heat: " << rays << " rays, " << bvh.nodeCount() << " nodes, " << coldNodes << " never visited\n";
+    std::cout << "visits per node histogram:\n";
+    for(unsigned int b = 0; b < histogram.size(); b++) {
+        if(!histogram[b])
+            continue;
+        uint64_t lo = b ? (1ull << (b - 1)) : 0;
+        uint64_t hi = b ? (1ull << b) - 1 : 0;
+        printf("  %12llu - %-12llu %8u\n", (unsigned long long)lo, (unsigned long long)hi, histogram[b]);
+    }
+
+    printf("cost per ray (SAH units): expected %.3f actual %.3f (ratio %.3f)\n", expected, actual, actual / expected);
+    printf("  depth   expected     actual\n");
+    for(unsigned int d = 0; d < expectedByDepth.size(); d++)
+        printf("  %5u %10.3f %10.3f\n", d, expectedByDepth[d], actualByDepth[d]);
+    std::cout << std::flush;
+}
+
+// the hottest parts of the tree. Starting from the root, repeatedly split the hottest subtree into its
+// children, until there are @count disjoint subtrees. The result is sorted hottest first.
+inline std::vector<unsigned int> findHotSubtrees(BVH const& bvh, std::vector<NodeInfo> const& info, unsigned int count) {
+    std::vector<unsigned int> subtrees(1, 0);
+
+    auto hotter = [&info](unsigned int a, unsigned int b) { return info[a].subtreeWork > info[b].subtreeWork; };
+
+    while(subtrees.size() < count) {
+        std::sort(subtrees.begin(), subtrees.end(), hotter);
+
+        // split the hottest one we can
+        auto it = std::find_if(subtrees.begin(), subtrees.end(),
+                               [&bvh](unsigned int n) { return !bvh.getNode(n).isLeaf(); });
+        if(it == subtrees.end())
+            break; // all leaves
+
+        BVHNode const& node = bvh.getNode(*it);
+        *it = node.leftIndex();
+        subtrees.push_back(node.rightIndex());
+    }
+
+    std::sort(subtrees.begin(), subtrees.end(), hotter);
+    return subtrees;
+}
+
+inline bool writeHotSubtrees(std::string const& fname, BVH const& bvh, std::vector<NodeInfo> const& info,
+                             std::vector<unsigned int> const& subtrees) {
+    std::ofstream out(fname);
+    out << "node,depth,subtree_work,work_share,surface_area,min_x,min_y,min_z,max_x,max_y,max_z\n";
+
+    double const total = std::max<uint64_t>(info[0].subtreeWork, 1);
+    std::cout << "hottest subtrees:\n";
+    for(unsigned int n : subtrees) {
+        BVHNode const& node = bvh.getNode(n);
+        AABB const& b = node.bounds;
+
+        out << n << "," << info[n].depth << "," << info[n].subtreeWork << "," << info[n].subtreeWork / total << ",";
+        out << surfaceAreaAABB(b) << "," << b.low.x << "," << b.low.y << "," << b.low.z << ",";
+        out << b.high.x << "," << b.high.y << "," << b.high.z << "\n";
+
+        printf("  node %8u depth %3u work %5.1f%% bounds ", n, info[n].depth, 100.0 * info[n].subtreeWork / total);
+        std::cout << b << "\n";
+    }
+    std::cout << std::flush;
+
+    if(!out) {
+        std::cout << "ERROR: couldn't write " << fname << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// the whole lot - summary to the console, per node and hot subtree csvs to <prefix>-nodes.csv and
+// <prefix>-hot.csv
+inline bool dumpNodeHeat(std::string const& prefix, BVH const& bvh, BVHHeatMap const& heat, unsigned int hotCount = 16) {
+    std::vector<NodeInfo> info = buildNodeInfo(bvh, heat);
+    printHeatSummary(bvh, heat, info);
+
+    bool ok = writeNodeHeatCsv(prefix + "-nodes.csv", bvh, heat, info);
+    ok = writeHotSubtrees(prefix + "-hot.csv", bvh, info, findHotSubtrees(bvh, info, hotCount)) && ok;
+    if(ok)
+        std::cout << "wrote " << prefix << "-nodes.csv and " << prefix << "-hot.csv" << std::endl;
+    return ok;
+}
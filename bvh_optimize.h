@@ -0,0 +1,280 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh.h"
+#include "bvh_diag.h"
+#include "profile.h"
+#include "timer.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+
+// Post build BVH optimisation - treelet restructuring, after Karras & Aila's TRBVH.
+// The top down builders pick each split greedily, so the tree they make is rarely the best one for
+// the SAH. This takes small treelets (a node, plus its descendants down to up to 7 "treelet leaves",
+// which are whole subtrees) and rebuilds each with the best possible topology over those leaves.
+// The leaves themselves aren't touched, so this works on any builder's output.
+//
+// Only the treelet's internal nodes change, and the sum of their leaves' costs is the same whatever
+// the topology, so the best topology is the one with the smallest total internal node area. With 7
+// leaves that's a cheap dynamic program over the 127 subsets of leaves.
+//
+// Nodes are rewritten in place: a treelet with n leaves has n-1 internal nodes, so n-1 child pairs,
+// and the new topology reuses exactly those pairs. Leaf subtrees are moved by copying their root node
+// (their children stay where they are), so after this nodes are no longer in depth first order.
+
+int const TREELET_MAX_LEAVES = 7;
+int const TREELET_SUBSETS = 1 << TREELET_MAX_LEAVES;
+
+struct Treelet {
+    Treelet() : leafCount(0), internalCount(0) {}
+
+    unsigned int leaves[TREELET_MAX_LEAVES];        // node indices of the leaf subtrees
+    unsigned int internal[TREELET_MAX_LEAVES - 1];  // node indices, the treelet root first
+    int leafCount, internalCount;
+};
+
+// grow a treelet from inner node @root, by repeatedly opening up the leaf with the largest surface
+// area (which is where the SAH says a better topology will help most)
+inline void formTreelet(BVH const& bvh, unsigned int root, Treelet& t) {
+    BVHNode const& rootNode = bvh.getNode(root);
+    assert(!rootNode.isLeaf());
+
+    t.internal[0] = root;
+    t.internalCount = 1;
+    t.leaves[0] = rootNode.leftIndex();
+    t.leaves[1] = rootNode.rightIndex();
+    t.leafCount = 2;
+
+    while(t.leafCount < TREELET_MAX_LEAVES) {
+        int best = -1;
+        float bestArea = -1.0f;
+        for(int i = 0; i < t.leafCount; i++) {
+            BVHNode const& node = bvh.getNode(t.leaves[i]);
+            if(node.isLeaf())
+                continue;
+            float area = surfaceAreaAABB(node.bounds);
+            if(area > bestArea) {
+                bestArea = area;
+                best = i;
+            }
+        }
+        if(best < 0)
+            break; // nothing left to open
+
+        BVHNode const& node = bvh.getNode(t.leaves[best]);
+        t.internal[t.internalCount++] = t.leaves[best];
+        t.leaves[best] = node.leftIndex();
+        t.leaves[t.leafCount++] = node.rightIndex();
+    }
+}
+
+// find the best topology for @t, and if it's better than the current one rewrite the nodes.
+// returns true if the treelet changed
+inline bool restructureTreelet(BVH& bvh, Treelet const& t) {
+    int const n = t.leafCount;
+    if(n < 3)
+        return false; // only one topology
+
+    int const full = (1 << n) - 1;
+    AABB bounds[TREELET_SUBSETS];
+    float cost[TREELET_SUBSETS];   // smallest total internal node area for the subset
+    int split[TREELET_SUBSETS];    // the subset's left child, for that cost
+
+    // bounds of every subset - each is its lowest leaf plus the rest
+    for(int s = 1; s <= full; s++) {
+        int const low = s & -s;
+        if(s == low) {
+            int leaf = 0;
+            while(!(s & (1 << leaf)))
+                leaf++;
+            bounds[s] = bvh.getNode(t.leaves[leaf]).bounds;
+            cost[s] = 0.0f;
+        } else {
+            bounds[s] = unionAABB(bounds[low], bounds[s ^ low]);
+        }
+    }
+
+    // subsets in increasing order, so every proper subset is already done. each partition is only
+    // tried once, by keeping the subset's lowest leaf on the left
+    for(int s = 1; s <= full; s++) {
+        int const low = s & -s;
+        if(s == low)
+            continue;
+
+        float best = INFINITY;
+        int bestSplit = 0;
+        int const rest = s ^ low;
+        // every subset of rest (bar all of it), plus the lowest leaf
+        for(int sub = (rest - 1) & rest; ; sub = (sub - 1) & rest) {
+            int const left = sub | low;
+            float c = cost[left] + cost[s ^ left];
+            if(c < best) {
+                best = c;
+                bestSplit = left;
+            }
+            if(sub == 0)
+                break;
+        }
+        cost[s] = best + surfaceAreaAABB(bounds[s]);
+        split[s] = bestSplit;
+    }
+
+    // the root keeps its own bounds whatever happens, so count the same area for it on both sides
+    float current = surfaceAreaAABB(bounds[full]);
+    for(int i = 1; i < t.internalCount; i++)
+        current += surfaceAreaAABB(bvh.getNode(t.internal[i]).bounds);
+
+    // only bother for a real improvement, or float noise would churn the tree forever
+    if(cost[full] >= current * (1.0f - 1e-5f))
+        return false;
+
+    // everything we need from the old nodes, before they get overwritten
+    BVHNode leafNodes[TREELET_MAX_LEAVES];
+    for(int i = 0; i < n; i++)
+        leafNodes[i] = bvh.getNode(t.leaves[i]);
+
+    // the child pairs to reuse, in index order. handing them out breadth first keeps every internal
+    // node's children after it in the array, like the builders do. the root gets the lowest, so the
+    // root's children stay at 2
+    unsigned int pairs[TREELET_MAX_LEAVES - 1];
+    // insertion sort - there are at most 6
+    for(int i = 0; i < t.internalCount; i++) {
+        unsigned int const pair = bvh.getNode(t.internal[i]).leftIndex();
+        int j = i;
+        for(; j > 0 && pairs[j - 1] > pair; j--)
+            pairs[j] = pairs[j - 1];
+        pairs[j] = pair;
+    }
+
+    struct Pending {
+        int subset;
+        unsigned int index;
+    };
+    Pending queue[TREELET_MAX_LEAVES - 1];
+    int head = 0, tail = 0, nextPair = 0;
+
+    // the root keeps its index and bounds, so its parent doesn't need to know anything happened
+    queue[tail++] = {full, t.internal[0]};
+
+    while(head < tail) {
+        Pending const p = queue[head++];
+        unsigned int const pair = pairs[nextPair++];
+
+        int children[2] = {split[p.subset], p.subset ^ split[p.subset]};
+
+        // there's no split plane any more, so take the axis the children's centres are furthest apart
+        // on, with the low one on the left like the builders
+        glm::vec3 const apart = centroidAABB(bounds[children[1]]) - centroidAABB(bounds[children[0]]);
+        unsigned int const axis = largestElem(glm::abs(apart));
+        if(apart[axis] < 0.0f)
+            std::swap(children[0], children[1]);
+
+        bvh.nodes[p.index].setInner(pair, axis);
+
+        for(int c = 0; c < 2; c++) {
+            int const sub = children[c];
+            if((sub & (sub - 1)) == 0) {
+                int leaf = 0;
+                while(!(sub & (1 << leaf)))
+                    leaf++;
+                bvh.nodes[pair + c] = leafNodes[leaf];
+            } else {
+                // made an inner node when it comes off the queue
+                bvh.nodes[pair + c].bounds = bounds[sub];
+                queue[tail++] = {sub, pair + c};
+            }
+        }
+    }
+    assert(nextPair == t.internalCount);
+    return true;
+}
+
+// depth of every reachable node
+inline std::vector<unsigned int> nodeDepths(BVH const& bvh) {
+    std::vector<unsigned int> depth(bvh.nodes.size(), 0);
+    std::vector<unsigned int> stack(1, 0);
+    while(!stack.empty()) {
+        unsigned int const index = stack.back();
+        stack.pop_back();
+
+        BVHNode const& node = bvh.getNode(index);
+        if(node.isLeaf())
+            continue;
+        for(unsigned int child : {node.leftIndex(), node.rightIndex()}) {
+            depth[child] = depth[index] + 1;
+            stack.push_back(child);
+        }
+    }
+    return depth;
+}
+
+struct TreeletStats {
+    TreeletStats() : iterations(0), treelets(0), restructured(0), sahBefore(0.0f), sahAfter(0.0f), time(0.0f) {}
+
+    unsigned int iterations;    // actually done
+    unsigned int treelets;      // treelets looked at
+    unsigned int restructured;  // treelets that got a better topology
+    float sahBefore, sahAfter;
+    float time;                 // seconds
+};
+
+// restructure every treelet in @bvh, @iterations times over.
+// A treelet's internal nodes span at most TREELET_MAX_LEAVES-1 levels below its root, and it only
+// writes to those, so treelets whose roots are TREELET_MAX_LEAVES levels apart never touch each
+// other's nodes. Each iteration is done in that many rounds, one per depth modulo TREELET_MAX_LEAVES,
+// and the treelets within a round are done in parallel.
+// Stops early once an iteration doesn't improve anything.
+inline TreeletStats optimizeTreelets(BVH& bvh, int iterations) {
+    ProfileZone zone("bvh treelet optimize");
+    Timer t;
+
+    TreeletStats stats;
+    stats.sahBefore = calcSAHCost(bvh);
+
+    for(int it = 0; it < iterations && !bvh.root().isLeaf(); it++) {
+        unsigned int changed = 0;
+        stats.iterations++;
+
+        for(int round = TREELET_MAX_LEAVES - 1; round >= 0; round--) {
+            // depths move as treelets are restructured, so recalculate every round
+            std::vector<unsigned int> depth = nodeDepths(bvh);
+
+            std::vector<unsigned int> roots;
+            for(unsigned int i = 0; i <= bvh.nodeCount(); i++) {
+                if(i != 1 && !bvh.nodes[i].isLeaf() && depth[i] % TREELET_MAX_LEAVES == (unsigned int)round)
+                    roots.push_back(i);
+            }
+
+            unsigned int roundChanged = 0;
+            #pragma omp parallel for schedule(dynamic, 64) reduction(+:roundChanged)
+            for(int r = 0; r < (int)roots.size(); r++) {
+                Treelet treelet;
+                formTreelet(bvh, roots[r], treelet);
+                if(restructureTreelet(bvh, treelet))
+                    roundChanged++;
+            }
+
+            stats.treelets += roots.size();
+            changed += roundChanged;
+        }
+
+        stats.restructured += changed;
+        if(changed == 0)
+            break; // converged, more iterations won't do anything
+    }
+
+    stats.sahAfter = calcSAHCost(bvh);
+    stats.time = t.sample();
+    return stats;
+}
+
+inline void printTreeletStats(TreeletStats const& s) {
+    float const reduction = s.sahBefore > 0.0f ? 100.0f * (s.sahBefore - s.sahAfter) / s.sahBefore : 0.0f;
+    printf("treelet optimize: %u iterations, %u of %u treelets restructured, SAH %.3f -> %.3f (-%.2f%%) in %.3fs\n",
+           s.iterations, s.restructured, s.treelets, s.sahBefore, s.sahAfter, reduction, s.time);
+    std::cout << std::flush;
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh.h"
+#include "bvh_build_common.h"
+#include "mem_stats.h"
+#include "profile.h"
+#include "timer.h"
+#include "utils.h"
+
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+
+// Quantized (compressed) BVH nodes - see QuantizedBVHNode in bvh.h.
+// Each node's bounds are stored in 8 or 16 bits per coordinate relative to its parent's bounds, which
+// traversal already has in hand when it gets to the node, so it can dequantize on the fly. That halves
+// (8 bit) or nearly halves (16 bit) the bytes traversal pulls through the cache per node, at the cost
+// of a little bounds inflation and a few extra flops per child.
+
+struct QuantizeStats {
+    QuantizeStats() : format(NodeFormat::Full), fullBytes(0), quantizedBytes(0), areaInflation(1.0), time(0.0f) {}
+
+    NodeFormat format;
+    uint64_t fullBytes, quantizedBytes;
+    double areaInflation;   // total dequantized surface area over the total real surface area
+    float time;             // seconds
+};
+
+// the smallest level whose dequantized low bound is still <= @low
+template<class Q>
+inline Q quantizeLow(float low, float parentLow, float parentHigh) {
+    unsigned int const levels = QuantizedBVHNode<Q>::LEVELS;
+    float const scale = (parentHigh - parentLow) * (1.0f / levels);
+    if(!(scale > 0.0f))
+        return 0;
+
+    // one level of slack, then walk down until it really is conservative. level 0 is exact
+    int q = clamp((int)floorf((low - parentLow) / scale) - 1, 0, (int)levels);
+    while(q > 0 && parentLow + q * scale > low)
+        q--;
+    return (Q)q;
+}
+
+// the same for the high bound, counted down from the parent's high bound
+template<class Q>
+inline Q quantizeHigh(float high, float parentLow, float parentHigh) {
+    unsigned int const levels = QuantizedBVHNode<Q>::LEVELS;
+    float const scale = (parentHigh - parentLow) * (1.0f / levels);
+    if(!(scale > 0.0f))
+        return (Q)levels;
+
+    int down = clamp((int)floorf((parentHigh - high) / scale) - 1, 0, (int)levels);
+    while(down > 0 && parentHigh - down * scale < high)
+        down--;
+    return (Q)(levels - down);
+}
+
+template<class Q>
+inline void quantizeRecurse(BVH const& bvh, unsigned int index, AABB const& parent, QuantizedNodes<Q>& out,
+                            double& fullArea, double& quantizedArea) {
+    BVHNode const& node = bvh.getNode(index);
+    QuantizedBVHNode<Q>& q = out.nodes[index];
+    q.leftFirst = node.leftFirst;
+    q.count = node.count;
+
+    for(int axis = 0; axis < 3; axis++) {
+        q.lo[axis] = quantizeLow<Q>(node.bounds.low[axis], parent.low[axis], parent.high[axis]);
+        q.hi[axis] = quantizeHigh<Q>(node.bounds.high[axis], parent.low[axis], parent.high[axis]);
+    }
+
+    // exactly what traversal will see
+    AABB const bounds = (index == 0) ? parent : q.dequantize(parent);
+    assert(containsAABB(bounds, node.bounds));
+
+    fullArea += surfaceAreaAABB(node.bounds);
+    quantizedArea += surfaceAreaAABB(bounds);
+
+    if(!node.isLeaf()) {
+        quantizeRecurse(bvh, node.leftIndex(), bounds, out, fullArea, quantizedArea);
+        quantizeRecurse(bvh, node.rightIndex(), bounds, out, fullArea, quantizedArea);
+    }
+}
+
+template<class Q>
+inline double quantizeNodes(BVH const& bvh, QuantizedNodes<Q>& out) {
+    out.rootBounds = bvh.root().bounds;
+    out.nodes.assign(bvh.nodes.size(), QuantizedBVHNode<Q>());
+
+    double fullArea = 0.0, quantizedArea = 0.0;
+    quantizeRecurse(bvh, 0, out.rootBounds, out, fullArea, quantizedArea);
+    return fullArea > 0.0 ? quantizedArea / fullArea : 1.0;
+}
+
+// make @format's nodes from the full nodes, and switch traversal over to them. Full just switches back.
+// the other formats' nodes are dropped
+inline QuantizeStats quantizeBVH(BVH& bvh, NodeFormat format) {
+    ProfileZone zone("bvh quantize");
+    Timer t;
+
+    QuantizeStats stats;
+    stats.format = format;
+    stats.fullBytes = usedBytes(bvh.nodes);
+
+    bvh.quantized16 = QuantizedNodes<uint16_t>();
+    bvh.quantized8 = QuantizedNodes<uint8_t>();
+
+    switch(format) {
+        case NodeFormat::Full:
+            stats.quantizedBytes = stats.fullBytes;
+            break;
+        case NodeFormat::Quantized16:
+            stats.areaInflation = quantizeNodes(bvh, bvh.quantized16);
+            stats.quantizedBytes = usedBytes(bvh.quantized16.nodes);
+            break;
+        case NodeFormat::Quantized8:
+            stats.areaInflation = quantizeNodes(bvh, bvh.quantized8);
+            stats.quantizedBytes = usedBytes(bvh.quantized8.nodes);
+            break;
+        case NodeFormat::_MAX: assert(false); break;
+    }
+
+    bvh.nodeFormat = format;
+    accountBVH(bvh);
+
+    stats.time = t.sample();
+    return stats;
+}
+
+inline void printQuantizeStats(QuantizeStats const& s) {
+    printf("quantized nodes (%s): %.2f MiB, against %.2f MiB full (%.1f%%), surface area inflation %.2f%% in %.3fs\n",
+           GetNodeFormatStr(s.format), s.quantizedBytes / (1024.0 * 1024.0), s.fullBytes / (1024.0 * 1024.0),
+           s.fullBytes ? 100.0 * s.quantizedBytes / s.fullBytes : 0.0, 100.0 * (s.areaInflation - 1.0), s.time);
+    std::cout << std::flush;
+}
@@ -2,25 +2,13 @@
 
 #include "aabb.h"
 #include "bvh.h"
+#include "bvh_heat.h"
 #include "primitive.h"
+#include "ray_record.h"
+#include "profile.h"
 
 #include "glm/vec3.hpp"
 
-// minimal intersection result
-// note: if dist == INFINITY, triangle is undefined.
-struct MiniIntersection {
-    MiniIntersection(float _distance, int _triangle) : distance(_distance), triangle(_triangle) {}
-    MiniIntersection() : distance(INFINITY) {} 
-
-    // did we hit something? if so, triangle should be defined
-    bool hit() const {
-        return (distance < INFINITY);
-    }
-
-    float distance;         // dist to intersection 
-    unsigned int triangle;  // triangle number
-};
-
 // used to visualise which node/bounds we intersected with
 struct DiagnosticCollector {
     DiagnosticCollector() : 
@@ -47,6 +35,10 @@ struct DiagnosticCollector {
         nodeIndex = n;
     }
 
+    // per node hooks, only used for the heat map - see NodeHeatCollector
+    void visitNode(unsigned int n) {}
+    void hitNode(unsigned int n) {}
+
     // accumulate stats from a child node
     // these stats refer to every node visited
     void combineStats(DiagnosticCollector const& other) {
@@ -71,6 +63,17 @@ struct DiagnosticCollector {
     unsigned int leafDepth;          // depth of the leaf node with which we ultimately intersected
 };
 
+// the usual diagnostics, plus per node visit/hit counts into this thread's heat map (see bvh_heat.h)
+struct NodeHeatCollector : DiagnosticCollector {
+    void visitNode(unsigned int n) {
+        threadNodeHeat().visits[n]++;
+    }
+
+    void hitNode(unsigned int n) {
+        threadNodeHeat().hits[n]++;
+    }
+};
+
 // used when we don't care for stats - all code should magically compile away
 struct NullCollector {
     static void incSplitsTraversed() {}
@@ -78,6 +81,8 @@ struct NullCollector {
     static void incLeavesChecked() {}
     static void incLeafDepth() {}
     static void setNodeIndex(unsigned int nodeIndex) {}
+    static void visitNode(unsigned int nodeIndex) {}
+    static void hitNode(unsigned int nodeIndex) {}
     static void combineStats(NullCollector const& other) {}
     static void combineSelection(NullCollector const& other) {}
 };
@@ -87,25 +92,90 @@ enum class IntersectMode{
     ANY
 };
 
+// the leaf's ray/triangle test, per TriangleTest. made once per ray at the top of the tree walk, so
+// anything that only depends on the ray is only worked out once
+
+struct MollerTrumboreTester {
+    MollerTrumboreTester(Ray const& ray) {}
+
+    float operator()(TrianglePos const& tri, Ray const& ray, float& u, float& v) const {
+        return moller_trumbore(tri, ray, u, v);
+    }
+};
+
+struct WatertightTester {
+    WatertightTester(Ray const& ray) : pre(ray) {}
+
+    float operator()(TrianglePos const& tri, Ray const& ray, float& u, float& v) const {
+        return watertight(tri, ray, pre, u, v);
+    }
+
+    WatertightRay pre;
+};
+
+// traversal reads nodes through one of these, so the same code runs on every NodeFormat.
+// bounds() is given the parent's bounds, which quantized nodes are stored relative to
+
+struct FullNodeSet {
+    FullNodeSet(BVH const& _bvh) : bvh(_bvh) {}
+
+    AABB const& rootBounds() const {
+        return bvh.root().bounds;
+    }
+
+    AABB const& bounds(unsigned int index, AABB const& parent) const {
+        return bvh.getNode(index).bounds;
+    }
+
+    BVHNode const& node(unsigned int index) const {
+        return bvh.getNode(index);
+    }
+
+    BVH const& bvh;
+};
+
+template<class Q>
+struct QuantizedNodeSet {
+    QuantizedNodeSet(QuantizedNodes<Q> const& _quantized) : quantized(_quantized) {}
+
+    AABB const& rootBounds() const {
+        return quantized.rootBounds;
+    }
+
+    AABB bounds(unsigned int index, AABB const& parent) const {
+        assert(index < quantized.nodes.size());
+        return quantized.nodes[index].dequantize(parent);
+    }
+
+    QuantizedBVHNode<Q> const& node(unsigned int index) const {
+        assert(index < quantized.nodes.size());
+        return quantized.nodes[index];
+    }
+
+    QuantizedNodes<Q> const& quantized;
+};
+
 
 // for a given BVH leaf node, traverse the triangles and find a hit per IntersectMode
-template<IntersectMode MODE, class DiagType>
+template<IntersectMode MODE, class NodeSet, class Tester, class DiagType>
 MiniIntersection traverseTriangles(
         BVH const& bvh, 
+        NodeSet const& nodes,
         unsigned int nodeIndex, 
+        AABB const& bounds,
         Primitives const& prims, 
         Ray const& ray,
-        glm::vec3 const& rayInvDir,
-        float const maxDist,
+        PrecomputedRay& rayData,
+        Tester const& tester,
         DiagType& diag) {
 
     diag.incLeavesChecked();
 
-    BVHNode const& node = bvh.getNode(nodeIndex);
+    auto const& node = nodes.node(nodeIndex);
     assert(node.isLeaf());
 
     // parent should perform bounds check.
-    assert(rayIntersectsAABB(node.bounds, ray.origin, rayInvDir) < INFINITY);
+    assert(rayIntersectsAABB(bounds, PrecomputedRay(ray, rayData.tmin, INFINITY)) < INFINITY);
 
     MiniIntersection hit; 
 
@@ -115,60 +185,94 @@ MiniIntersection traverseTriangles(
         assert(i < bvh.indicies.size());
         unsigned int triangleIndex = bvh.indicies[i];
         TrianglePos const& t = prims.pos[triangleIndex];
-        float distance = moller_trumbore(t, ray);
+        float u = 0.f, v = 0.f;
+        float distance = tester(t, ray, u, v);
 
         if (MODE==IntersectMode::ANY){ // if checking for any intersection whatsoever
-            if(distance > 0 && distance < maxDist){
+            if(distance > 0 && distance < rayData.tmax){
                 diag.setNodeIndex(nodeIndex);
                 hit.distance = distance;
                 hit.triangle = triangleIndex;
+                hit.u = u;
+                hit.v = v;
                 return hit; // early out!
             }
         }else{ // if we want to find the closest intersection
-            if(distance > 0 && distance < hit.distance) {
+            // tmax is the closest hit anywhere so far - anything further is no use, here or later
+            if(distance > 0 && distance < rayData.tmax) {
                 diag.setNodeIndex(nodeIndex);
                 hit.distance = distance;
                 hit.triangle = triangleIndex;
+                hit.u = u;
+                hit.v = v;
+                rayData.tmax = distance;
             }
         }
     }
     return hit;
 }
 
-template<IntersectMode MODE, TraversalMode TRAV, class DiagType>
+template<IntersectMode MODE, TraversalMode TRAV, class NodeSet, class Tester, class DiagType>
 MiniIntersection traverseBVH(
         BVH const& bvh, 
+        NodeSet const& nodes,
         unsigned int nodeIndex, 
+        AABB const& bounds,
         Primitives const& prims, 
         Ray const& ray,
-        glm::vec3 const& rayInvDir,
-        float const maxDist,
+        PrecomputedRay& rayData,
+        Tester const& tester,
+        DiagType& diag);
+
+// the work for a single node - see traverseBVH below
+template<IntersectMode MODE, TraversalMode TRAV, class NodeSet, class Tester, class DiagType>
+MiniIntersection traverseBVHNode(
+        BVH const& bvh, 
+        NodeSet const& nodes,
+        unsigned int nodeIndex, 
+        AABB const& bounds,
+        Primitives const& prims, 
+        Ray const& ray,
+        PrecomputedRay& rayData,
+        Tester const& tester,
         DiagType& diag) {
-    auto const& node = bvh.getNode(nodeIndex);
+    auto const& node = nodes.node(nodeIndex);
 
     // parent should perform bounds check before calling us
-    assert(rayIntersectsAABB(node.bounds, ray.origin, rayInvDir) < INFINITY);
+    assert(rayIntersectsAABB(bounds, PrecomputedRay(ray, rayData.tmin, INFINITY)) < INFINITY);
 
     if(node.isLeaf()) {
         // at a leaf - walk triangles and test for a hit.
-        return traverseTriangles<MODE>(bvh, nodeIndex, prims, ray, rayInvDir, maxDist, diag);
+        return traverseTriangles<MODE>(bvh, nodes, nodeIndex, bounds, prims, ray, rayData, tester, diag);
     }
 
     diag.incSplitsTraversed();
 
-    // ordered / non-ordered traversal?
-    if (TRAV==TraversalMode::Ordered){
-        // ordered traversal
-        glm::vec3 leftCentroid  = centroidAABB(bvh.getNode(node.leftIndex()).bounds);
-        glm::vec3 rightCentroid = centroidAABB(bvh.getNode(node.rightIndex()).bounds);
+    // a reference for full nodes, dequantized copies for quantized ones
+    auto const& leftBounds = nodes.bounds(node.leftIndex(), bounds);
+    auto const& rightBounds = nodes.bounds(node.rightIndex(), bounds);
 
-        // find the biggest axis
-        glm::vec3 lengths = glm::abs(leftCentroid - rightCentroid);
-        int axis = largestElem(lengths);
+    // both children's boxes in one go
+    float distLeftAABB, distRightAABB;
+    rayIntersectsAABBPair(leftBounds, rightBounds, rayData, distLeftAABB, distRightAABB);
+
+    // ordered / non-ordered traversal?
+    if (TRAV!=TraversalMode::Unordered){
+        // ordered traversal, close child first
+        bool left_closer;
+        if(TRAV==TraversalMode::Ordered) {
+            // the builder left the split axis in the node, with the left child on the low side, so the
+            // ray's sign on that axis says which is in front - nothing more to load
+            left_closer = rayData.invDir[node.splitAxis()] >= 0.f;
+        } else {
+            // whichever box the ray enters first
+            left_closer = distLeftAABB <= distRightAABB;
+        }
 
-        bool left_closer = ray.direction[axis] > 0.f;
         int closeIndex  = left_closer?node.leftIndex():node.rightIndex();
         int farIndex = left_closer?node.rightIndex():node.leftIndex();
+        AABB const& closeBounds = left_closer?leftBounds:rightBounds;
+        AABB const& farBounds = left_closer?rightBounds:leftBounds;
 
         // ok we'll now call the 2 AABBs close and far - which doesn't nescessarily mean which one contains
         // our nearest intersection
@@ -176,27 +280,26 @@ MiniIntersection traverseBVH(
         DiagType diagClose, diagFar;
         MiniIntersection closeHit, farHit;
 
-        // get distance to far AABB
-        float distCloseAABB = rayIntersectsAABB(bvh.getNode(closeIndex).bounds, ray.origin, rayInvDir);
-        float distFarAABB = rayIntersectsAABB(bvh.getNode(farIndex).bounds, ray.origin, rayInvDir);
+        float distCloseAABB = left_closer?distLeftAABB:distRightAABB;
+        float distFarAABB = left_closer?distRightAABB:distLeftAABB;
 
         // intersects with close bounds?
         if(distCloseAABB < INFINITY) {
             // find intersection in close node.
-            closeHit = traverseBVH<MODE,TRAV>(bvh, closeIndex, prims, ray, rayInvDir, maxDist, diagClose);
+            closeHit = traverseBVH<MODE,TRAV>(bvh, nodes, closeIndex, closeBounds, prims, ray, rayData, tester, diagClose);
             diag.combineStats(diagClose);
 
-            // if closest intersection is closer than the far aabb, we win
+            // any hit will do, or the closest intersection is closer than the far aabb.
             // Note that this also covers the case that distFarAABB == INFINITY
-            if(closeHit.distance < distFarAABB){
+            if(closeHit.hit() && (MODE==IntersectMode::ANY || closeHit.distance < distFarAABB)){
                 diag.combineSelection(diagClose);
                 return closeHit;
             }
         }
 
-        // intersects with far bounds?
-        if(distFarAABB < INFINITY) {
-            farHit = traverseBVH<MODE,TRAV>(bvh, farIndex, prims, ray, rayInvDir, maxDist, diagFar);
+        // intersects with far bounds? (closer than any hit in the close one, which pulled tmax in)
+        if(distFarAABB < INFINITY && distFarAABB <= rayData.tmax) {
+            farHit = traverseBVH<MODE,TRAV>(bvh, nodes, farIndex, farBounds, prims, ray, rayData, tester, diagFar);
             diag.combineStats(diagFar);
 
             if(closeHit.distance < farHit.distance) {
@@ -208,6 +311,11 @@ MiniIntersection traverseBVH(
             }
         }
 
+        if(closeHit.hit()) {
+            diag.combineSelection(diagClose);
+            return closeHit;
+        }
+
         return MiniIntersection(); // complete miss
     }else{ 
         // unordered traversal
@@ -215,13 +323,14 @@ MiniIntersection traverseBVH(
         MiniIntersection hitLeft, hitRight;
         DiagType diagLeft, diagRight;
 
-        if(rayIntersectsAABB(bvh.getNode(node.leftIndex()).bounds, ray.origin, rayInvDir) < INFINITY) {
-            hitLeft = traverseBVH<MODE,TRAV>(bvh, node.leftIndex(), prims, ray, rayInvDir, maxDist, diagLeft);
+        if(distLeftAABB < INFINITY) {
+            hitLeft = traverseBVH<MODE,TRAV>(bvh, nodes, node.leftIndex(), leftBounds, prims, ray, rayData, tester, diagLeft);
             diag.combineStats(diagLeft);
         }
 
-        if(rayIntersectsAABB(bvh.getNode(node.rightIndex()).bounds, ray.origin, rayInvDir) < INFINITY) {
-            hitRight = traverseBVH<MODE,TRAV>(bvh, node.rightIndex(), prims, ray, rayInvDir, maxDist, diagRight);
+        // a hit on the left may have pulled tmax in past the right box
+        if(distRightAABB < INFINITY && distRightAABB <= rayData.tmax) {
+            hitRight = traverseBVH<MODE,TRAV>(bvh, nodes, node.rightIndex(), rightBounds, prims, ray, rayData, tester, diagRight);
             diag.combineStats(diagRight);
         }
 
@@ -240,48 +349,149 @@ MiniIntersection traverseBVH(
     }
 }
 
-// entry point for the main tree walk
-template<IntersectMode MODE, TraversalMode TRAV, class DiagnosticCollectorType>
+// recursive tree walk, from @nodeIndex down
+template<IntersectMode MODE, TraversalMode TRAV, class NodeSet, class Tester, class DiagType>
 MiniIntersection traverseBVH(
         BVH const& bvh, 
+        NodeSet const& nodes,
+        unsigned int nodeIndex, 
+        AABB const& bounds,
+        Primitives const& prims, 
+        Ray const& ray,
+        PrecomputedRay& rayData,
+        Tester const& tester,
+        DiagType& diag) {
+    diag.visitNode(nodeIndex);
+
+    MiniIntersection hit = traverseBVHNode<MODE,TRAV>(bvh, nodes, nodeIndex, bounds, prims, ray, rayData, tester, diag);
+    if(hit.hit())
+        diag.hitNode(nodeIndex);
+    return hit;
+}
+
+// the tree walk from the root, on a particular node array
+template<IntersectMode MODE, TraversalMode TRAV, class NodeSet, class Tester, class DiagnosticCollectorType>
+MiniIntersection traverseBVHRoot(
+        BVH const& bvh, 
+        NodeSet const& nodes,
         Primitives const& primitives, 
         Ray const& ray,
-        float const maxDist,
+        PrecomputedRay& rayData,
+        Tester const& tester,
         DiagnosticCollectorType& diag) {
 
-    // calculate 1/direction here once, as it's used repeatedly throughout the recursive chain
-    glm::vec3 rayInvDir(1.0f/ray.direction[0], 1.0f/ray.direction[1], 1.0f/ray.direction[2]);
-
-    BVHNode const& node = bvh.getNode(0);
+    AABB const& bounds = nodes.rootBounds();
 
-    if(rayIntersectsAABB(node.bounds, ray.origin, rayInvDir) < INFINITY)
-        return traverseBVH<MODE,TRAV>(bvh, 0, primitives, ray, rayInvDir, maxDist, diag);
+    if(rayIntersectsAABB(bounds, rayData) < INFINITY)
+        return traverseBVH<MODE,TRAV>(bvh, nodes, 0, bounds, primitives, ray, rayData, tester, diag);
 
     // missed bounds all together
     return MiniIntersection();
 }
 
+// entry point for the main tree walk
+template<IntersectMode MODE, TraversalMode TRAV, class Tester, class DiagnosticCollectorType>
+MiniIntersection traverseBVH(
+        BVH const& bvh, 
+        Primitives const& primitives, 
+        Ray const& ray,
+        float const maxDist,
+        DiagnosticCollectorType& diag) {
+
+    countRay(ray.kind);
+    if(rayRecordingEnabled())
+        recordRay(ray, maxDist, MODE == IntersectMode::ANY);
+
+    // calculate 1/direction etc here once, as it's used repeatedly throughout the recursive chain.
+    // closest hit queries start with the whole ray, and pull tmax in as they find hits
+    PrecomputedRay rayData(ray, 0.0f, MODE == IntersectMode::ANY ? maxDist : INFINITY);
+    // and the same for the triangle test's per ray setup
+    Tester const tester(ray);
+
+    switch(bvh.nodeFormat) {
+        case NodeFormat::Quantized16:
+            return traverseBVHRoot<MODE,TRAV>(bvh, QuantizedNodeSet<uint16_t>(bvh.quantized16), primitives, ray, rayData, tester, diag);
+        case NodeFormat::Quantized8:
+            return traverseBVHRoot<MODE,TRAV>(bvh, QuantizedNodeSet<uint8_t>(bvh.quantized8), primitives, ray, rayData, tester, diag);
+        default:
+            return traverseBVHRoot<MODE,TRAV>(bvh, FullNodeSet(bvh), primitives, ray, rayData, tester, diag);
+    }
+}
+
+// pick the traverseBVH instance for the runtime traversal mode and triangle test
+template<IntersectMode MODE, class DiagnosticCollectorType>
+MiniIntersection traverseBVH(
+        BVH const& bvh, 
+        Primitives const& primitives, 
+        Ray const& ray,
+        float const maxDist,
+        DiagnosticCollectorType& diag,
+        TraversalMode traversalMode,
+        TriangleTest triangleTest) {
+
+    if(triangleTest == TriangleTest::Watertight) {
+        switch(traversalMode) {
+            case TraversalMode::Unordered:
+                return traverseBVH<MODE, TraversalMode::Unordered, WatertightTester>(bvh, primitives, ray, maxDist, diag);
+            case TraversalMode::Distance:
+                return traverseBVH<MODE, TraversalMode::Distance, WatertightTester>(bvh, primitives, ray, maxDist, diag);
+            default:
+                return traverseBVH<MODE, TraversalMode::Ordered, WatertightTester>(bvh, primitives, ray, maxDist, diag);
+        }
+    }
+
+    switch(traversalMode) {
+        case TraversalMode::Unordered:
+            return traverseBVH<MODE, TraversalMode::Unordered, MollerTrumboreTester>(bvh, primitives, ray, maxDist, diag);
+        case TraversalMode::Distance:
+            return traverseBVH<MODE, TraversalMode::Distance, MollerTrumboreTester>(bvh, primitives, ray, maxDist, diag);
+        default:
+            return traverseBVH<MODE, TraversalMode::Ordered, MollerTrumboreTester>(bvh, primitives, ray, maxDist, diag);
+    }
+}
+
 template<class DiagnosticCollectorType>
 MiniIntersection findClosestIntersectionBVH(
         BVH const& bvh, 
         Primitives const& primitives, 
         Ray const& ray,
         DiagnosticCollectorType& diag,
-        TraversalMode traversalMode) {
+        TraversalMode traversalMode,
+        TriangleTest triangleTest) {
 
-    return (traversalMode==TraversalMode::Unordered) ?
-        traverseBVH<IntersectMode::CLOSEST, TraversalMode::Unordered>(bvh, primitives, ray, 0.f, diag) :
-        traverseBVH<IntersectMode::CLOSEST, TraversalMode::Ordered>(bvh, primitives, ray, 0.f, diag);
+    return traverseBVH<IntersectMode::CLOSEST>(bvh, primitives, ray, 0.f, diag, traversalMode, triangleTest);
+}
+
+// with profiling on, count the work done into the profile counters
+template<class DiagnosticCollectorType>
+MiniIntersection findClosestIntersectionBVHProfiled(
+        BVH const& bvh, 
+        Primitives const& primitives, 
+        Ray const& ray,
+        TraversalMode traversalMode,
+        TriangleTest triangleTest) {
+
+    DiagnosticCollectorType diag;
+    MiniIntersection hit = findClosestIntersectionBVH(bvh, primitives, ray, diag, traversalMode, triangleTest);
+    countTraversal(diag.splitsTraversed + diag.leavesChecked, diag.trianglesChecked);
+    return hit;
 }
 
 MiniIntersection findClosestIntersectionBVH(
         BVH const& bvh, 
         Primitives const& primitives, 
         Ray const& ray,
-        TraversalMode traversalMode) {
+        TraversalMode traversalMode,
+        TriangleTest triangleTest) {
+
+    if(profilingEnabled()) {
+        if(nodeHeatEnabled())
+            return findClosestIntersectionBVHProfiled<NodeHeatCollector>(bvh, primitives, ray, traversalMode, triangleTest);
+        return findClosestIntersectionBVHProfiled<DiagnosticCollector>(bvh, primitives, ray, traversalMode, triangleTest);
+    }
 
     NullCollector diag;
-    return findClosestIntersectionBVH(bvh, primitives, ray, diag, traversalMode); 
+    return findClosestIntersectionBVH(bvh, primitives, ray, diag, traversalMode, triangleTest); 
 }
 
 template<class DiagnosticCollectorType>
@@ -291,23 +501,46 @@ bool findAnyIntersectionBVH(
         Ray const& ray,
         float maxLength,
         DiagnosticCollectorType& diag,
-        TraversalMode traversalMode) {
+        TraversalMode traversalMode,
+        TriangleTest triangleTest) {
     
-    MiniIntersection hit = (traversalMode==TraversalMode::Unordered) ?
-        traverseBVH<IntersectMode::ANY, TraversalMode::Unordered>(bvh, primitives, ray, maxLength, diag) :
-        traverseBVH<IntersectMode::ANY, TraversalMode::Ordered>(bvh, primitives, ray, maxLength, diag);
+    MiniIntersection hit = traverseBVH<IntersectMode::ANY>(bvh, primitives, ray, maxLength, diag, traversalMode, triangleTest);
 
     return hit.hit(); 
 }
 
+template<class DiagnosticCollectorType>
+bool findAnyIntersectionBVHProfiled(
+        BVH const& bvh, 
+        Primitives const& primitives, 
+        Ray const& ray,
+        float maxLength,
+        TraversalMode traversalMode,
+        TriangleTest triangleTest) {
+
+    DiagnosticCollectorType diag;
+    bool hit = findAnyIntersectionBVH(bvh, primitives, ray, maxLength, diag, traversalMode, triangleTest);
+    countTraversal(diag.splitsTraversed + diag.leavesChecked, diag.trianglesChecked);
+    if(hit && ray.kind == RayKind::Shadow)
+        countShadowOccluded();
+    return hit;
+}
+
 bool findAnyIntersectionBVH(
         BVH const& bvh, 
         Primitives const& primitives, 
         Ray const& ray,
         float maxLength,
-        TraversalMode traversalMode) {
+        TraversalMode traversalMode,
+        TriangleTest triangleTest) {
+
+    if(profilingEnabled()) {
+        if(nodeHeatEnabled())
+            return findAnyIntersectionBVHProfiled<NodeHeatCollector>(bvh, primitives, ray, maxLength, traversalMode, triangleTest);
+        return findAnyIntersectionBVHProfiled<DiagnosticCollector>(bvh, primitives, ray, maxLength, traversalMode, triangleTest);
+    }
 
     NullCollector diag;
-    return findAnyIntersectionBVH(bvh, primitives, ray, maxLength, diag, traversalMode); 
+    return findAnyIntersectionBVH(bvh, primitives, ray, maxLength, diag, traversalMode, triangleTest); 
 }
 
@@ -17,6 +17,25 @@
 
 const float DEFAULT_FOV = PI/2;
 
+// a camera position+orientation, as stored in the scene file (or printed by printCamera())
+// used for camera paths in batch mode
+struct CameraPose {
+    CameraPose() : origin(0.0f, 0.0f, 0.0f), yaw(0.0f), pitch(0.0f), fov(DEFAULT_FOV) {}
+    CameraPose(glm::vec3 const& o, float y, float p, float f) : origin(o), yaw(y), pitch(p), fov(f) {}
+
+    glm::vec3 origin;
+    float yaw, pitch, fov;
+};
+
+// linearly interpolate between two poses. t==0 gives a, t==1 gives b
+inline CameraPose lerpPose(CameraPose const& a, CameraPose const& b, float t) {
+    return CameraPose(
+            glm::mix(a.origin, b.origin, t),
+            glm::mix(a.yaw, b.yaw, t),
+            glm::mix(a.pitch, b.pitch, t),
+            glm::mix(a.fov, b.fov, t));
+}
+
 struct Camera{
     // screen res in pixels
     int width, height;
@@ -64,6 +83,21 @@ struct Camera{
         buildCamera();
     }
 
+    // current position+orientation
+    CameraPose pose() const {
+        return CameraPose(origin, yaw, pitch, fov);
+    }
+
+    // jump straight to @pose (without touching the starting params), and rebuild
+    void setPose(CameraPose const& pose){
+        origin = pose.origin;
+        yaw = pose.yaw;
+        pitch = pose.pitch;
+        fov = pose.fov;
+        buildLookVectors();
+        buildCamera();
+    }
+
     // takes a screen co-ord, and returns a ray from the camera through that pixel
     // note that this is in screen space and not world space, the conversion is handled internally
     Ray makeRay(int x, int y) const
@@ -113,7 +147,8 @@ struct Camera{
         assert(isAngleInOneRev(pitch));
         assert(isAngleInHalfRev(fov));
 
-        const float aspectRatio = (float)width / (float)height;
+        // square until the screen size is set
+        const float aspectRatio = (width > 0 && height > 0) ? (float)width / (float)height : 1.0f;
 
         // start with 3x points around the screen
         auto tl = glm::vec3(-aspectRatio, 1, 1);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "basics.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Conversion of the float screenbuffer into something we can throw at the screen.
+// Display pixels are packed 8 bit XRGB (ie SDL_PIXELFORMAT_RGB888), top row first. Note this is
+// the opposite row order to the ScreenBuffer, which is bottom row first (as per TGA/OpenGL)
+typedef std::vector<uint32_t> DisplayBuffer;
+
+// convert a run of pixels. this is called per row as the render loop finishes each row, so the
+// floats are still in cache.
+// gamma correction is a template param so the inner loop has no branches, and vectorises
+template<bool CORRECT>
+inline void toneMapRow(Color const* in, uint32_t* out, int count) {
+    float const* f = &in[0].r;
+
+    #pragma omp simd
+    for(int i = 0; i < count; i++) {
+        float r = clamp(f[i * 3 + 0], 0.0f, 1.0f);
+        float g = clamp(f[i * 3 + 1], 0.0f, 1.0f);
+        float b = clamp(f[i * 3 + 2], 0.0f, 1.0f);
+
+        if(CORRECT) {
+            r = sqrtf(r);
+            g = sqrtf(g);
+            b = sqrtf(b);
+        }
+
+        uint32_t ir = (uint32_t)(r * 255.0f + 0.5f);
+        uint32_t ig = (uint32_t)(g * 255.0f + 0.5f);
+        uint32_t ib = (uint32_t)(b * 255.0f + 0.5f);
+        out[i] = (ir << 16) | (ig << 8) | ib;
+    }
+}
+
+inline void toneMapRow(Color const* in, uint32_t* out, int count, bool correct) {
+    static_assert(sizeof(Color) == 3 * sizeof(float), "Color must be 3 packed floats");
+
+    if(correct)
+        toneMapRow<true>(in, out, count);
+    else
+        toneMapRow<false>(in, out, count);
+}
+
+// unpack a display buffer back into floats, flipping it back to bottom row first - as used for
+// screenshots, so they match what was on screen
+inline void unpackDisplayBuffer(DisplayBuffer const& in, int width, int height, ScreenBuffer& out) {
+    assert(in.size() == (size_t)(width * height));
+    out.resize(in.size());
+
+    for(int y = 0; y < height; y++) {
+        uint32_t const* src = &in[(height - 1 - y) * width];
+        Color* dst = &out[y * width];
+        for(int x = 0; x < width; x++) {
+            dst[x] = Color(((src[x] >> 16) & 0xff) / 255.0f,
+                           ((src[x] >> 8) & 0xff) / 255.0f,
+                           (src[x] & 0xff) / 255.0f);
+        }
+    }
+}
@@ -3,17 +3,18 @@
 #include "bvh.h"
 #include "bvh_build_factory.h"
 #include "camera.h"
+#include "display.h"
 #include "loader.h"
 #include "output.h"
+#include "output_queue.h"
 #include "params.h"
 #include "render.h"
+#include "render_worker.h"
 #include "scene.h"
 #include "timer.h"
 #include "trace.h"
 
-#define GL_GLEXT_PROTOTYPES
 #include <SDL2/SDL.h>
-#include <SDL2/SDL_opengl.h>
 #undef main
 
 #include <cmath>
@@ -22,7 +23,7 @@
 // this file contains all machinery to operate interactive mode - ie whenever there is a visible window 
 // note frametime is in seconds
 
-void setWindowTitle(Scene const& s, SDL_Window *win, float frametime, Params const& p)
+void setWindowTitle(Camera const& camera, SDL_Window *win, RenderWorker::Image const& img, Params const& p)
 {
     char title[1024];
 
@@ -30,18 +31,24 @@ void setWindowTitle(Scene const& s, SDL_Window *win, float frametime, Params con
             "%s "
             "%dx%d "
             "@ %2.3fms(%0.0ffps) "
+            "1/%d pass %d "
+            "%s "
+            "%s "
             "%s "
             "bvh=%s "
             "(%0.3f, %0.3f, %0.3f) " 
             "fov=%0.0f "
             "color: %s",
             GetVisModeStr(p.visMode), 
-            s.camera.width, s.camera.height,
-            frametime*1000.0f, 1.0f/frametime,
+            camera.width, camera.height,
+            img.renderTime*1000.0f, 1.0f/img.renderTime,
+            img.scale, img.passes,
             GetTraversalModeStr(p.traversalMode),
+            GetTriangleTestStr(p.triangleTest),
+            GetShadingModeStr(p.shadingMode),
             GetBVHMethodStr(p.bvhMethod),
-            s.camera.origin[0], s.camera.origin[1], s.camera.origin[2],
-            glm::degrees(s.camera.fov),
+            camera.origin[0], camera.origin[1], camera.origin[2],
+            glm::degrees(camera.fov),
             p.colorCorrection?"corrected":"uncorrected"
             );
 
@@ -56,7 +63,7 @@ enum GuiAction {
 
 // process input
 // returns action to be performed
-GuiAction handleEvents(Scene& s, float frameTime, Params& p, Uint8 const* kbd, bool& camera_dirty)
+GuiAction handleEvents(Camera& camera, float frameTime, Params& p, Uint8 const* kbd, bool& camera_dirty)
 {
     SDL_Event e;
     float scale = frameTime;
@@ -68,7 +75,7 @@ GuiAction handleEvents(Scene& s, float frameTime, Params& p, Uint8 const* kbd, b
                 return GA_QUIT;
             case SDL_MOUSEWHEEL:
                 if(p.captureMouse){
-                    s.camera.moveFov(glm::radians((float)-e.wheel.y * 10.f*scale));
+                    camera.moveFov(glm::radians((float)-e.wheel.y * 10.f*scale));
                     camera_dirty=true;
                 }
                 break;
@@ -76,7 +83,7 @@ GuiAction handleEvents(Scene& s, float frameTime, Params& p, Uint8 const* kbd, b
                 if(p.captureMouse){
                     float yaw = (((float)e.motion.xrel)/5) * 0.01;
                     float pitch = (((float)e.motion.yrel)/5) * 0.01;
-                    s.camera.moveYawPitch(yaw, pitch);
+                    camera.moveYawPitch(yaw, pitch);
                     camera_dirty=true;
                 }
                 break;
@@ -84,13 +91,15 @@ GuiAction handleEvents(Scene& s, float frameTime, Params& p, Uint8 const* kbd, b
                 switch(e.key.keysym.scancode){
                     case SDL_SCANCODE_ESCAPE:  return GA_QUIT;
                     case SDL_SCANCODE_P: return GA_SCREENSHOT;
-                    case SDL_SCANCODE_R: camera_dirty=true; s.camera.resetView(); break;
-                    case SDL_SCANCODE_C: printCamera(s.camera); break;
+                    case SDL_SCANCODE_R: camera_dirty=true; camera.resetView(); break;
+                    case SDL_SCANCODE_C: printCamera(camera); break;
                     case SDL_SCANCODE_M: camera_dirty=true; p.flipSmoothing(); break;
                     case SDL_SCANCODE_B: p.nextBvhMethod(); break;
                     case SDL_SCANCODE_T: p.flipTraversalMode(); break;
+                    case SDL_SCANCODE_I: p.nextTriangleTest(); break;
+                    case SDL_SCANCODE_G: p.nextShadingMode(); break;
                     case SDL_SCANCODE_Q: p.captureMouse=!p.captureMouse; SDL_SetRelativeMouseMode(p.captureMouse ? SDL_TRUE : SDL_FALSE); break;
-                    case SDL_SCANCODE_L: p.colorCorrection=!p.colorCorrection; break;
+                    case SDL_SCANCODE_L: camera_dirty=true; p.colorCorrection=!p.colorCorrection; break;
                     case SDL_SCANCODE_0: p.setVisMode(VisMode::Default); break;
                     case SDL_SCANCODE_1: p.setVisMode(VisMode::Microseconds); break;
                     case SDL_SCANCODE_2: p.setVisMode(VisMode::Normal); break;
@@ -101,6 +110,8 @@ GuiAction handleEvents(Scene& s, float frameTime, Params& p, Uint8 const* kbd, b
                     case SDL_SCANCODE_7: p.setVisMode(VisMode::NodeIndex); break;
                     case SDL_SCANCODE_8: p.setVisMode(VisMode::PathMicroseconds); break;
                     case SDL_SCANCODE_9: camera_dirty=true; p.setVisMode(VisMode::PathTrace); break;
+                    case SDL_SCANCODE_F1: p.setVisMode(VisMode::CacheMisses); break;
+                    case SDL_SCANCODE_F2: p.setVisMode(VisMode::IPC); break;
                     default:
                         break;
                 }
@@ -109,12 +120,12 @@ GuiAction handleEvents(Scene& s, float frameTime, Params& p, Uint8 const* kbd, b
     }
 
 
-    if(kbd[SDL_SCANCODE_S]){camera_dirty=true; s.camera.moveForward(-2 * scale);}
-    if(kbd[SDL_SCANCODE_W]){camera_dirty=true; s.camera.moveForward(2 * scale);}
-    if(kbd[SDL_SCANCODE_A]){camera_dirty=true; s.camera.moveRight(-2 * scale);}
-    if(kbd[SDL_SCANCODE_D]){camera_dirty=true; s.camera.moveRight(2 * scale);}
-    if(kbd[SDL_SCANCODE_SPACE]){camera_dirty=true; s.camera.moveUp(2 * scale);}
-    if(kbd[SDL_SCANCODE_LSHIFT]){camera_dirty=true; s.camera.moveUp(-2 * scale);}
+    if(kbd[SDL_SCANCODE_S]){camera_dirty=true; camera.moveForward(-2 * scale);}
+    if(kbd[SDL_SCANCODE_W]){camera_dirty=true; camera.moveForward(2 * scale);}
+    if(kbd[SDL_SCANCODE_A]){camera_dirty=true; camera.moveRight(-2 * scale);}
+    if(kbd[SDL_SCANCODE_D]){camera_dirty=true; camera.moveRight(2 * scale);}
+    if(kbd[SDL_SCANCODE_SPACE]){camera_dirty=true; camera.moveUp(2 * scale);}
+    if(kbd[SDL_SCANCODE_LSHIFT]){camera_dirty=true; camera.moveUp(-2 * scale);}
     if(kbd[SDL_SCANCODE_COMMA]){camera_dirty=true; p.decVisScale();}
     if(kbd[SDL_SCANCODE_PERIOD]){camera_dirty=true; p.incVisScale();}
     
@@ -138,92 +149,103 @@ int interactiveLoop(Scene& s, std::string const& imgDir, int width, int height)
     p.autoSetVisScale((float)bvh->maxDepth);
 
     SDL_Window *win = SDL_CreateWindow("Roaytroayzah (initialising)", 50, 50, width, height, 
-                                       SDL_WINDOW_OPENGL|SDL_WINDOW_RESIZABLE);
-    SDL_GL_CreateContext(win);
+                                       SDL_WINDOW_RESIZABLE);
+    SDL_Renderer *renderer = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+
+    // the rendered image is uploaded to this every frame. will be created on first loop
+    SDL_Texture *texture = nullptr;
 
     // clear screen (probably not strictly nescessary)
-    glClearColor(0,0,0,1);
-    glClear(GL_COLOR_BUFFER_BIT);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_RenderClear(renderer);
 
     // switch on relative mouse mode - hides the cursor, and kinda makes things... relative.
     SDL_SetRelativeMouseMode(SDL_TRUE);
 
     Uint8 const * kbd = SDL_GetKeyboardState(NULL);
 
-    // will be sized on first loop
-    ScreenBuffer screenBuffer; 
-    ScreenBuffer clampedScreenBuffer;
+    // screenshots are written asynchronously, so the frame loop doesn't stall on disk
+    OutputQueue screenshots(2);
+
+    // rendering happens on a background thread, so the UI stays responsive however slow the
+    // frame is. From here on the worker owns the scene - the UI edits its own copy of the camera
+    // and hands it over whenever it changes
+    Camera camera = s.camera;
+    RenderWorker worker(s);
+
+    // the most recent image from the worker - ie what's currently on screen
+    RenderWorker::Image img;
 
-    // for path-tracing
     bool camera_dirty = true;
-    int passes = 0;
 
-    AvgTimer frameTimer;
+    // times the UI loop, for scaling movement
+    Timer uiTimer;
     int prev_width=0, prev_height=0;
     while(true){
         int width, height;
-        SDL_GL_GetDrawableSize(win, &width, &height);
+        SDL_GetRendererOutputSize(renderer, &width, &height);
         if(prev_width!=width || prev_height!=height){
             //printf("window size change! %dx%d -> %dx%d\n",prev_width, prev_height, width, height);
-            s.camera.width = width;
-            s.camera.height= height;
-            screenBuffer.resize(s.camera.width * s.camera.height);
-            clampedScreenBuffer.resize(s.camera.width * s.camera.height);
-            glViewport(0, 0, s.camera.width, s.camera.height);
-
+            camera.width = width;
+            camera.height= height;
             prev_width = width; prev_height = height;
             camera_dirty=true;
         }
 
         BVHMethod oldMethod = p.bvhMethod;
-        GuiAction a = handleEvents(s, frameTimer.timer.lastDiff, p, kbd, camera_dirty);
+        GuiAction a = handleEvents(camera, uiTimer.sample(), p, kbd, camera_dirty);
 
         if (a==GA_QUIT)
             return 0;
-        else if (a==GA_SCREENSHOT)
-            WriteTgaImage(imgDir, s.camera.width, s.camera.height, clampedScreenBuffer);
+        else if (a==GA_SCREENSHOT && !img.pixels.empty()) {
+            // screenshot the last frame, as it was displayed (which may be a reduced res level)
+            ScreenBuffer shot;
+            unpackDisplayBuffer(img.pixels, img.width, img.height, shot);
+            screenshots.push(MakeImageFilename(imgDir), img.width, img.height, shot);
+        }
 
         if(oldMethod != p.bvhMethod) {
             std::cout << "BVH method " << GetBVHMethodStr(oldMethod) << "->";
             std::cout << GetBVHMethodStr(p.bvhMethod) << std::endl;
+            // the worker must let go of the old BVH before it's deleted
+            worker.pause();
             delete bvh;
             bvh = buildBVH(s, p.bvhMethod);
         }
 
-
-        // if any params have changed, reset the average frametime
-        if(p.dirty) {
-            std::cout << "resetting average frametime" << std::endl;
+        if(camera_dirty || p.dirty) {
+            camera.buildCamera();
+            worker.restart(camera, p, bvh);
             p.clearDirty();
-            frameTimer.reset();
+            camera_dirty = false;
         }
 
-        if(camera_dirty) {
-            s.camera.buildCamera();
-            passes = 0;
-            camera_dirty = false;
+        if(!worker.takeLatest(img)) {
+            // nothing new to show - don't spin
+            SDL_Delay(1);
+            continue;
         }
 
-        renderFrame(s, *bvh, p, screenBuffer, passes++);
-       
-        // blit to screen
-        if(p.colorCorrection){
-            for(int i=0; i<screenBuffer.size(); i++){
-                clampedScreenBuffer[i] = colorClamp(colorCorrect(screenBuffer[i]));
-            }
-        }else{
-            for(int i=0; i<screenBuffer.size(); i++){
-                clampedScreenBuffer[i] = colorClamp(screenBuffer[i]);
-            }
+        if(img.renderTime > 1.0f)
+            std::cout << "long render - frametime=" << img.renderTime << "s" << std::endl;
+
+        // (re)create the texture whenever the image size changes, ie per progressive level
+        int texWidth = 0, texHeight = 0;
+        if(texture)
+            SDL_QueryTexture(texture, nullptr, nullptr, &texWidth, &texHeight);
+        if(texWidth != img.width || texHeight != img.height) {
+            if(texture)
+                SDL_DestroyTexture(texture);
+            texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB888, SDL_TEXTUREACCESS_STREAMING, 
+                                        img.width, img.height);
         }
-        glDrawPixels(s.camera.width, s.camera.height, GL_RGB, GL_FLOAT, clampedScreenBuffer.data());
 
-        float frametimeAv = frameTimer.sample();
-        if(frameTimer.timer.lastDiff > 1.0f)
-            std::cout << "long render - frametime=" << frameTimer.timer.lastDiff << "s" << std::endl;
+        // blit to screen - reduced res levels get scaled up to fill the window
+        SDL_UpdateTexture(texture, nullptr, img.pixels.data(), img.width * sizeof(uint32_t));
+        SDL_RenderCopy(renderer, texture, nullptr, nullptr);
 
-        setWindowTitle(s, win, frametimeAv, p);
-        SDL_GL_SwapWindow(win);
+        setWindowTitle(camera, win, img, p);
+        SDL_RenderPresent(renderer);
     }
 
     return 0; // no error
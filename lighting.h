@@ -4,13 +4,31 @@
 #include "lighting.h"
 
 #include "glm/vec3.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <vector>
 
+// how a light's intensity drops with distance
 enum FalloffKind {
-    FK_LINEAR,
-    FK_LOG
+    FK_LINEAR,  // 1/distance - the original falloff, softer than real light
+    FK_LOG      // 1/distance^2, physically based (a slope of -2 on a log-log plot, hence the name)
 };
 
+inline float lightFalloff(FalloffKind kind, float distance) {
+    return kind == FK_LOG ? 1.0f / (distance * distance) : 1.0f / distance;
+}
+
+// how far a light of brightest channel @intensity reaches before it's under @cutoff. infinite for
+// no cutoff
+inline float lightRadius(FalloffKind kind, float intensity, float cutoff) {
+    if(!(cutoff > 0.0f))
+        return INFINITY;
+    float const ratio = std::max(intensity, 0.0f) / cutoff;
+    return kind == FK_LOG ? std::sqrt(ratio) : ratio;
+}
+
 struct SpotLight{
     SpotLight(
         const glm::vec3& p, 
@@ -25,7 +43,8 @@ struct SpotLight{
         color(c), 
         falloff(f), 
         cosInnerAngle(cosf(_innerAngle)), 
-        cosOuterAngle(cosf(_outerAngle)) 
+        cosOuterAngle(cosf(_outerAngle)),
+        radius(INFINITY)
     {
     }
 
@@ -36,18 +55,266 @@ struct SpotLight{
     // cosine of the inner and outer angle of the light 
     float cosInnerAngle;
     float cosOuterAngle;
+    float radius;       // nothing further away gets any light. set by buildLightGrid()
 };
 
 struct PointLight{
-    PointLight(glm::vec3 const& p, Color c) : pos(p), color(c) {};
+    PointLight(glm::vec3 const& p, Color c, FalloffKind f = FK_LINEAR) : pos(p), color(c), falloff(f), radius(INFINITY) {};
 
     glm::vec3 pos;
     Color color;
+    FalloffKind falloff;
+    float radius;       // as SpotLight's
+};
+
+// Light culling. Each light's influence volume - where it can light anything at all - is put in a
+// uniform grid, so a shading point only has to look at the lights listed for its cell.
+// Light never quite reaches zero, so anything under the scene's radiance cutoff is taken as no light at
+// all, which gives every light a radius (see lightRadius) - a point light lights a sphere. A spot light
+// only reaches inside its cone (both ways - see calcLightOutput), out to its radius. Only the part of
+// either inside the scene matters, so each is cut off where it leaves the scene's bounds. The grid only
+// covers those bounded volumes, so a huge ground plane doesn't stretch the cells.
+// With no cutoff point lights reach everywhere, and are just listed once, as are spots of 90 degrees or
+// more.
+
+// a light in the grid: an index into pointLights, or into spotLights with this bit set
+uint32_t const LIGHT_REF_SPOT = 0x80000000u;
+
+// cells to aim for per bounded light, and the most there can be in all
+unsigned int const LIGHT_GRID_CELLS_PER_LIGHT = 8;
+unsigned int const LIGHT_GRID_MAX_CELLS = 32 * 32 * 32;
+
+struct LightGrid {
+    LightGrid() : low(0.0f), cellSize(1.0f), res{0, 0, 0} {}
+
+    // lights for a point at @pos are global, then cellRefs[cellStart[c]] until cellStart[c+1] for
+    // its cell c, if it's in the grid at all
+    std::vector<uint32_t> global;
+    std::vector<uint32_t> cellStart;
+    std::vector<uint32_t> cellRefs;
+
+    glm::vec3 low;
+    glm::vec3 cellSize;
+    int res[3];
+
+    // the cell @pos is in, or -1 if it's outside the grid
+    int cellIndex(glm::vec3 const& pos) const {
+        if(cellStart.empty())
+            return -1;
+
+        int c[3];
+        for(int axis = 0; axis < 3; axis++) {
+            float const f = (pos[axis] - low[axis]) / cellSize[axis];
+            if(!(f >= 0.0f && f <= (float)res[axis]))
+                return -1;
+            c[axis] = std::min((int)f, res[axis] - 1);
+        }
+        return (c[2] * res[1] + c[1]) * res[0] + c[0];
+    }
+
+    // call @f on every light that might reach @pos
+    template<class F>
+    void forEachLight(glm::vec3 const& pos, F const& f) const {
+        for(uint32_t ref : global)
+            f(ref);
+
+        int const cell = cellIndex(pos);
+        if(cell >= 0) {
+            for(uint32_t i = cellStart[cell]; i < cellStart[cell + 1]; i++)
+                f(cellRefs[i]);
+        }
+    }
 };
 
+// the default radiance cutoff - half an 8 bit step of the final image
+float const LIGHT_DEFAULT_CUTOFF = 0.5f / 255.0f;
+
 struct Lights {
+    Lights() : cutoff(LIGHT_DEFAULT_CUTOFF) {}
+
     std::vector<PointLight> pointLights;
     std::vector<SpotLight> spotLights;
+    // a light adding less than this (in its brightest channel) is out of range, and shading stops tracing
+    // shadow rays once the lights left add less than this between them. 0 for off
+    float cutoff;
+    LightGrid grid;     // see buildLightGrid()
 };
 
+// bounds of the part of @light's cone inside its radius and the box @sceneLow-@sceneHigh, per direction
+// (@sign is 1 or -1). returns false if that half misses the box
+inline bool spotHalfBounds(SpotLight const& light, float sign, glm::vec3 const& sceneLow,
+                           glm::vec3 const& sceneHigh, glm::vec3& low, glm::vec3& high) {
+    glm::vec3 const axis = light.pointDir * sign;
+
+    // the furthest along the axis anything in the box is - always at a corner
+    float length = -INFINITY;
+    for(int corner = 0; corner < 8; corner++) {
+        glm::vec3 const c((corner & 1) ? sceneHigh.x : sceneLow.x,
+                          (corner & 2) ? sceneHigh.y : sceneLow.y,
+                          (corner & 4) ? sceneHigh.z : sceneLow.z);
+        length = std::max(length, glm::dot(c - light.pos, axis));
+    }
+    length = std::min(length, light.radius);
+    if(length <= 0.0f)
+        return false;
+
+    // the cone up to there, ie the apex and the disc at the end
+    float const cosAngle = light.cosOuterAngle;
+    float const radius = length * std::sqrt(std::max(0.0f, 1.0f - cosAngle * cosAngle)) / cosAngle;
+    glm::vec3 const centre = light.pos + axis * length;
+    glm::vec3 const extent = radius * glm::sqrt(glm::max(glm::vec3(0.0f), glm::vec3(1.0f) - axis * axis));
+
+    // a wide cone's end disc can stick out past the radius
+    low  = glm::max(glm::max(glm::min(light.pos, centre - extent), light.pos - light.radius), sceneLow);
+    high = glm::min(glm::min(glm::max(light.pos, centre + extent), light.pos + light.radius), sceneHigh);
+    return glm::all(glm::lessThanEqual(low, high));
+}
+
+// bounds of the sphere @radius around @pos inside the box @sceneLow-@sceneHigh. returns false if it
+// misses the box
+inline bool sphereBounds(glm::vec3 const& pos, float radius, glm::vec3 const& sceneLow,
+                         glm::vec3 const& sceneHigh, glm::vec3& low, glm::vec3& high) {
+    low  = glm::max(pos - radius, sceneLow);
+    high = glm::min(pos + radius, sceneHigh);
+    return glm::all(glm::lessThanEqual(low, high));
+}
+
+// could the sphere at @centre, @radius be inside @light's cone (either way)? conservative
+inline bool spotReachesSphere(SpotLight const& light, glm::vec3 const& centre, float radius) {
+    glm::vec3 const v = centre - light.pos;
+    float const distance = glm::length(v);
+    if(distance <= radius)
+        return true;
+
+    // the angle off the axis to the sphere's centre, less the angle the sphere covers
+    float const offAxis = std::acos(std::min(1.0f, std::abs(glm::dot(v, light.pointDir)) / distance));
+    float const covers = std::asin(radius / distance);
+    return offAxis - covers <= std::acos(light.cosOuterAngle) + 1e-4f;
+}
+
+// (re)build @lights.grid, for a scene whose geometry is all inside @sceneLow-@sceneHigh. sets every
+// light's radius from @lights.cutoff first
+inline void buildLightGrid(Lights& lights, glm::vec3 const& sceneLow, glm::vec3 const& sceneHigh) {
+    LightGrid& grid = lights.grid;
+    grid = LightGrid();
+
+    auto brightest = [](Color const& c) { return std::max(c.r, std::max(c.g, c.b)); };
+    for(auto& light : lights.pointLights)
+        light.radius = lightRadius(light.falloff, brightest(light.color), lights.cutoff);
+    for(auto& light : lights.spotLights)
+        light.radius = lightRadius(light.falloff, brightest(light.color), lights.cutoff);
+
+    // a little slack, so shading points a hair outside the geometry still find their lights
+    glm::vec3 const slack(1e-3f * glm::length(sceneHigh - sceneLow) + 1e-4f);
+    glm::vec3 const boxLow = sceneLow - slack, boxHigh = sceneHigh + slack;
+
+    struct Bounded {
+        uint32_t ref;
+        glm::vec3 low, high;
+    };
+    std::vector<Bounded> bounded;
+    glm::vec3 gridLow(INFINITY), gridHigh(-INFINITY);
+
+    auto addBounded = [&](uint32_t ref, glm::vec3 const& low, glm::vec3 const& high) {
+        bounded.push_back({ref, low, high});
+        gridLow = glm::min(gridLow, low);
+        gridHigh = glm::max(gridHigh, high);
+    };
+
+    for(uint32_t i = 0; i < lights.pointLights.size(); i++) {
+        PointLight const& light = lights.pointLights[i];
+        glm::vec3 low, high;
+        if(light.radius == INFINITY)
+            grid.global.push_back(i);
+        else if(sphereBounds(light.pos, light.radius, boxLow, boxHigh, low, high))
+            addBounded(i, low, high);
+        // else it can't light anything
+    }
+
+    for(uint32_t i = 0; i < lights.spotLights.size(); i++) {
+        SpotLight const& light = lights.spotLights[i];
+        uint32_t const ref = LIGHT_REF_SPOT | i;
+
+        // 90 degrees or wider, and the two halves cover everything - so it's as a point light
+        if(light.cosOuterAngle <= 0.0f) {
+            glm::vec3 low, high;
+            if(light.radius == INFINITY)
+                grid.global.push_back(ref);
+            else if(sphereBounds(light.pos, light.radius, boxLow, boxHigh, low, high))
+                addBounded(ref, low, high);
+            continue;
+        }
+
+        glm::vec3 low(INFINITY), high(-INFINITY);
+        for(float sign : {1.0f, -1.0f}) {
+            glm::vec3 halfLow, halfHigh;
+            if(spotHalfBounds(light, sign, boxLow, boxHigh, halfLow, halfHigh)) {
+                low = glm::min(low, halfLow);
+                high = glm::max(high, halfHigh);
+            }
+        }
+
+        if(glm::all(glm::lessThanEqual(low, high)))
+            addBounded(ref, low, high);
+        // else it misses the scene altogether
+    }
+
+    if(bounded.empty())
+        return;
+
+    // roughly cube cells, as many as asked for. a flat axis still gets a cell
+    glm::vec3 extent = gridHigh - gridLow;
+    float const largest = std::max(extent.x, std::max(extent.y, extent.z));
+    extent = glm::max(extent, glm::vec3(std::max(largest * 1e-3f, 1e-4f)));
+
+    unsigned int const target = std::min(LIGHT_GRID_MAX_CELLS, LIGHT_GRID_CELLS_PER_LIGHT * (unsigned int)bounded.size());
+    float const side = std::cbrt(extent.x * extent.y * extent.z / target);
+    for(int axis = 0; axis < 3; axis++) {
+        grid.res[axis] = clamp((int)std::ceil(extent[axis] / side), 1, (int)LIGHT_GRID_MAX_CELLS);
+        grid.cellSize[axis] = extent[axis] / grid.res[axis];
+    }
+    // rounding up can overshoot - trim the longest axes until it fits
+    while((unsigned int)grid.res[0] * grid.res[1] * grid.res[2] > LIGHT_GRID_MAX_CELLS) {
+        int const axis = grid.res[0] >= grid.res[1] ? (grid.res[0] >= grid.res[2] ? 0 : 2) : (grid.res[1] >= grid.res[2] ? 1 : 2);
+        grid.res[axis]--;
+        grid.cellSize[axis] = extent[axis] / grid.res[axis];
+    }
+    grid.low = gridLow;
+
+    int const cells = grid.res[0] * grid.res[1] * grid.res[2];
+    float const cellRadius = 0.5f * glm::length(grid.cellSize);
+
+    // the cells each light's bounds overlap, less any out of its radius or cone
+    std::vector<std::vector<uint32_t>> perCell(cells);
+    for(auto const& b : bounded) {
+        bool const spot = (b.ref & LIGHT_REF_SPOT) != 0;
+        SpotLight const* light = spot ? &lights.spotLights[b.ref & ~LIGHT_REF_SPOT] : nullptr;
+        glm::vec3 const pos = spot ? light->pos : lights.pointLights[b.ref].pos;
+        float const radius = spot ? light->radius : lights.pointLights[b.ref].radius;
+
+        int c0[3], c1[3];
+        for(int axis = 0; axis < 3; axis++) {
+            c0[axis] = clamp((int)((b.low[axis] - grid.low[axis]) / grid.cellSize[axis]), 0, grid.res[axis] - 1);
+            c1[axis] = clamp((int)((b.high[axis] - grid.low[axis]) / grid.cellSize[axis]), 0, grid.res[axis] - 1);
+        }
+
+        for(int z = c0[2]; z <= c1[2]; z++)
+        for(int y = c0[1]; y <= c1[1]; y++)
+        for(int x = c0[0]; x <= c1[0]; x++) {
+            glm::vec3 const centre = grid.low + (glm::vec3(x, y, z) + 0.5f) * grid.cellSize;
+            if(glm::length(centre - pos) > radius + cellRadius)
+                continue;
+            if(!spot || light->cosOuterAngle <= 0.0f || spotReachesSphere(*light, centre, cellRadius))
+                perCell[(z * grid.res[1] + y) * grid.res[0] + x].push_back(b.ref);
+        }
+    }
+
+    grid.cellStart.reserve(cells + 1);
+    for(auto const& refs : perCell) {
+        grid.cellStart.push_back(grid.cellRefs.size());
+        grid.cellRefs.insert(grid.cellRefs.end(), refs.begin(), refs.end());
+    }
+    grid.cellStart.push_back(grid.cellRefs.size());
+}
+
 
@@ -1,7 +1,10 @@
 #include "basics.h"
 #include "debug_print.h"
+#include "loader.h"
 #include "material.h"
+#include "mem_stats.h"
 #include "mesh.h"
+#include "profile.h"
 #include "scene.h"
 
 #include "json.hpp"
@@ -11,6 +14,7 @@
 #include "glm/gtx/transform.hpp"
 #include "tiny_obj_loader.h"
 
+#include <cmath>
 #include <fstream>
 #include <string>
 #include <vector>
@@ -240,10 +244,30 @@ void setupStream(std::string const& inputDir, std::string const& filename, Loade
     throw std::runtime_error("couldn't setup stream");
 }
 
+// tinyobj's arrays only live while the mesh is being converted, but can dwarf the mesh itself
+void accountLoadedObject(LoadedObject const& obj) {
+    uint64_t allocated = allocatedBytes(obj.attrib.vertices) + allocatedBytes(obj.attrib.normals) +
+                         allocatedBytes(obj.attrib.texcoords) + allocatedBytes(obj.shapes) +
+                         allocatedBytes(obj.materials);
+    uint64_t used = usedBytes(obj.attrib.vertices) + usedBytes(obj.attrib.normals) +
+                    usedBytes(obj.attrib.texcoords) + usedBytes(obj.shapes) + usedBytes(obj.materials);
+
+    for(auto const& shape : obj.shapes) {
+        allocated += allocatedBytes(shape.mesh.indices) + allocatedBytes(shape.mesh.num_face_vertices) +
+                     allocatedBytes(shape.mesh.material_ids);
+        used += usedBytes(shape.mesh.indices) + usedBytes(shape.mesh.num_face_vertices) +
+                usedBytes(shape.mesh.material_ids);
+    }
+
+    setMemoryUsage(MemoryKind::ObjLoader, allocated, used);
+}
+
 Mesh loadMesh(std::string const& inputDir, std::string const& filename, Scene& s){
+    ProfileZone zone("load mesh");
 
     LoadedObject obj;
     setupStream(inputDir, filename, obj);
+    accountLoadedObject(obj);
         
     std::cout << "material count " << obj.materials.size() << std::endl;
 
@@ -293,6 +317,9 @@ Mesh loadMesh(std::string const& inputDir, std::string const& filename, Scene& s
     // triangles are split in two - must have exactly the same count in both arrays
     assert(mesh.pos.size() == mesh.extra.size());
     std::cout << "load done, triangles = " << mesh.pos.size() << std::endl;
+
+    // obj is about to go - just its peak is left
+    setMemoryUsage(MemoryKind::ObjLoader, 0, 0);
     return mesh;
 }
 
@@ -383,7 +410,9 @@ void handleLight(Scene& s, json const& l) {
     const Color color = readColor(l["color"]);
 
     if(kind == "point"){
-        s.lights.pointLights.emplace_back(position, color);
+        // point lights predate falloff kinds, so it's optional
+        FalloffKind falloff = l.find("falloff") != l.end() ? readFalloffKind(l["falloff"]) : FK_LINEAR;
+        s.lights.pointLights.emplace_back(position, color, falloff);
     }
     else if(kind == "spot"){
         const glm::vec3 pointDirection = readPY(l["point_direction"]);
@@ -398,17 +427,31 @@ void handleLight(Scene& s, json const& l) {
     }
 }
 
-void handleCamera(Scene& s, json const& c) {
-    s.camera.startingOrigin = readXYZ(c["origin"]);
-
+CameraPose readCameraPose(json const& c) {
     auto const& lookAngle = c["look_angle"];
-    s.camera.startingYaw = readAngle(lookAngle, "yaw");
-    s.camera.startingPitch = readAngle(lookAngle, "pitch");
+    return CameraPose(
+            readXYZ(c["origin"]),
+            readAngle(lookAngle, "yaw"),
+            readAngle(lookAngle, "pitch"),
+            readAngle(c, "fov"));
+}
 
-    s.camera.startingFov = readAngle(c, "fov");
+void handleCamera(Scene& s, json const& c) {
+    CameraPose pose = readCameraPose(c);
+    s.camera.startingOrigin = pose.origin;
+    s.camera.startingYaw = pose.yaw;
+    s.camera.startingPitch = pose.pitch;
+    s.camera.startingFov = pose.fov;
     s.camera.resetView();
 }
 
+void handleCameraPath(Scene& s, json const& path) {
+    for(auto const& c : path) {
+        s.cameraPath.push_back(readCameraPose(c));
+    }
+    std::cout << "camera path with " << s.cameraPath.size() << " keyframes" << std::endl;
+}
+
 bool loadScene(std::string const& inputDir, std::string const& filename, Scene& scene) {
     std::stringstream ss;
     if(inputDir.size() > 0)
@@ -451,15 +494,24 @@ bool loadScene(std::string const& inputDir, std::string const& filename, Scene&
         handleLight(scene, light);
     }
 
+    if(world.find("light_cutoff") != world.end()) {
+        scene.lights.cutoff = world["light_cutoff"];
+    }
+
     if(o.find("camera") != o.end()) {
         handleCamera(scene, o["camera"]);
     }
 
+    if(o.find("camera_path") != o.end()) {
+        handleCameraPath(scene, o["camera_path"]);
+    }
+
     return true;
 }
 
 bool setupScene(std::string const& inputDir, std::string const& filename, Scene& scene)
 {
+    ProfileZone zone("load scene");
     buildFixedMaterials(scene.primitives.materials);
 
     // sanity check - the fixed materials should now be created
@@ -472,15 +524,116 @@ bool setupScene(std::string const& inputDir, std::string const& filename, Scene&
         return false;
     }
 
+    // every material's in now
+    scene.primitives.shading = buildShadingTable(scene.primitives.materials);
+
     // fill in the light array
     for(int i=0; i<scene.primitives.extra.size(); i++){
         auto const& e = scene.primitives.extra[i];
-        auto const& mat = scene.primitives.materials[e.mat];
-        if(!(mat.emissive.r==0 && mat.emissive.g==0 && mat.emissive.b==0))
+        if(scene.primitives.shading.has(e.mat, MATERIAL_EMISSIVE))
             scene.primitives.light_indices.push_back(i);
     }
     printf("light emmiting triangles: %zu\n", scene.primitives.light_indices.size());
 
+    // and the light grid, over everything there is to light
+    glm::vec3 sceneLow(INFINITY), sceneHigh(-INFINITY);
+    for(auto const& t : scene.primitives.pos) {
+        for(auto const& v : t.v) {
+            sceneLow = glm::min(sceneLow, v);
+            sceneHigh = glm::max(sceneHigh, v);
+        }
+    }
+    if(!scene.primitives.pos.empty()) {
+        buildLightGrid(scene.lights, sceneLow, sceneHigh);
+        printf("light grid: cutoff %g, %zu global lights, %dx%dx%d cells, %zu cell entries\n",
+               scene.lights.cutoff, scene.lights.grid.global.size(),
+               scene.lights.grid.res[0], scene.lights.grid.res[1], scene.lights.grid.res[2],
+               scene.lights.grid.cellRefs.size());
+    }
+
+    // the triangle arrays grow mesh by mesh, so can be up to twice the size they need to be. record
+    // that as the peak, then give the spare back
+    accountPrimitives(scene.primitives);
+    scene.primitives.pos.shrink_to_fit();
+    scene.primitives.extra.shrink_to_fit();
+    accountPrimitives(scene.primitives);
+    printMemoryReport("after setupScene");
+
+    return true;
+}
+
+bool loadCameraPath(std::string const& filename, std::vector<CameraPose>& path) {
+    std::cout << "loading camera path " << filename << std::endl;
+    std::ifstream inFile(filename);
+    if(!inFile.good()) {
+        std::cerr << "couldn't open camera path " << filename << std::endl;
+        return false;
+    }
+
+    std::string line;
+    int lineNo = 0;
+    while(std::getline(inFile, line)) {
+        lineNo++;
+
+        // skip anything before the camera object itself - ie the "camera" : from printCamera()
+        auto start = line.find('{');
+        if(start == std::string::npos)
+            continue;
+
+        try{
+            json c = json::parse(line.substr(start));
+            path.push_back(readCameraPose(c));
+        } catch (std::exception const& e) {
+            std::cerr << "exception loading camera path line " << lineNo << " - " << e.what() << std::endl;
+            return false;
+        }
+    }
+
+    std::cout << "camera path with " << path.size() << " keyframes" << std::endl;
+    return true;
+}
+
+bool parseRenderJob(std::string const& text, RenderJob& job, std::string& err) {
+    try{
+        json o = json::parse(text);
+
+        job.sceneFile = o.at("scene").get<std::string>();
+
+        if(o.find("camera") != o.end()) {
+            job.camera = readCameraPose(o["camera"]);
+            job.hasCamera = true;
+        }
+
+        // read wide and range checked below, so huge numbers can't wrap round to something plausible
+        auto readInt = [&o](char const* key, int max, int& out) {
+            if(o.find(key) == o.end())
+                return true;
+            double const v = o[key].get<double>();
+            if(!(v > 0.0 && v <= max) || v != std::floor(v))
+                return false;
+            out = (int)v;
+            return true;
+        };
+
+        if(!readInt("width", RENDER_JOB_MAX_DIMENSION, job.width) ||
+           !readInt("height", RENDER_JOB_MAX_DIMENSION, job.height) ||
+           !readInt("spp", RENDER_JOB_MAX_SPP, job.spp)) {
+            err = "width and height must be 1.." + std::to_string(RENDER_JOB_MAX_DIMENSION) +
+                  ", spp 1.." + std::to_string(RENDER_JOB_MAX_SPP);
+            return false;
+        }
+        if(o.find("vis_mode") != o.end())   job.visMode = o["vis_mode"].get<std::string>();
+        if(o.find("bvh") != o.end())        job.bvhMethod = o["bvh"].get<std::string>();
+    } catch (std::exception const& e) {
+        err = e.what();
+        return false;
+    }
+
+    if((long long)job.width * job.height > RENDER_JOB_MAX_PIXELS) {
+        err = "at most " + std::to_string(RENDER_JOB_MAX_PIXELS) + " pixels";
+        return false;
+    }
+
     return true;
 }
 
@@ -5,6 +5,33 @@
 
 bool setupScene(std::string const& inputDir, std::string const& filename, Scene& s);
 
+// load a camera path file - one camera per line, in the format printed by printCamera()
+// (the leading "camera" : is optional). Appends to @path.
+bool loadCameraPath(std::string const& filename, std::vector<CameraPose>& path);
+
+// a render request, as submitted to the render server (see server.h)
+// vis mode and bvh method are kept as strings here, and converted by the server. This keeps 
+// params.h out of loader.cc
+struct RenderJob {
+    RenderJob() : hasCamera(false), width(640), height(640), spp(1), visMode("0"), bvhMethod("SBVH") {}
+
+    std::string sceneFile;  // relative to the server's input dir
+    bool hasCamera;         // if false, use the scene's starting camera
+    CameraPose camera;
+    int width, height;
+    int spp;
+    std::string visMode;    // interactive mode key, ie "0".."9"
+    std::string bvhMethod;  // per GetBVHMethodStr()
+};
+
+// limits on what a render job can ask for. TGA stores width and height in 16 bits
+int const RENDER_JOB_MAX_DIMENSION = 65535;
+long long const RENDER_JOB_MAX_PIXELS = 64LL * 1024 * 1024;
+int const RENDER_JOB_MAX_SPP = 4096;
+
+// parse a json render job, and check it's within the limits above. returns false and sets @err on failure
+bool parseRenderJob(std::string const& text, RenderJob& job, std::string& err);
+
 // it's a little odd to have this in loader, but it saves having to bring json.h anywhere else 
 // (which improves compile time noticably outside loader.cc)
 void printCamera(Camera const& c);
@@ -1,7 +1,9 @@
-
 #include "batch.h"
 #include "interactive.h"
+#include "server.h"
 
+#include <cstdio>
+#include <cstdlib>
 #include <deque>
 #include <string>
 #include <iostream>
@@ -11,8 +13,64 @@ int width = 640;
 int height = 640;
 
 void showUsage(const char* binary) {
-    std::cout << "USAGE: " << binary << "[-b] <input dir> <scene file> [image output dir]\n";
+    std::cout << "USAGE: " << binary << "[-b [batch options]] <input dir> <scene file> [image output dir]\n";
+    std::cout << "       " << binary << " -S <socket path> <input dir> [scene cache size]\n";
     std::cout << "         -b  batch mode\n";
+    std::cout << "         -S  render server mode\n";
+    std::cout << "batch options:\n";
+    std::cout << "         -r <width>x<height>  resolution (default " << width << "x" << height << ")\n";
+    std::cout << "         -s <spp>             samples per pixel, for progressive vis modes (default 1)\n";
+    std::cout << "         -m <mode>            vis mode - interactive mode keys 0-9, c/i for F1/F2 (default 0)\n";
+    std::cout << "         -w <moller|watertight> ray/triangle test (default moller)\n";
+    std::cout << "         -d <immediate|deferred> shade as each pixel is hit, or a tile at a time by material (default immediate)\n";
+    std::cout << "         -p <camera file>     camera path, one printCamera entry per line\n";
+    std::cout << "         -i <frames>          frames to interpolate between camera keyframes (default 0)\n";
+    std::cout << "         -t <trace file>      profile each frame, and write a chrome trace (chrome://tracing)\n";
+    std::cout << "         -H <prefix>          collect per bvh node heat over all frames, write <prefix>-nodes.csv/-hot.csv\n";
+    std::cout << "         -T <iterations>      bvh treelet optimisation passes, 0 for none (default " << BVHBuildOptions().treeletIterations << ")\n";
+    std::cout << "         -L <off|auto|cost>   bvh leaf collapsing, with measured or given triangle/node cost ratio (default auto)\n";
+    std::cout << "         -D <factor>          sbvh max triangle references, as a multiple of the triangle count (default " << BVHBuildOptions().sbvhMaxDuplication << ")\n";
+    std::cout << "         -K <splits>          sbvh max spatial splits at any one depth, 0 for no limit (default 0)\n";
+    std::cout << "         -q <full|q16|q8>     bvh node format for traversal - quantized nodes are smaller (default full)\n";
+}
+
+// parse the batch mode flags off the front of args. returns false on a bad flag
+bool parseBatchOptions(std::deque<std::string>& args, BatchOptions& opts) {
+    while(!args.empty() && args.front().size() == 2 && args.front()[0] == '-') {
+        char flag = args.front()[1];
+        args.pop_front();
+
+        if(args.empty())
+            return false;
+
+        std::string val = args.front();
+        args.pop_front();
+
+        bool ok = false;
+        switch(flag) {
+            case 'r':
+                ok = sscanf(val.c_str(), "%dx%d", &opts.width, &opts.height) == 2 && 
+                     opts.width > 0 && opts.height > 0;
+                break;
+            case 's': ok = parseCount(val, opts.spp, false); break;
+            case 'i': ok = parseCount(val, opts.interpFrames, true); break;
+            case 'm': ok = ParseVisMode(val, opts.visMode); break;
+            case 'w': ok = ParseTriangleTest(val, opts.triangleTest); break;
+            case 'd': ok = ParseShadingMode(val, opts.shadingMode); break;
+            case 'p': opts.cameraPathFile = val; ok = true; break;
+            case 't': opts.traceFile = val; ok = true; break;
+            case 'H': opts.heatPrefix = val; ok = true; break;
+            case 'T': ok = parseCount(val, opts.bvhOptions.treeletIterations, true); break;
+            case 'L': ok = parseLeafCollapse(val, opts.bvhOptions); break;
+            case 'D': ok = parseFactor(val, opts.bvhOptions.sbvhMaxDuplication); break;
+            case 'K': ok = parseCount(val, opts.bvhOptions.sbvhSpatialSplitsPerDepth, true); break;
+            case 'q': ok = ParseNodeFormat(val, opts.bvhOptions.nodeFormat); break;
+        }
+
+        if(!ok)
+            return false;
+    }
+    return true;
 }
 
 int main(int argc, char* argv[]){
@@ -21,20 +79,56 @@ int main(int argc, char* argv[]){
         args.push_back(argv[i]);
 
     Scene scene;
-    if (args.size() < 2 || args.size() > 5) {
+    if (args.size() < 2) {
         showUsage(argv[0]);
         setupScene("data", "teapot.scene", scene);
         return interactiveLoop(scene, "data", width, height);
     }
 
+    if(args.front() == "-S") {
+        args.pop_front();
+        std::string socketPath = args.front();
+        args.pop_front();
+
+        if(args.empty() || args.size() > 2) {
+            showUsage(argv[0]);
+            return -1;
+        }
+
+        std::string inputDir = args.front();
+        args.pop_front();
+
+        int cacheSize = 4;
+        if(!args.empty() && !parseCount(args.front(), cacheSize, false)) {
+            showUsage(argv[0]);
+            return -1;
+        }
+
+        return serverLoop(inputDir, socketPath, cacheSize);
+    }
+
 	bool batch = false;
+    BatchOptions batchOpts;
+    batchOpts.width = width;
+    batchOpts.height = height;
+
     if(args.front() == "-b") {
         std::cout << "batch mode\n";
         batch = true;
         args.pop_front();
+
+        if(!parseBatchOptions(args, batchOpts)) {
+            showUsage(argv[0]);
+            return -1;
+        }
+
+        // switch on before loading, so that gets profiled too
+        // the heat map is collected by the profiling traversal
+        if(!batchOpts.traceFile.empty() || !batchOpts.heatPrefix.empty())
+            setProfiling(true);
     }
 
-    if(args.size() < 2) {
+    if(args.size() < 2 || args.size() > 3) {
         showUsage(argv[0]);
         return -1;
     }
@@ -66,7 +160,7 @@ int main(int argc, char* argv[]){
     }
 
     if(batch)
-         return batchRender(scene, outputDir, width, height);
+         return batchRender(scene, outputDir, batchOpts);
     else
          return interactiveLoop(scene, outputDir, width, height);
 }
@@ -2,6 +2,7 @@
 
 #include "basics.h"
 
+#include <cstdint>
 #include <vector>
 
 struct Material{
@@ -40,6 +41,72 @@ const int MATERIAL_REFLECTIVE_BLUE= 2;
 // if a mesh doesn't have a material, it'll get this one
 const int DEFAULT_MATERIAL = MATERIAL_CHECKER;
 
+// what a material does, worked out once so shading branches on bits instead of comparing colours
+const uint8_t MATERIAL_DIFFUSE     = 1 << 0;  // lit by the lights
+const uint8_t MATERIAL_SPECULAR    = 1 << 1;  // has a specular highlight
+const uint8_t MATERIAL_REFLECTIVE  = 1 << 2;
+const uint8_t MATERIAL_TRANSPARENT = 1 << 3;
+const uint8_t MATERIAL_EMISSIVE    = 1 << 4;
+const uint8_t MATERIAL_CHECKERED   = 1 << 5;  // alternates with material checkered[] every unit cube
+
+// The materials again, one array per field (indexed by material) - what shading reads.
+// A Material is ~80 bytes, and the shaders used to copy one or two per hit whatever they needed;
+// this way they only touch the fields they use, and never copy.
+struct ShadingTable {
+    std::vector<uint8_t> flags;
+    std::vector<Color> diffuseColor;
+    std::vector<Color> reflectiveness;
+    std::vector<Color> specular_highlight;
+    std::vector<Color> emissive;
+    std::vector<float> transparency;
+    std::vector<float> refraction_index;
+    std::vector<float> shininess;
+    std::vector<int> checkered;
+
+    unsigned int size() const {
+        return flags.size();
+    }
+
+    bool has(int mat, uint8_t flag) const {
+        return (flags[mat] & flag) != 0;
+    }
+
+    // the material actually showing at @impact on material @mat
+    int resolve(int mat, glm::vec3 const& impact) const {
+        if(!has(mat, MATERIAL_CHECKERED))
+            return mat;
+
+        int x = (int)(impact.x - EPSILON);
+        int y = (int)(impact.y - EPSILON);
+        int z = (int)(impact.z - EPSILON);
+        return ((x&1)^(y&1)^(z&1)) ? checkered[mat] : mat;
+    }
+};
+
+inline ShadingTable buildShadingTable(std::vector<Material> const& materials) {
+    ShadingTable t;
+    for(auto const& m : materials) {
+        uint8_t flags = 0;
+        if(m.diffuseColor != BLACK)       flags |= MATERIAL_DIFFUSE;
+        if(m.specular_highlight != BLACK) flags |= MATERIAL_SPECULAR;
+        if(m.reflectiveness != BLACK)     flags |= MATERIAL_REFLECTIVE;
+        if(m.transparency > 0.f)          flags |= MATERIAL_TRANSPARENT;
+        if(m.emissive != BLACK)           flags |= MATERIAL_EMISSIVE;
+        if(m.checkered >= 0)              flags |= MATERIAL_CHECKERED;
+
+        t.flags.push_back(flags);
+        t.diffuseColor.push_back(m.diffuseColor);
+        t.reflectiveness.push_back(m.reflectiveness);
+        t.specular_highlight.push_back(m.specular_highlight);
+        t.emissive.push_back(m.emissive);
+        t.transparency.push_back(m.transparency);
+        t.refraction_index.push_back(m.refraction_index);
+        t.shininess.push_back(m.shininess);
+        t.checkered.push_back(m.checkered);
+    }
+    return t;
+}
+
 inline void buildFixedMaterials(std::vector<Material>& v){
     // AIR
     v.emplace_back(Color(0.f, 0.f, 0.f), // diffuse col
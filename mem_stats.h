@@ -0,0 +1,201 @@
+#pragma once
+
+#include "basics.h"
+#include "primitive.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
+
+// Memory accounting for the big allocations, by subsystem - so we can size machines for large scenes
+// and see what memory reduction work actually buys.
+//
+// Each subsystem reports its bytes allocated (vector capacity) and used (vector size) whenever it
+// (re)builds its data, and the peak allocated is remembered. The numbers are for the most recently
+// reported data, eg the last BVH built - not a sum over everything alive.
+// Only the large arrays are counted, not per object overheads, so it's a floor on the real usage.
+// (no BVH here - this is included by the loader, and aabb.h can't be. see accountBVH())
+
+enum class MemoryKind {
+    Primitives,     // triangle positions, extra data, materials (both layouts) and light list
+    ObjLoader,      // tinyobj's LoadedObject, while a mesh is being loaded
+    BVHNodes,
+    BVHIndicies,
+    BVHQuantizedNodes,  // compressed copy of the nodes, if one's been made
+    ScreenBuffers,
+    _MAX
+};
+
+const int MEMORY_KIND_COUNT = (int)MemoryKind::_MAX;
+
+inline const char* GetMemoryKindStr(MemoryKind k) {
+    switch(k) {
+        case MemoryKind::Primitives:        return "primitives";
+        case MemoryKind::ObjLoader:         return "obj_loader";
+        case MemoryKind::BVHNodes:          return "bvh_nodes";
+        case MemoryKind::BVHIndicies:       return "bvh_indicies";
+        case MemoryKind::BVHQuantizedNodes: return "bvh_quantized_nodes";
+        case MemoryKind::ScreenBuffers:     return "screen_buffers";
+        default:                            return "unknown";
+    }
+}
+
+struct MemoryUsage {
+    MemoryUsage() : allocated(0), used(0), peak(0) {}
+
+    uint64_t allocated; // bytes
+    uint64_t used;      // bytes actually holding data
+    uint64_t peak;      // highest allocated so far
+};
+
+struct MemoryStats {
+    MemoryUsage usage[MEMORY_KIND_COUNT];
+
+    MemoryUsage const& get(MemoryKind k) const {
+        return usage[(int)k];
+    }
+
+    uint64_t totalAllocated() const {
+        uint64_t sum = 0;
+        for(auto const& u : usage)
+            sum += u.allocated;
+        return sum;
+    }
+
+    uint64_t totalUsed() const {
+        uint64_t sum = 0;
+        for(auto const& u : usage)
+            sum += u.used;
+        return sum;
+    }
+};
+
+struct MemoryState {
+    std::mutex mutex;
+    MemoryStats stats;
+};
+
+inline MemoryState& memoryState() {
+    static MemoryState state;
+    return state;
+}
+
+template<class T>
+inline uint64_t allocatedBytes(std::vector<T> const& v) {
+    return (uint64_t)v.capacity() * sizeof(T);
+}
+
+template<class T>
+inline uint64_t usedBytes(std::vector<T> const& v) {
+    return (uint64_t)v.size() * sizeof(T);
+}
+
+// replace the numbers for @k
+inline void setMemoryUsage(MemoryKind k, uint64_t allocated, uint64_t used) {
+    MemoryState& s = memoryState();
+    std::unique_lock<std::mutex> lock(s.mutex);
+
+    MemoryUsage& u = s.stats.usage[(int)k];
+    u.allocated = allocated;
+    u.used = used;
+    u.peak = std::max(u.peak, allocated);
+}
+
+inline MemoryStats memoryStats() {
+    MemoryState& s = memoryState();
+    std::unique_lock<std::mutex> lock(s.mutex);
+    return s.stats;
+}
+
+// forget @k's numbers, peak included. eg before building another BVH to compare
+inline void clearMemoryUsage(MemoryKind k) {
+    MemoryState& s = memoryState();
+    std::unique_lock<std::mutex> lock(s.mutex);
+    s.stats.usage[(int)k] = MemoryUsage();
+}
+
+// forget everything, peaks included. eg between benchmark scenes
+inline void resetMemoryStats() {
+    MemoryState& s = memoryState();
+    std::unique_lock<std::mutex> lock(s.mutex);
+    s.stats = MemoryStats();
+}
+
+inline uint64_t allocatedBytes(ShadingTable const& t) {
+    return allocatedBytes(t.flags) + allocatedBytes(t.diffuseColor) + allocatedBytes(t.reflectiveness) +
+        allocatedBytes(t.specular_highlight) + allocatedBytes(t.emissive) + allocatedBytes(t.transparency) +
+        allocatedBytes(t.refraction_index) + allocatedBytes(t.shininess) + allocatedBytes(t.checkered);
+}
+
+inline uint64_t usedBytes(ShadingTable const& t) {
+    return usedBytes(t.flags) + usedBytes(t.diffuseColor) + usedBytes(t.reflectiveness) +
+        usedBytes(t.specular_highlight) + usedBytes(t.emissive) + usedBytes(t.transparency) +
+        usedBytes(t.refraction_index) + usedBytes(t.shininess) + usedBytes(t.checkered);
+}
+
+inline void accountPrimitives(Primitives const& prims) {
+    setMemoryUsage(MemoryKind::Primitives,
+        allocatedBytes(prims.pos) + allocatedBytes(prims.extra) + allocatedBytes(prims.materials) +
+            allocatedBytes(prims.shading) + allocatedBytes(prims.light_indices),
+        usedBytes(prims.pos) + usedBytes(prims.extra) + usedBytes(prims.materials) +
+            usedBytes(prims.shading) + usedBytes(prims.light_indices));
+}
+
+inline void accountScreenBuffers(std::vector<ScreenBuffer const*> const& buffers) {
+    uint64_t allocated = 0, used = 0;
+    for(auto b : buffers) {
+        allocated += allocatedBytes(*b);
+        used += usedBytes(*b);
+    }
+    setMemoryUsage(MemoryKind::ScreenBuffers, allocated, used);
+}
+
+// peak resident set size of the process so far, in bytes. 0 if we can't tell
+inline long peakRSSBytes() {
+#ifndef WIN32
+    rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        return usage.ru_maxrss;         // macOS reports bytes
+#else
+        return usage.ru_maxrss * 1024L; // linux (and the BSDs) report KiB
+#endif
+    }
+#endif
+    return 0;
+}
+
+inline void printMemoryReport(char const* label, std::ostream& os = std::cout) {
+    MemoryStats const stats = memoryStats();
+    auto mib = [](uint64_t bytes) { return bytes / (1024.0 * 1024.0); };
+
+    char line[160];
+    os << "memory " << label << ":\n";
+    for(int i = 0; i < MEMORY_KIND_COUNT; i++) {
+        MemoryUsage const& u = stats.usage[i];
+        snprintf(line, sizeof(line), "  %-20s allocated %9.2f MiB used %9.2f MiB peak %9.2f MiB\n",
+                 GetMemoryKindStr((MemoryKind)i), mib(u.allocated), mib(u.used), mib(u.peak));
+        os << line;
+    }
+    snprintf(line, sizeof(line), "  %-20s allocated %9.2f MiB used %9.2f MiB, process peak RSS %.2f MiB\n",
+             "total", mib(stats.totalAllocated()), mib(stats.totalUsed()), mib(peakRSSBytes()));
+    os << line << std::flush;
+}
+
+// as a json object, keyed by subsystem
+inline void writeMemoryJson(std::ostream& os, MemoryStats const& stats) {
+    os << "{";
+    for(int i = 0; i < MEMORY_KIND_COUNT; i++) {
+        MemoryUsage const& u = stats.usage[i];
+        os << (i ? ", " : "") << "\"" << GetMemoryKindStr((MemoryKind)i) << "\" : {";
+        os << "\"allocated\" : " << u.allocated << ", \"used\" : " << u.used << ", \"peak\" : " << u.peak << "}";
+    }
+    os << "}";
+}
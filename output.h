@@ -1,40 +1,51 @@
 #pragma once
 
+#include "basics.h"
+
 #include <cassert>
 #include <chrono>
 #include <iomanip>
+#include <iostream>
 #include <fstream>
 #include <sstream>
 #include <vector>
 
 // originally from https://danielbeard.wordpress.com/2011/06/06/image-saving-code-c/
-bool WriteNamedTgaImage(std::string const& fname, unsigned int w, unsigned int h, ScreenBuffer const& buf) {
+// encodes @buf as an uncompressed 24 bit TGA into @out (which is overwritten)
+void EncodeTgaImage(unsigned int w, unsigned int h, ScreenBuffer const& buf, std::vector<char>& out) {
     assert(buf.size() == w * h);
 
-    std::cout << "screenshot - " << fname << std::endl;
-	std::fstream o(fname, std::ios::out | std::ios::binary);
+    out.clear();
+    out.reserve(18 + (w * h * 3));
 
 	// Write the header
-	o.put(0);
-   	o.put(0);
-   	o.put(2);                       // uncompressed RGB 
-   	o.put(0); 	o.put(0);
-   	o.put(0); 	o.put(0);
-   	o.put(0);
-   	o.put(0); 	o.put(0);           // X origin 
-   	o.put(0); 	o.put(0);           // y origin
-   	o.put((w & 0x00FF));
-   	o.put((w & 0xFF00) / 256);
-   	o.put((h & 0x00FF));
-   	o.put((h & 0xFF00) / 256);
-   	o.put(24);                      // 24 bit bitmap
-   	o.put(0);
+	out.push_back(0);
+   	out.push_back(0);
+   	out.push_back(2);                       // uncompressed RGB 
+   	out.push_back(0); 	out.push_back(0);
+   	out.push_back(0); 	out.push_back(0);
+   	out.push_back(0);
+   	out.push_back(0); 	out.push_back(0);           // X origin 
+   	out.push_back(0); 	out.push_back(0);           // y origin
+   	out.push_back((w & 0x00FF));
+   	out.push_back((w & 0xFF00) / 256);
+   	out.push_back((h & 0x00FF));
+   	out.push_back((h & 0xFF00) / 256);
+   	out.push_back(24);                      // 24 bit bitmap
+   	out.push_back(0);
 
 	for (unsigned int i = 0; i < (h * w); i++) {
-		o.put((char)(buf[i].b * 255));
-		o.put((char)(buf[i].g * 255));
-		o.put((char)(buf[i].r * 255));
+		out.push_back((char)(buf[i].b * 255));
+		out.push_back((char)(buf[i].g * 255));
+		out.push_back((char)(buf[i].r * 255));
 	}   
+}
+
+// dump a block of bytes to a file in one go
+bool WriteFile(std::string const& fname, std::vector<char> const& data) {
+    std::cout << "screenshot - " << fname << std::endl;
+	std::fstream o(fname, std::ios::out | std::ios::binary);
+    o.write(data.data(), data.size());
 
     if(!o.good()) {
         std::cout << "WARNING: error writing screenshot " << std::endl;
@@ -43,8 +54,14 @@ bool WriteNamedTgaImage(std::string const& fname, unsigned int w, unsigned int h
     return true;
 }
 
-// generates a filename, and writes the image to dir
-bool WriteTgaImage(std::string const& dir, unsigned int width, unsigned int height, ScreenBuffer const& buf) {
+bool WriteNamedTgaImage(std::string const& fname, unsigned int w, unsigned int h, ScreenBuffer const& buf) {
+    std::vector<char> encoded;
+    EncodeTgaImage(w, h, buf, encoded);
+    return WriteFile(fname, encoded);
+}
+
+// generates a timestamped filename (minus extension) in dir
+std::string MakeImageFilenameBase(std::string const& dir) {
     std::stringstream ss;
 
     if (dir.size() > 0)
@@ -54,7 +71,23 @@ bool WriteTgaImage(std::string const& dir, unsigned int width, unsigned int heig
 
     auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
     ss << std::put_time(std::localtime(&now), "%Y-%m-%d-%H.%M.%S");
-    ss << ".tga";
 
-    return WriteNamedTgaImage(ss.str(), width, height, buf);
+    return ss.str();
+}
+
+// generates a timestamped filename in dir
+std::string MakeImageFilename(std::string const& dir) {
+    return MakeImageFilenameBase(dir) + ".tga";
+}
+
+// filename for frame @frame of a sequence, sharing a common @base from MakeImageFilenameBase()
+std::string MakeFrameFilename(std::string const& base, int frame) {
+    std::stringstream ss;
+    ss << base << "-" << std::setw(4) << std::setfill('0') << frame << ".tga";
+    return ss.str();
+}
+
+// generates a filename, and writes the image to dir
+bool WriteTgaImage(std::string const& dir, unsigned int width, unsigned int height, ScreenBuffer const& buf) {
+    return WriteNamedTgaImage(MakeImageFilename(dir), width, height, buf);
 }
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "basics.h"
+#include "output.h"
+#include "profile.h"
+
+#include <cassert>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// asynchronous image output.
+// frames are copied into one of a small, fixed number of slots, and a writer thread encodes and
+// writes them out while the render thread gets on with the next frame. If the disk is slower than
+// the renderer, all slots fill up and push() blocks until the writer frees one (ie backpressure),
+// so we never queue up an unbounded amount of memory.
+struct OutputQueue {
+    // a single frame waiting to be written
+    struct Slot {
+        Slot() : width(0), height(0), pending(false) {}
+
+        std::string fname;
+        unsigned int width, height;
+        ScreenBuffer buf;
+        bool pending; // filled by push(), not yet written
+    };
+
+    // @slotCount: max frames in flight. 2 = double buffered, 3 = triple buffered
+    OutputQueue(unsigned int slotCount = 3) :
+        slots(slotCount),
+        nextPush(0),
+        nextWrite(0),
+        inFlight(0),
+        failures(0),
+        stopping(false)
+    {
+        assert(slotCount > 0);
+        writer = std::thread(&OutputQueue::writerLoop, this);
+    }
+
+    ~OutputQueue() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        pushed.notify_all();
+        // the writer drains everything pending before exiting
+        writer.join();
+    }
+
+    OutputQueue(OutputQueue const&) = delete;
+    OutputQueue& operator=(OutputQueue const&) = delete;
+
+    // queue an image for writing. the buffer is copied, so the caller may reuse it straight away.
+    // blocks while all slots are in flight.
+    void push(std::string const& fname, unsigned int width, unsigned int height, ScreenBuffer const& buf) {
+        assert(buf.size() == width * height);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        if(inFlight == slots.size())
+            std::cout << "output queue full, waiting for writer" << std::endl;
+        written.wait(lock, [this]{ return inFlight < slots.size(); });
+
+        Slot& slot = slots[nextPush];
+        assert(!slot.pending);
+
+        // copy while holding the lock - the writer never touches a slot that isn't pending,
+        // so this could be done unlocked, but it's only a memcpy
+        slot.fname = fname;
+        slot.width = width;
+        slot.height = height;
+        slot.buf.assign(buf.begin(), buf.end()); // reuses the slot's allocation after the first frame
+        slot.pending = true;
+
+        nextPush = (nextPush + 1) % slots.size();
+        inFlight++;
+
+        lock.unlock();
+        pushed.notify_one();
+    }
+
+    // wait until everything pushed so far has hit the disk
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        written.wait(lock, [this]{ return inFlight == 0; });
+    }
+
+    // true if every write so far succeeded
+    bool ok() {
+        std::unique_lock<std::mutex> lock(mutex);
+        return failures == 0;
+    }
+
+private:
+    void writerLoop() {
+        std::vector<char> encoded;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while(true) {
+            pushed.wait(lock, [this]{ return inFlight > 0 || stopping; });
+
+            if(inFlight == 0) {
+                assert(stopping);
+                return;
+            }
+
+            Slot& slot = slots[nextWrite];
+            assert(slot.pending);
+
+            // slot is ours until we clear pending - drop the lock so the render thread can keep
+            // pushing into the other slots
+            lock.unlock();
+            bool result;
+            {
+                ProfileZone encodeZone("output encode");
+                EncodeTgaImage(slot.width, slot.height, slot.buf, encoded);
+            }
+            {
+                ProfileZone writeZone("output write");
+                result = WriteFile(slot.fname, encoded);
+            }
+            lock.lock();
+
+            slot.pending = false;
+            nextWrite = (nextWrite + 1) % slots.size();
+            inFlight--;
+            if(!result)
+                failures++;
+
+            written.notify_all();
+        }
+    }
+
+    std::vector<Slot> slots;
+    unsigned int nextPush;  // next slot to fill
+    unsigned int nextWrite; // next slot to write out
+    unsigned int inFlight;  // number of pending slots
+    unsigned int failures;
+    bool stopping;
+
+    std::mutex mutex;
+    std::condition_variable pushed;  // signalled when a slot becomes pending (or we're stopping)
+    std::condition_variable written; // signalled when a slot is freed
+    std::thread writer;
+};
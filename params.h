@@ -1,5 +1,9 @@
 #pragma once
 
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
 enum class VisMode {
     Default,
     Microseconds,
@@ -10,7 +14,9 @@ enum class VisMode {
     TrianglesChecked,
     LeavesChecked,
     LeafDepth,
-    PathTrace
+    PathTrace,
+    CacheMisses,
+    IPC
 };
 
 const char* GetVisModeStr(VisMode m) {
@@ -25,24 +31,119 @@ const char* GetVisModeStr(VisMode m) {
         case VisMode::LeavesChecked: return "leaves checked";
         case VisMode::LeafDepth: return "leaf depth";
         case VisMode::PathTrace: return "path trace";
+        case VisMode::CacheMisses: return "L1D misses";
+        case VisMode::IPC: return "IPC";
     }
 
 	return ""; // silence msvc warn
 };
 
+// parse a vis mode from the command line. accepts the same digits as the interactive mode keys,
+// plus c and i for the hardware counter modes (F1/F2 interactively)
+// returns false if the string isn't recognised
+bool ParseVisMode(std::string const& str, VisMode& m) {
+    if(str.size() != 1)
+        return false;
+
+    switch(str[0]) {
+        case '0': m = VisMode::Default; return true;
+        case '1': m = VisMode::Microseconds; return true;
+        case '2': m = VisMode::Normal; return true;
+        case '3': m = VisMode::LeafDepth; return true;
+        case '4': m = VisMode::TrianglesChecked; return true;
+        case '5': m = VisMode::SplitsTraversed; return true;
+        case '6': m = VisMode::LeavesChecked; return true;
+        case '7': m = VisMode::NodeIndex; return true;
+        case '8': m = VisMode::PathMicroseconds; return true;
+        case '9': m = VisMode::PathTrace; return true;
+        case 'c': m = VisMode::CacheMisses; return true;
+        case 'i': m = VisMode::IPC; return true;
+    }
+    return false;
+}
+
+// is this one of the hardware performance counter modes? (see perf_counters.h)
+inline bool IsPerfCounterMode(VisMode m) {
+    return m == VisMode::CacheMisses || m == VisMode::IPC;
+}
+
+// does this mode accumulate over multiple passes? (ie do extra samples per pixel make any difference)
+inline bool IsProgressive(VisMode m) {
+    return m == VisMode::PathTrace;
+}
+
+// the order a BVH node's children are visited in
 enum class TraversalMode{
-    Unordered,
-    Ordered
+    Unordered,  // left then right
+    Ordered,    // front to back by the ray's direction along the node's split axis
+    Distance,   // front to back by where the ray enters each child's box
+    _MAX
 };
 
 const char* GetTraversalModeStr(TraversalMode m) {
     switch (m) {
         case TraversalMode::Unordered: return "unordered";
         case TraversalMode::Ordered: return "ordered";
+        case TraversalMode::Distance: return "distance";
+        case TraversalMode::_MAX: return "shouldn't happen";
     }
 	return ""; // silence msvc warn
 }
 
+// which ray/triangle test the leaves use (see primitive.h)
+enum class TriangleTest {
+    MollerTrumbore,
+    Watertight,
+    _MAX
+};
+
+const char* GetTriangleTestStr(TriangleTest t) {
+    switch(t) {
+        case TriangleTest::MollerTrumbore: return "moller";
+        case TriangleTest::Watertight: return "watertight";
+        case TriangleTest::_MAX: return "shouldn't happen";
+    }
+	return ""; // silence msvc warn
+}
+
+// parse a triangle test, per GetTriangleTestStr(). returns false if the string isn't recognised
+bool ParseTriangleTest(std::string const& str, TriangleTest& t) {
+    for(int i = 0; i < (int)TriangleTest::_MAX; i++) {
+        if(str == GetTriangleTestStr((TriangleTest)i)) {
+            t = (TriangleTest)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// when camera hits are shaded (see renderDeferredLoop)
+enum class ShadingMode {
+    Immediate,  // as each pixel is intersected
+    Deferred,   // a tile at a time, sorted by material
+    _MAX
+};
+
+const char* GetShadingModeStr(ShadingMode m) {
+    switch(m) {
+        case ShadingMode::Immediate: return "immediate";
+        case ShadingMode::Deferred: return "deferred";
+        case ShadingMode::_MAX: return "shouldn't happen";
+    }
+	return ""; // silence msvc warn
+}
+
+// parse a shading mode, per GetShadingModeStr(). returns false if the string isn't recognised
+bool ParseShadingMode(std::string const& str, ShadingMode& m) {
+    for(int i = 0; i < (int)ShadingMode::_MAX; i++) {
+        if(str == GetShadingModeStr((ShadingMode)i)) {
+            m = (ShadingMode)i;
+            return true;
+        }
+    }
+    return false;
+}
+
 enum class BVHMethod {
     SBVH,
     CENTROID_SAH,
@@ -60,18 +161,42 @@ const char* GetBVHMethodStr(BVHMethod m) {
 	return ""; // silence msvc warn
 }
 
+// parse a strictly positive (or zero, if allowed) int. returns false if it's not a valid number
+inline bool parseCount(std::string const& str, int& val, bool allowZero) {
+    char* end = nullptr;
+    long res = strtol(str.c_str(), &end, 10);
+    if(str.empty() || *end != '\0' || res < (allowZero ? 0 : 1) || res > 1000000)
+        return false;
+    val = (int)res;
+    return true;
+}
+
+// parse a BVH method, per GetBVHMethodStr(). returns false if the string isn't recognised
+bool ParseBVHMethod(std::string const& str, BVHMethod& m) {
+    for(int i = 0; i < (int)BVHMethod::_MAX; i++) {
+        if(str == GetBVHMethodStr((BVHMethod)i)) {
+            m = (BVHMethod)i;
+            return true;
+        }
+    }
+    return false;
+}
+
 // parameters to current render.
 struct Params {
     Params() : 
         visMode(VisMode::Default),
         visScale(1.0f),
 		traversalMode(TraversalMode::Ordered),
+        triangleTest(TriangleTest::MollerTrumbore),
+        shadingMode(ShadingMode::Immediate),
         bvhMethod(BVHMethod::SBVH),
         smoothing(true),
         dirty(true),
         visScaleSetManually(false),
         captureMouse(true),
-        colorCorrection(true)
+        colorCorrection(true),
+        seed(1337)
     {}
 
     void flipSmoothing() {
@@ -80,10 +205,17 @@ struct Params {
     }
 
     void flipTraversalMode() {
-        if(traversalMode == TraversalMode::Ordered)
-            traversalMode = TraversalMode::Unordered;
-        else
-            traversalMode = TraversalMode::Ordered;
+        traversalMode = (TraversalMode)(((int)traversalMode + 1) % (int)TraversalMode::_MAX);
+        dirty = true;
+    }
+
+    void nextTriangleTest() {
+        triangleTest = (TriangleTest)(((int)(triangleTest) + 1) % (int)TriangleTest::_MAX);
+        dirty = true;
+    }
+
+    void nextShadingMode() {
+        shadingMode = (ShadingMode)(((int)(shadingMode) + 1) % (int)ShadingMode::_MAX);
         dirty = true;
     }
 
@@ -121,11 +253,14 @@ struct Params {
     VisMode visMode;
     float visScale;
 	TraversalMode traversalMode;
+    TriangleTest triangleTest;
+    ShadingMode shadingMode;
     BVHMethod bvhMethod;
     bool smoothing;
     bool captureMouse;
     bool dirty; // has something changed recently?
     bool visScaleSetManually; // has the user explicitly adjusted vis scale? (ie pressed . or ,) ? 
     bool colorCorrection;
+    unsigned int seed; // base seed for the path tracer's rng
 };
 
@@ -17,7 +17,15 @@ Color pathTrace(
         const Params& p,
         bool prevMirror);
 
-static Rng rng = Rng(1337);
+// one generator per thread. renderLoop reseeds it at the start of every row (and renderDeferredLoop every
+// tile, see seedPathRng), so a frame comes out the same no matter which thread renders which row
+static thread_local Rng rng = Rng(1337);
+
+// seed for a given row (or tile) of a given pass. xorshift gets stuck on 0, so avoid that
+inline void seedPathRng(uint32_t seed, int pass, int row) {
+    uint32_t state = hash32(seed ^ hash32((uint32_t)pass ^ hash32((uint32_t)row)));
+    rng.state = state ? state : 1;
+}
 
 // thanks Jacco!
 glm::vec3 diffuseDirectionCos(glm::vec3 const& norm){
@@ -52,7 +60,7 @@ inline glm::vec3 random_point_on_triangle(TrianglePos const& t){
 }
 
 Color directIllumination(Scene const& scene, FancyIntersection const& fancy, 
-                         BVH const& bvh, Params const& p, Material const& mat){
+                         BVH const& bvh, Params const& p, int mat){
     // picking random point on light
     auto const& light_indices = scene.primitives.light_indices;
     assert(light_indices.size()>0);
@@ -63,42 +71,44 @@ Color directIllumination(Scene const& scene, FancyIntersection const& fancy,
     l /= dist;
 
     // culling
-    glm::vec3 lightNormal = scene.primitives.extra[random_index].n[0]; //good enough?
+    glm::vec3 lightNormal = scene.primitives.extra[random_index].faceNormal;
     float cos_o = glm::dot(-l, lightNormal);
     if(cos_o<=0.f) return BLACK;
     float cos_i = glm::dot( l, fancy.normal);
     if(cos_i<=0.f) return BLACK;
 
     // light not behind face, trace shadow ray
-    Ray shadowray = Ray(fancy.impact+EPSILON*l, l, 0, 1);
+    Ray shadowray = Ray(fancy.impact+EPSILON*l, l, 0, 1, RayKind::Shadow);
     if(findAnyIntersectionBVH(bvh, scene.primitives, shadowray, 
-                              dist-2*EPSILON, p.traversalMode)) return BLACK;
+                              dist-2*EPSILON, p.traversalMode, p.triangleTest)) return BLACK;
 
     // calculate transport
-    auto lightmat = scene.primitives.materials[scene.primitives.extra[random_index].mat];
-    glm::vec3 BRDF = mat.diffuseColor * INVPI;
+    ShadingTable const& mats = scene.primitives.shading;
+    Color const& emissive = mats.emissive[scene.primitives.extra[random_index].mat];
+    glm::vec3 BRDF = mats.diffuseColor[mat] * INVPI;
     float solidAngle = (cos_o*random_triangle.area()) / (dist*dist);
-    return BRDF * (float)light_indices.size() * lightmat.emissive * solidAngle * cos_i;
+    return BRDF * (float)light_indices.size() * emissive * solidAngle * cos_i;
 }
 
 Color indirectIllumination(Scene const& scene, FancyIntersection const& fancy, 
-        BVH const& bvh, Params const& p, Material const& mat, 
-        Ray ray, Material const& raymat, bool prevMirror){
+        BVH const& bvh, Params const& p, int mat, 
+        Ray ray, int raymat, bool prevMirror){
+    ShadingTable const& mats = scene.primitives.shading;
 
     // terminate if we hit a light source 
-    if (mat.emissive!=BLACK) {
+    if (mats.has(mat, MATERIAL_EMISSIVE)) {
         if(prevMirror) // lights should look bright
-            return mat.emissive;
+            return mats.emissive[mat];
         else return BLACK; // but not count towards indirect illumination
     }
 
-    Color reflectiveness = mat.reflectiveness;
-    float transparency   = mat.transparency;
+    Color reflectiveness = mats.reflectiveness[mat];
+    float transparency   = mats.transparency[mat];
 
     // angle-depenent transparancy (for dielectric materials)
-    if(mat.transparency > 0.f){
-        float n1 = raymat.refraction_index;
-        float n2 = mat.refraction_index;
+    if(mats.has(mat, MATERIAL_TRANSPARENT)){
+        float n1 = mats.refraction_index[raymat];
+        float n2 = mats.refraction_index[mat];
         float r0 = (n1-n2)/(n1+n2); r0*=r0;
         float pow5 = 1.f-glm::dot(fancy.normal, -ray.direction);
         float fr = r0+(1.f-r0)*pow5*pow5*pow5*pow5*pow5;
@@ -110,12 +120,13 @@ Color indirectIllumination(Scene const& scene, FancyIntersection const& fancy,
     if(transparency>rng.floatRange(0,1)){
         glm::vec3 refract_direction = 
             glm::refract(ray.direction, fancy.normal, 
-                    raymat.refraction_index/(fancy.internal?1.f:mat.refraction_index));
+                    mats.refraction_index[raymat]/(fancy.internal?1.f:mats.refraction_index[mat]));
         Ray refract_ray = Ray(fancy.impact-(fancy.normal*EPSILON),
                 refract_direction, 
                 //FIXME: exiting a primitive will set the material to air
                 fancy.internal ? MATERIAL_AIR : fancy.mat, 
-                ray.ttl-1);
+                ray.ttl-1,
+                RayKind::Secondary);
         return pathTrace(refract_ray, bvh, scene, p, prevMirror);
     }
 
@@ -123,7 +134,7 @@ Color indirectIllumination(Scene const& scene, FancyIntersection const& fancy,
     // handle mirrors
     if(reflectiveness.r+reflectiveness.g+reflectiveness.b > rng.floatRange(0,3)){
         glm::vec3 refl = glm::reflect(ray.direction, fancy.normal);
-        Ray reflray = Ray(fancy.impact+fancy.normal*EPSILON, refl, ray.mat, ray.ttl-1);
+        Ray reflray = Ray(fancy.impact+fancy.normal*EPSILON, refl, ray.mat, ray.ttl-1, RayKind::Secondary);
         return pathTrace(reflray, bvh, scene, p, prevMirror);
     }
 
@@ -137,14 +148,29 @@ Color indirectIllumination(Scene const& scene, FancyIntersection const& fancy,
     Ray newray(fancy.impact + EPSILON*fancy.normal,
                direction,
                ray.mat,
-               ray.ttl-1);
+               ray.ttl-1,
+               RayKind::Diffuse);
 
-    glm::vec3 BRDF = mat.diffuseColor * INVPI;
+    glm::vec3 BRDF = mats.diffuseColor[mat] * INVPI;
     float PDF = glm::dot(fancy.normal,direction)*INVPI;
     Color ii = glm::dot(fancy.normal, direction) * pathTrace(newray, bvh, scene, p, prevMirror) / PDF;
     return BRDF * ii;
 }
         
+// the shading half of pathTrace(), for the hit @fancy on (already checkered) material @mat
+Color pathShadeHit(
+        const Ray& ray,
+        const FancyIntersection& fancy,
+        int mat,
+        const BVH& bvh,
+        const Scene& scene,
+        const Params& p) {
+    // direct illumination
+    Color di = directIllumination(scene, fancy, bvh, p, mat);
+    Color ii = indirectIllumination(scene, fancy, bvh, p, mat, ray, ray.mat, true);
+    return di + ii;
+}
+
 Color pathTrace(
         const Ray& ray,
         const BVH& bvh,
@@ -154,30 +180,16 @@ Color pathTrace(
     if(ray.ttl == 0) return BLACK;
     
     const MiniIntersection mini = 
-        findClosestIntersectionBVH(bvh, scene.primitives, ray, p.traversalMode);
+        findClosestIntersectionBVH(bvh, scene.primitives, ray, p.traversalMode, p.triangleTest);
 
     // terminate if ray left the scene
     if(!mini.hit()) return BLACK;
 
     const FancyIntersection fancy = 
-        FancyIntersect(mini.distance, scene.primitives.pos[mini.triangle], 
-                                      scene.primitives.extra[mini.triangle], 
-                                      ray, p.smoothing);
-    const Material& raymat = scene.primitives.materials[ray.mat];
-    Material mat = scene.primitives.materials[fancy.mat];
-
+        FancyIntersect(mini, scene.primitives.extra[mini.triangle], ray, p.smoothing);
     // checkers!
-    if(mat.checkered >= 0){
-        int x = (int)(fancy.impact.x - EPSILON);
-        int y = (int)(fancy.impact.y - EPSILON);
-        int z = (int)(fancy.impact.z - EPSILON);
-        if((x&1)^(y&1)^(z&1)) 
-            mat = scene.primitives.materials[mat.checkered];
-    }
+    int const mat = scene.primitives.shading.resolve(fancy.mat, fancy.impact);
 
-    // direct illumination
-    Color di = directIllumination(scene, fancy, bvh, p, mat);
-    Color ii = indirectIllumination(scene, fancy, bvh, p, mat, ray, raymat, true);
-    return di + ii;
+    return pathShadeHit(ray, fancy, mat, bvh, scene, p);
 }
 
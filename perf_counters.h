@@ -0,0 +1,224 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware performance counters, via linux perf_event_open.
+// Each thread opens its own group of counters, counting just that thread in user space, and
+// reading the whole group is a single read(). Any counter the cpu/kernel doesn't support (or isn't
+// allowed - see /proc/sys/kernel/perf_event_paranoid) is just left out, and reads as zero.
+// On other platforms nothing is available.
+
+enum class PerfEvent {
+    Cycles,
+    Instructions,
+    L1DMisses,      // L1 data cache read misses
+    LLCMisses,      // last level cache misses
+    BranchMisses,
+    _MAX
+};
+
+const int PERF_EVENT_COUNT = (int)PerfEvent::_MAX;
+
+inline const char* GetPerfEventStr(PerfEvent e) {
+    switch(e) {
+        case PerfEvent::Cycles:       return "cycles";
+        case PerfEvent::Instructions: return "instructions";
+        case PerfEvent::L1DMisses:    return "L1D misses";
+        case PerfEvent::LLCMisses:    return "LLC misses";
+        case PerfEvent::BranchMisses: return "branch misses";
+        default:                      return "unknown";
+    }
+}
+
+// a snapshot (or difference) of all the counters
+struct PerfValues {
+    PerfValues() {
+        for(auto& c : counts)
+            c = 0;
+    }
+
+    uint64_t get(PerfEvent e) const {
+        return counts[(int)e];
+    }
+
+    PerfValues operator-(PerfValues const& other) const {
+        PerfValues res;
+        for(int i = 0; i < PERF_EVENT_COUNT; i++)
+            res.counts[i] = counts[i] - other.counts[i];
+        return res;
+    }
+
+    PerfValues& operator+=(PerfValues const& other) {
+        for(int i = 0; i < PERF_EVENT_COUNT; i++)
+            counts[i] += other.counts[i];
+        return *this;
+    }
+
+    uint64_t counts[PERF_EVENT_COUNT];
+};
+
+// the counters for the calling thread. don't share between threads - see threadPerfCounters()
+struct PerfCounters {
+    PerfCounters() : leader(-1), groupSize(0) {
+        for(int i = 0; i < PERF_EVENT_COUNT; i++) {
+            fds[i] = -1;
+            slot[i] = -1;
+        }
+
+#ifdef __linux__
+        for(int i = 0; i < PERF_EVENT_COUNT; i++) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+            attr.disabled = (leader < 0) ? 1 : 0; // the whole group starts with the leader
+
+            switch((PerfEvent)i) {
+                case PerfEvent::Cycles:
+                    attr.type = PERF_TYPE_HARDWARE;
+                    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+                    break;
+                case PerfEvent::Instructions:
+                    attr.type = PERF_TYPE_HARDWARE;
+                    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+                    break;
+                case PerfEvent::L1DMisses:
+                    attr.type = PERF_TYPE_HW_CACHE;
+                    attr.config = PERF_COUNT_HW_CACHE_L1D |
+                                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+                    break;
+                case PerfEvent::LLCMisses:
+                    attr.type = PERF_TYPE_HARDWARE;
+                    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+                    break;
+                case PerfEvent::BranchMisses:
+                    attr.type = PERF_TYPE_HARDWARE;
+                    attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+                    break;
+                default:
+                    continue;
+            }
+
+            // this thread, any cpu
+            int fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+            if(fd < 0)
+                continue; // not supported here - leave it out
+
+            fds[i] = fd;
+            slot[i] = groupSize++;
+            if(leader < 0)
+                leader = fd;
+        }
+
+        if(leader >= 0)
+            ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+    }
+
+    ~PerfCounters() {
+#ifdef __linux__
+        for(int fd : fds) {
+            if(fd >= 0)
+                close(fd);
+        }
+#endif
+    }
+
+    PerfCounters(PerfCounters const&) = delete;
+    PerfCounters& operator=(PerfCounters const&) = delete;
+
+    // is anything being counted at all?
+    bool available() const {
+        return leader >= 0;
+    }
+
+    bool has(PerfEvent e) const {
+        return fds[(int)e] >= 0;
+    }
+
+    // current counter values. unavailable counters read as zero
+    PerfValues read() const {
+        PerfValues res;
+#ifdef __linux__
+        if(leader < 0)
+            return res;
+
+        // PERF_FORMAT_GROUP layout - the number of counters, then their values in group order
+        uint64_t buf[1 + PERF_EVENT_COUNT];
+        if(::read(leader, buf, sizeof(buf)) < (ssize_t)((1 + groupSize) * sizeof(uint64_t)))
+            return res;
+
+        for(int i = 0; i < PERF_EVENT_COUNT; i++) {
+            if(slot[i] >= 0)
+                res.counts[i] = buf[1 + slot[i]];
+        }
+#endif
+        return res;
+    }
+
+    int fds[PERF_EVENT_COUNT];
+    int slot[PERF_EVENT_COUNT]; // index into the group read, -1 if not available
+    int leader;                 // group leader fd, -1 if nothing is available
+    int groupSize;
+};
+
+// this thread's counters, opened on first use
+inline PerfCounters& threadPerfCounters() {
+    thread_local PerfCounters counters;
+    return counters;
+}
+
+// summary of a frame rendered in one of the hardware counter vis modes
+struct PerfFrameSummary {
+    PerfFrameSummary() : pixels(0), tiles(0) {
+        for(auto& a : available)
+            a = false;
+    }
+
+    PerfValues totals;
+    bool available[PERF_EVENT_COUNT];
+    uint64_t pixels;
+    unsigned int tiles;
+};
+
+// the most recently rendered frame. written by the render loop, so only read it between frames
+inline PerfFrameSummary& lastPerfFrame() {
+    static PerfFrameSummary summary;
+    return summary;
+}
+
+inline void printPerfFrameSummary(PerfFrameSummary const& f, std::ostream& os = std::cout) {
+    os << "perf counters: " << f.pixels << " pixels in " << f.tiles << " tiles";
+
+    bool any = false;
+    for(int i = 0; i < PERF_EVENT_COUNT; i++) {
+        if(!f.available[i])
+            continue;
+        any = true;
+        os << ", " << GetPerfEventStr((PerfEvent)i) << " " << f.totals.counts[i];
+        if(f.pixels > 0)
+            os << " (" << (double)f.totals.counts[i] / f.pixels << "/px)";
+    }
+
+    if(!any) {
+        os << " - no hardware counters available (check perf_event_paranoid)" << std::endl;
+        return;
+    }
+
+    if(f.available[(int)PerfEvent::Cycles] && f.available[(int)PerfEvent::Instructions] &&
+       f.totals.get(PerfEvent::Cycles) > 0)
+        os << ", IPC " << (double)f.totals.get(PerfEvent::Instructions) / f.totals.get(PerfEvent::Cycles);
+    os << std::endl;
+}
@@ -62,7 +62,7 @@ inline std::ostream& operator<<(std::ostream& os, const TrianglePos& t) {
 // 3x per-vertex normals, and ref to a material. Separated from TrianglePos to improve cache performance
 struct TriangleExtra{
     TriangleExtra(glm::vec3 const& n1, glm::vec3 const& n2, glm::vec3 const& n3, int _mat)
-        : n{n1, n2, n3}, mat(_mat) {
+        : n{n1, n2, n3}, faceNormal(glm::normalize((n1 + n2 + n3) / 3.0f)), mat(_mat) {
             sanityCheck();
         }
 
@@ -70,10 +70,13 @@ struct TriangleExtra{
         assert(glm::isNormalized(n[0], EPSILON));
         assert(glm::isNormalized(n[1], EPSILON));
         assert(glm::isNormalized(n[2], EPSILON));
+        assert(glm::isNormalized(faceNormal, EPSILON));
     }
 
     // per-vertex normal
     glm::vec3 n[3];
+    // the normal when not smoothing - the average of the vertex normals, so it faces the same way
+    glm::vec3 faceNormal;
     // material
     int mat; 
 };
@@ -85,6 +88,8 @@ typedef std::vector<TrianglePos> TrianglePosSet;
 
 struct Primitives{
     MaterialSet materials;
+    // the same materials, laid out for shading. built from materials once they're all loaded
+    ShadingTable shading;
     // these next two combined define the world triangles. 
     // They are seperate to improve cache performance. Indicies must line up.
     TrianglePosSet pos;
@@ -92,6 +97,22 @@ struct Primitives{
     std::vector<int> light_indices;
 };
 
+// minimal intersection result
+// note: if dist == INFINITY, triangle (and u/v) are undefined.
+struct MiniIntersection {
+    MiniIntersection(float _distance, int _triangle) : distance(_distance), triangle(_triangle), u(0), v(0) {}
+    MiniIntersection() : distance(INFINITY), u(0), v(0) {} 
+
+    // did we hit something? if so, triangle should be defined
+    bool hit() const {
+        return (distance < INFINITY);
+    }
+
+    float distance;         // dist to intersection 
+    unsigned int triangle;  // triangle number
+    float u, v;             // barycentrics of the hit: the weights of the triangle's v[1] and v[2]
+};
+
 // result of an intersection calculation
 // This is the former Intersection struct - the basic result of an intersection is now in MiniIntersection
 // generally one of these will be built after deciding a specific triangle is the closest
@@ -114,46 +135,24 @@ inline std::ostream& operator<<(std::ostream& os, const FancyIntersection& i) {
     return os;
 }
 
-// adapted from Christer Ericson's Read-Time Collition Detection
-inline glm::vec3 barycentric(glm::vec3 p, TrianglePos const& tri) {
-    const glm::vec3 v0 = tri.v[1] - tri.v[0];
-    const glm::vec3 v1 = tri.v[2] - tri.v[0];
-    const glm::vec3 v2 = p - tri.v[0];
-
-    float d00 = glm::dot(v0, v0);
-    float d01 = glm::dot(v0, v1);
-    float d11 = glm::dot(v1, v1);
-    float d20 = glm::dot(v2, v0);
-    float d21 = glm::dot(v2, v1);
-    float denom = d00 * d11 - d01 * d01;
-    float v = (d11 * d20 - d01 * d21) / denom;
-    float w = (d00 * d21 - d01 * d20) / denom;
-    float u = 1.0f - v - w;
-    return glm::vec3(u,v,w);
-}
-
 // compute triangle/ray intersection
 // assumes there is an intersection between t & ray already calculated
 inline FancyIntersection FancyIntersect(
-        float dist, 
-        TrianglePos const& p, 
+        MiniIntersection const& mini, 
         TriangleExtra const& t, 
         Ray const& ray,
         bool smooth){
-    assert(dist < INFINITY);
+    assert(mini.distance < INFINITY);
     t.sanityCheck();
 
-    glm::vec3 hit = ray.origin + ray.direction * dist;
+    glm::vec3 hit = ray.origin + ray.direction * mini.distance;
     glm::vec3 normal;
     // smoothing
     if(smooth){
-        glm::vec3 bary = barycentric(hit, p);
-        normal = glm::normalize(bary.x*t.n[0] + bary.y*t.n[1] + bary.z*t.n[2]);
+        // the intersector's barycentrics weight the vertex normals
+        normal = glm::normalize((1.0f - mini.u - mini.v)*t.n[0] + mini.u*t.n[1] + mini.v*t.n[2]);
     }else{
-        // so we take the simple average normal of the 3 per-vertex normals.
-        // we could precalc this of course. This raises the whole question of how to store
-        // smoothed / non smoothed objects (etc)
-        normal = glm::normalize((t.n[0] + t.n[1] + t.n[2]) / 3.0f);
+        normal = t.faceNormal;
     }
 
     assert(glm::isNormalized(normal, EPSILON));
@@ -167,7 +166,9 @@ inline FancyIntersection FancyIntersect(
 
 // adapted from:
 // https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm
-inline float moller_trumbore(TrianglePos const& tri, Ray const& ray) {
+// on a hit, @hitU and @hitV are set to its barycentrics (see MiniIntersection) - on a miss they're
+// left as they were
+inline float moller_trumbore(TrianglePos const& tri, Ray const& ray, float& hitU, float& hitV) {
     // Find vectors for two edges sharing V1
     glm::vec3 e1 = tri.v[1] - tri.v[0];
     glm::vec3 e2 = tri.v[2] - tri.v[0];
@@ -207,13 +208,99 @@ inline float moller_trumbore(TrianglePos const& tri, Ray const& ray) {
 
     float ret = glm::dot(e2, q) * inv_det;
 
-    if(ret > EPSILON)  // ray intersection
+    if(ret > EPSILON) { // ray intersection
+        hitU = u;
+        hitV = v;
         return ret;
+    }
 
     // No hit, no win
     return INFINITY;
 }
 
+inline float moller_trumbore(TrianglePos const& tri, Ray const& ray) {
+    float u = 0.f, v = 0.f;
+    return moller_trumbore(tri, ray, u, v);
+}
+
+// the per ray part of the watertight test below. worked out once per ray, not per triangle
+struct WatertightRay {
+    WatertightRay(Ray const& ray) {
+        // kz is the ray's dominant axis. swapping kx/ky when it points down kz keeps the winding, so
+        // the sign of the determinant still means the same thing
+        glm::vec3 const a = glm::abs(ray.direction);
+        kz = (a.x > a.y) ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        if(ray.direction[kz] < 0.0f)
+            std::swap(kx, ky);
+
+        // shear that takes the ray direction to +z
+        sx = ray.direction[kx] / ray.direction[kz];
+        sy = ray.direction[ky] / ray.direction[kz];
+        sz = 1.0f / ray.direction[kz];
+    }
+
+    int kx, ky, kz;     // axis permutation
+    float sx, sy, sz;   // shear
+};
+
+// watertight ray/triangle test, from Woop, Benthin & Wald's "Watertight Ray/Triangle Intersection".
+// The triangle is moved into a space where the ray starts at the origin and runs along +z, and the
+// hit is decided by the signs of 2D edge functions there. Neighbouring triangles work out their
+// shared edge's function from the same two (transformed) vertices, so a ray can't slip between them
+// the way it can with moller_trumbore, and there's no determinant epsilon to drop thin triangles.
+// Returns the distance along the ray, or INFINITY on a miss - the same as moller_trumbore, barycentrics too.
+inline float watertight(TrianglePos const& tri, Ray const& ray, WatertightRay const& w, float& hitU, float& hitV) {
+    // vertices relative to the ray origin
+    glm::vec3 const a = tri.v[0] - ray.origin;
+    glm::vec3 const b = tri.v[1] - ray.origin;
+    glm::vec3 const c = tri.v[2] - ray.origin;
+
+    // shear and scale
+    float const ax = a[w.kx] - w.sx * a[w.kz];
+    float const ay = a[w.ky] - w.sy * a[w.kz];
+    float const bx = b[w.kx] - w.sx * b[w.kz];
+    float const by = b[w.ky] - w.sy * b[w.kz];
+    float const cx = c[w.kx] - w.sx * c[w.kz];
+    float const cy = c[w.ky] - w.sy * c[w.kz];
+
+    // scaled barycentrics, ie the 2D edge functions. done in double, where the products are exact and
+    // the difference is rounded just once - so the triangle on the other side of an edge always gets
+    // exactly minus this, whatever order it has the vertices in and whether the compiler fuses the
+    // multiply-adds or not (float with FMA contraction does leave gaps)
+    double const u = (double)cx * by - (double)cy * bx;
+    double const v = (double)ax * cy - (double)ay * cx;
+    double const e = (double)bx * ay - (double)by * ax;
+
+    // inside means all the same sign, either way round - we don't cull back faces
+    if((u < 0.0 || v < 0.0 || e < 0.0) && (u > 0.0 || v > 0.0 || e > 0.0))
+        return INFINITY;
+
+    double const det = u + v + e;
+    if(det == 0.0)
+        return INFINITY;
+
+    // distance, from the barycentric weighted vertex depths. the depths nearly cancel for a ray
+    // leaving the surface it's on, so this is done in double too, or shadow rays hit their own triangle
+    float const t = (float)(w.sz * (u * a[w.kz] + v * b[w.kz] + e * c[w.kz]) / det);
+
+    // same cut off as moller_trumbore, so the two find the same hits off a surface
+    if(t > EPSILON) {
+        // u, v and e weight a, b and c
+        hitU = (float)(v / det);
+        hitV = (float)(e / det);
+        return t;
+    }
+
+    return INFINITY;
+}
+
+inline float watertight(TrianglePos const& tri, Ray const& ray, WatertightRay const& w) {
+    float u = 0.f, v = 0.f;
+    return watertight(tri, ray, w, u, v);
+}
+
 // slice (clip) a triangle by an axis-aligned plane perpendicular to @axis at point @splitPoint
 // the two intersection points are returned in @res
 // splitPoint must be within the range of the triangle on the given axis
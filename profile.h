@@ -0,0 +1,351 @@
+#pragma once
+
+#include "basics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Instrumentation - per thread counters, and scoped timing zones.
+//
+// Every thread gets its own block of counters (cache line aligned, so threads never share a line)
+// which it bumps without any locking. Totals are summed over all the blocks, which should only be
+// done between frames, when the render threads are idle.
+//
+// Ray counts by kind are always collected - it's one increment per ray, and the benchmarks depend
+// on them. Everything else (nodes/triangles visited, shadow occlusion, timing zones) only happens
+// when profiling is switched on with setProfiling(true). Switched off, each costs a single flag check.
+//
+// Zones nest, and are recorded per thread. profileEndFrame() aggregates everything since the previous
+// call and dumps it to the console. writeChromeTrace() writes the lot out in the chrome://tracing
+// (or perfetto) json format.
+
+struct alignas(64) ProfileCounters {
+    ProfileCounters() {
+        reset();
+    }
+
+    void reset() {
+        for(auto& r : rays)
+            r = 0;
+        nodesVisited = 0;
+        trianglesTested = 0;
+        shadowOccluded = 0;
+        shadowSkipped = 0;
+    }
+
+    void add(ProfileCounters const& other) {
+        for(int i = 0; i < RAY_KIND_COUNT; i++)
+            rays[i] += other.rays[i];
+        nodesVisited += other.nodesVisited;
+        trianglesTested += other.trianglesTested;
+        shadowOccluded += other.shadowOccluded;
+        shadowSkipped += other.shadowSkipped;
+    }
+
+    // this - other, ie the counts since @other was taken
+    ProfileCounters since(ProfileCounters const& other) const {
+        ProfileCounters res;
+        for(int i = 0; i < RAY_KIND_COUNT; i++)
+            res.rays[i] = rays[i] - other.rays[i];
+        res.nodesVisited = nodesVisited - other.nodesVisited;
+        res.trianglesTested = trianglesTested - other.trianglesTested;
+        res.shadowOccluded = shadowOccluded - other.shadowOccluded;
+        res.shadowSkipped = shadowSkipped - other.shadowSkipped;
+        return res;
+    }
+
+    uint64_t get(RayKind k) const {
+        return rays[(int)k];
+    }
+
+    uint64_t totalRays() const {
+        uint64_t sum = 0;
+        for(auto r : rays)
+            sum += r;
+        return sum;
+    }
+
+    uint64_t rays[RAY_KIND_COUNT]; // always collected
+    uint64_t nodesVisited;         // inner + leaf nodes, profiling only
+    uint64_t trianglesTested;      // profiling only
+    uint64_t shadowOccluded;       // shadow rays that hit something, profiling only
+    uint64_t shadowSkipped;        // lights that didn't need a shadow ray - out of reach, or too dim. always collected
+};
+
+// a finished zone
+struct ZoneEvent {
+    char const* name;   // must be a string literal (or otherwise live forever)
+    int64_t start;      // ns since the profiler started
+    int64_t duration;   // ns
+    int depth;          // nesting depth on its thread, 0 = outermost
+    int frame;          // frame it finished in
+};
+
+struct ThreadProfile;
+
+struct ProfileState {
+    ProfileState() : enabled(false), nextThreadId(0), frame(0), start(std::chrono::steady_clock::now()) {}
+
+    int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    bool enabled;
+
+    std::mutex mutex;
+    std::vector<ThreadProfile*> live;
+    ProfileCounters retiredCounters;            // from threads that have since exited
+    std::vector<std::pair<int, ZoneEvent>> retiredEvents; // thread id + event
+    int nextThreadId;
+
+    int frame;                                  // current frame number
+    ProfileCounters frameStartCounters;         // totals at the end of the previous frame
+    std::vector<std::pair<int64_t, ProfileCounters>> frameCounters; // per frame - end time, counts
+
+    std::chrono::steady_clock::time_point start;
+};
+
+inline ProfileState& profileState() {
+    static ProfileState state;
+    return state;
+}
+
+inline bool profilingEnabled() {
+    return profileState().enabled;
+}
+
+// per thread data, which registers itself on first use
+struct ThreadProfile {
+    ThreadProfile() : depth(0) {
+        ProfileState& s = profileState();
+        std::unique_lock<std::mutex> lock(s.mutex);
+        id = s.nextThreadId++;
+        s.live.push_back(this);
+    }
+
+    ~ThreadProfile() {
+        ProfileState& s = profileState();
+        std::unique_lock<std::mutex> lock(s.mutex);
+        s.retiredCounters.add(counters);
+        for(auto const& e : events)
+            s.retiredEvents.emplace_back(id, e);
+        s.live.erase(std::find(s.live.begin(), s.live.end(), this));
+    }
+
+    ProfileCounters counters;
+
+    // events can be read while other threads are still going (eg the output thread), so they're
+    // guarded - only ever contended while dumping
+    std::mutex eventMutex;
+    std::vector<ZoneEvent> events;
+
+    int depth;  // current zone nesting
+    int id;     // small sequential id, for the trace
+};
+
+inline ThreadProfile& threadProfile() {
+    thread_local ThreadProfile profile;
+    return profile;
+}
+
+inline void countRay(RayKind k) {
+    threadProfile().counters.rays[(int)k]++;
+}
+
+// only call when profiling is enabled
+inline void countTraversal(unsigned int nodes, unsigned int triangles) {
+    ProfileCounters& c = threadProfile().counters;
+    c.nodesVisited += nodes;
+    c.trianglesTested += triangles;
+}
+
+inline void countShadowOccluded() {
+    threadProfile().counters.shadowOccluded++;
+}
+
+inline void countShadowSkipped(unsigned int lights) {
+    threadProfile().counters.shadowSkipped += lights;
+}
+
+// sum over all threads
+inline ProfileCounters totalProfileCounters() {
+    ProfileState& s = profileState();
+    std::unique_lock<std::mutex> lock(s.mutex);
+
+    ProfileCounters res = s.retiredCounters;
+    for(auto t : s.live)
+        res.add(t->counters);
+    return res;
+}
+
+inline void resetProfileCounters() {
+    ProfileState& s = profileState();
+    std::unique_lock<std::mutex> lock(s.mutex);
+
+    s.retiredCounters.reset();
+    s.frameStartCounters.reset();
+    for(auto t : s.live)
+        t->counters.reset();
+}
+
+// times its own scope, if profiling is enabled
+// usage: ProfileZone zone("bvh build");
+struct ProfileZone {
+    ProfileZone(char const* _name) : name(_name), start(-1) {
+        if(profilingEnabled()) {
+            start = profileState().now();
+            threadProfile().depth++;
+        }
+    }
+
+    ~ProfileZone() {
+        if(start < 0)
+            return;
+
+        ProfileState& s = profileState();
+        ThreadProfile& t = threadProfile();
+        t.depth--;
+
+        ZoneEvent e = {name, start, s.now() - start, t.depth, s.frame};
+        std::unique_lock<std::mutex> lock(t.eventMutex);
+        t.events.push_back(e);
+    }
+
+    ProfileZone(ProfileZone const&) = delete;
+    ProfileZone& operator=(ProfileZone const&) = delete;
+
+    char const* name;
+    int64_t start; // -1 if profiling was off when we were created
+};
+
+// switch profiling on/off. only between frames
+inline void setProfiling(bool enabled) {
+    profileState().enabled = enabled;
+}
+
+// every event so far, tagged with its thread id
+inline std::vector<std::pair<int, ZoneEvent>> collectZoneEvents() {
+    ProfileState& s = profileState();
+    std::unique_lock<std::mutex> lock(s.mutex);
+
+    std::vector<std::pair<int, ZoneEvent>> res = s.retiredEvents;
+    for(auto t : s.live) {
+        std::unique_lock<std::mutex> eventLock(t->eventMutex);
+        for(auto const& e : t->events)
+            res.emplace_back(t->id, e);
+    }
+    return res;
+}
+
+// finish the current frame - print its counters, and a summary of the zones which finished during
+// it (summed over threads, in the order they started). @label names it in the output.
+// Returns the frame's counters.
+inline ProfileCounters profileEndFrame(std::string const& label, std::ostream& os = std::cout) {
+    ProfileState& s = profileState();
+
+    ProfileCounters total = totalProfileCounters();
+    ProfileCounters frame = total.since(s.frameStartCounters);
+
+    std::vector<std::pair<int, ZoneEvent>> events = collectZoneEvents();
+
+    // zone totals, keyed by depth + name. keep the first start time for ordering
+    struct ZoneTotal {
+        int64_t firstStart;
+        int64_t duration;
+        int count;
+    };
+    std::map<std::pair<int, std::string>, ZoneTotal> zones;
+    for(auto const& te : events) {
+        ZoneEvent const& e = te.second;
+        if(e.frame != s.frame)
+            continue;
+
+        auto it = zones.find(std::make_pair(e.depth, e.name));
+        if(it == zones.end()) {
+            zones[std::make_pair(e.depth, std::string(e.name))] = ZoneTotal{e.start, e.duration, 1};
+        } else {
+            it->second.firstStart = std::min(it->second.firstStart, e.start);
+            it->second.duration += e.duration;
+            it->second.count++;
+        }
+    }
+
+    std::vector<std::pair<int64_t, std::string>> lines;
+    for(auto const& z : zones) {
+        char line[256];
+        snprintf(line, sizeof(line), "  %*s%-24s %10.3fms x%d", z.first.first * 2, "", z.first.second.c_str(),
+                 z.second.duration / 1e6, z.second.count);
+        lines.emplace_back(z.second.firstStart, line);
+    }
+    std::sort(lines.begin(), lines.end());
+
+    uint64_t const rays = frame.totalRays();
+    uint64_t const shadows = frame.get(RayKind::Shadow);
+
+    os << "profile " << label << ": rays";
+    for(int k = 0; k < RAY_KIND_COUNT; k++)
+        os << " " << GetRayKindStr((RayKind)k) << " " << frame.rays[k];
+    os << " | shadow rays skipped " << frame.shadowSkipped;
+    if(s.enabled && rays > 0) {
+        os << " | nodes/ray " << (double)frame.nodesVisited / rays;
+        os << " tris/ray " << (double)frame.trianglesTested / rays;
+        if(shadows > 0)
+            os << " | shadow occlusion " << 100.0 * frame.shadowOccluded / shadows << "%";
+    }
+    os << "\n";
+    for(auto const& l : lines)
+        os << l.second << "\n";
+    os << std::flush;
+
+    s.frameCounters.emplace_back(s.now(), frame);
+    s.frameStartCounters = total;
+    s.frame++;
+    return frame;
+}
+
+// dump every zone (and the per frame counters) in chrome trace event format
+inline bool writeChromeTrace(std::string const& fname) {
+    std::vector<std::pair<int, ZoneEvent>> events = collectZoneEvents();
+    ProfileState& s = profileState();
+
+    std::ofstream out(fname);
+    out << "{\"traceEvents\" : [\n";
+
+    bool first = true;
+    for(auto const& te : events) {
+        ZoneEvent const& e = te.second;
+        out << (first ? "" : ",\n");
+        out << "{\"name\" : \"" << e.name << "\", \"ph\" : \"X\", \"pid\" : 1, \"tid\" : " << te.first;
+        out << ", \"ts\" : " << e.start / 1000.0 << ", \"dur\" : " << e.duration / 1000.0;
+        out << ", \"args\" : {\"frame\" : " << e.frame << "}}";
+        first = false;
+    }
+
+    for(auto const& fc : s.frameCounters) {
+        ProfileCounters const& c = fc.second;
+        out << (first ? "" : ",\n");
+        out << "{\"name\" : \"rays\", \"ph\" : \"C\", \"pid\" : 1, \"ts\" : " << fc.first / 1000.0 << ", \"args\" : {";
+        for(int k = 0; k < RAY_KIND_COUNT; k++)
+            out << (k ? ", " : "") << "\"" << GetRayKindStr((RayKind)k) << "\" : " << c.rays[k];
+        out << "}}";
+        first = false;
+    }
+
+    out << "\n]}\n";
+
+    if(!out) {
+        std::cout << "ERROR: couldn't write trace " << fname << std::endl;
+        return false;
+    }
+    std::cout << "wrote " << events.size() << " profile zones to " << fname << std::endl;
+    return true;
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include "basics.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Ray recording, for replaying a real render's rays through the traversal code on their own.
+// When recording is switched on, the traversal entry point appends every ray to a per-thread buffer,
+// so there's no contention between render threads. When it's off, the cost is a single flag check
+// per ray.
+
+// a ray, as written to a ray file
+struct RecordedRay {
+    RecordedRay() {}
+    RecordedRay(Ray const& r, float _maxDist, bool _anyHit) :
+        origin{r.origin.x, r.origin.y, r.origin.z},
+        direction{r.direction.x, r.direction.y, r.direction.z},
+        maxDist(_maxDist),
+        kind((uint8_t)r.kind),
+        anyHit(_anyHit ? 1 : 0),
+        pad(0)
+    {}
+
+    Ray toRay() const {
+        return Ray(glm::vec3(origin[0], origin[1], origin[2]),
+                   glm::vec3(direction[0], direction[1], direction[2]),
+                   0, STARTING_TTL, (RayKind)kind);
+    }
+
+    float origin[3];
+    float direction[3];
+    float maxDist;      // only meaningful for any hit (ie shadow) queries
+    uint8_t kind;       // RayKind
+    uint8_t anyHit;     // 1 for any hit queries, 0 for closest hit
+    uint16_t pad;
+};
+
+static_assert(sizeof(RecordedRay) == 32, "RecordedRay size");
+
+struct RayRecordRegistry {
+    RayRecordRegistry() : enabled(false) {}
+
+    std::mutex mutex;
+    std::vector<std::vector<RecordedRay>*> live;
+    std::vector<RecordedRay> retired; // rays from threads that have since exited
+    bool enabled;
+};
+
+inline RayRecordRegistry& rayRecordRegistry() {
+    static RayRecordRegistry registry;
+    return registry;
+}
+
+// a thread's own buffer, which registers itself on first use
+struct ThreadRayRecord {
+    ThreadRayRecord() {
+        RayRecordRegistry& r = rayRecordRegistry();
+        std::unique_lock<std::mutex> lock(r.mutex);
+        r.live.push_back(&rays);
+    }
+
+    ~ThreadRayRecord() {
+        RayRecordRegistry& r = rayRecordRegistry();
+        std::unique_lock<std::mutex> lock(r.mutex);
+        r.retired.insert(r.retired.end(), rays.begin(), rays.end());
+        for(auto it = r.live.begin(); it != r.live.end(); ++it) {
+            if(*it == &rays) {
+                r.live.erase(it);
+                break;
+            }
+        }
+    }
+
+    std::vector<RecordedRay> rays;
+};
+
+inline bool rayRecordingEnabled() {
+    return rayRecordRegistry().enabled;
+}
+
+inline void recordRay(Ray const& ray, float maxDist, bool anyHit) {
+    thread_local ThreadRayRecord record;
+    record.rays.emplace_back(ray, maxDist, anyHit);
+}
+
+// only call these between frames, when the render threads are idle
+inline void startRayRecording() {
+    RayRecordRegistry& r = rayRecordRegistry();
+    std::unique_lock<std::mutex> lock(r.mutex);
+    r.retired.clear();
+    for(auto rays : r.live)
+        rays->clear();
+    r.enabled = true;
+}
+
+// stop recording, and hand back everything recorded since startRayRecording()
+inline std::vector<RecordedRay> stopRayRecording() {
+    RayRecordRegistry& r = rayRecordRegistry();
+    std::unique_lock<std::mutex> lock(r.mutex);
+    r.enabled = false;
+
+    std::vector<RecordedRay> res;
+    res.swap(r.retired);
+    for(auto rays : r.live) {
+        res.insert(res.end(), rays->begin(), rays->end());
+        std::vector<RecordedRay>().swap(*rays); // free the memory
+    }
+    return res;
+}
+
+// Ray file format: a small header, followed by the rays as a raw array of RecordedRay.
+// Native endianness - these are scratch files for benchmarking, not for interchange.
+struct RayFileHeader {
+    char magic[4];      // "RAYS"
+    uint32_t version;
+    uint32_t raySize;   // sizeof(RecordedRay), as a sanity check
+    uint32_t pad;
+    uint64_t count;
+};
+
+const uint32_t RAY_FILE_VERSION = 1;
+
+inline bool writeRayFile(std::string const& fname, std::vector<RecordedRay> const& rays) {
+    RayFileHeader header;
+    memcpy(header.magic, "RAYS", 4);
+    header.version = RAY_FILE_VERSION;
+    header.raySize = sizeof(RecordedRay);
+    header.pad = 0;
+    header.count = rays.size();
+
+    std::ofstream out(fname, std::ios::binary);
+    out.write((char const*)&header, sizeof(header));
+    out.write((char const*)rays.data(), rays.size() * sizeof(RecordedRay));
+
+    if(!out) {
+        std::cout << "ERROR: couldn't write ray file " << fname << std::endl;
+        return false;
+    }
+    return true;
+}
+
+inline bool readRayFile(std::string const& fname, std::vector<RecordedRay>& rays) {
+    std::ifstream in(fname, std::ios::binary);
+    RayFileHeader header;
+    in.read((char*)&header, sizeof(header));
+
+    if(!in || memcmp(header.magic, "RAYS", 4) != 0 || header.version != RAY_FILE_VERSION ||
+       header.raySize != sizeof(RecordedRay)) {
+        std::cout << "ERROR: " << fname << " isn't a valid ray file" << std::endl;
+        return false;
+    }
+
+    rays.resize(header.count);
+    in.read((char*)rays.data(), rays.size() * sizeof(RecordedRay));
+    if(!in) {
+        std::cout << "ERROR: ray file " << fname << " is truncated" << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,275 @@
+#pragma once
+
+#include "bench.h"
+#include "bvh.h"
+#include "bvh_build_factory.h"
+#include "bvh_traverse.h"
+#include "loader.h"
+#include "params.h"
+#include "ray_record.h"
+#include "render.h"
+#include "scene.h"
+#include "timer.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Traversal microbenchmark: record every ray from a real render to a file, then replay just those
+// rays through the BVH - no camera, no shading - so traversal/intersection changes can be compared
+// like for like on a real workload.
+
+// load a scene, ready for recording or replay, at the bench resolution
+inline bool loadBenchScene(std::string const& inputDir, std::string const& sceneFile, BenchOptions const& opts, Scene& s) {
+    if(!setupScene(inputDir, sceneFile, s) || s.primitives.pos.size() == 0) {
+        std::cout << "ERROR: failed to setup scene " << sceneFile << std::endl;
+        return false;
+    }
+
+    s.camera.width = opts.width;
+    s.camera.height = opts.height;
+    s.camera.resetView();
+    return true;
+}
+
+// render the scene once (with the first of opts.methods and opts.triangleTests), writing every ray cast to @rayFile
+int recordRays(std::string const& inputDir, std::string const& sceneFile, BenchOptions const& opts,
+               std::string const& rayFile) {
+    Scene s;
+    if(!loadBenchScene(inputDir, sceneFile, opts, s))
+        return -1;
+
+    Params p;
+    p.setVisMode(opts.visMode);
+    p.triangleTest = opts.triangleTests.front();
+    BVH* bvh = buildBVH(s, opts.methods.front(), opts.bvhOptions);
+    p.autoSetVisScale((float)bvh->maxDepth);
+
+    ScreenBuffer screenBuffer(opts.width * opts.height);
+    int const passes = IsProgressive(p.visMode) ? opts.spp : 1;
+
+    startRayRecording();
+    for(int pass = 0; pass < passes; pass++)
+        renderFrame(s, *bvh, p, screenBuffer, pass);
+    std::vector<RecordedRay> rays = stopRayRecording();
+
+    delete bvh;
+
+    uint64_t perKind[RAY_KIND_COUNT] = {};
+    for(auto const& r : rays)
+        perKind[r.kind]++;
+
+    std::cout << "recorded " << rays.size() << " rays (";
+    for(int k = 0; k < RAY_KIND_COUNT; k++)
+        std::cout << (k ? ", " : "") << GetRayKindStr((RayKind)k) << " " << perKind[k];
+    std::cout << ") to " << rayFile << std::endl;
+
+    return writeRayFile(rayFile, rays) ? 0 : -1;
+}
+
+// stats for replaying a set of rays
+struct ReplayStats {
+    ReplayStats() : rays(0), time(0.0f), nodes(0), triangles(0), hits(0) {}
+
+    uint64_t rays;
+    float time;         // median seconds to trace them all
+    uint64_t nodes;     // inner + leaf nodes visited
+    uint64_t triangles; // triangles intersected
+    uint64_t hits;
+};
+
+// result of replaying a ray file against one BVH method + node format + traversal mode + triangle test
+struct ReplayResult {
+    BVHMethod method;
+    NodeFormat nodeFormat;
+    TraversalMode traversalMode;
+    TriangleTest triangleTest;
+    ReplayStats perKind[RAY_KIND_COUNT];
+    ReplayStats total;
+    uint64_t checksum;  // over every ray's result - identical between variants unless results differ
+};
+
+// a single ray's hit result, as fed into the checksum. For closest hit queries that's the triangle,
+// for any hit queries just hit or miss (which triangle is found first legitimately varies)
+template<class DiagType>
+inline uint32_t replayRay(RecordedRay const& rr, BVH const& bvh, Primitives const& prims, TraversalMode trav,
+                          TriangleTest test, DiagType& diag) {
+    Ray ray = rr.toRay();
+    if(rr.anyHit)
+        return findAnyIntersectionBVH(bvh, prims, ray, rr.maxDist, diag, trav, test) ? 1 : 0;
+
+    MiniIntersection hit = findClosestIntersectionBVH(bvh, prims, ray, diag, trav, test);
+    return hit.hit() ? hit.triangle + 1 : 0;
+}
+
+inline ReplayResult replayRays(std::vector<std::vector<RecordedRay>> const& byKind, Scene const& s, BVH const& bvh,
+                               TraversalMode trav, TriangleTest test, int runs) {
+    ReplayResult res;
+    res.method = BVHMethod::_MAX;
+    res.nodeFormat = bvh.nodeFormat;
+    res.traversalMode = trav;
+    res.triangleTest = test;
+    res.checksum = 0;
+
+    for(int k = 0; k < RAY_KIND_COUNT; k++) {
+        std::vector<RecordedRay> const& rays = byKind[k];
+        ReplayStats& stats = res.perKind[k];
+        stats.rays = rays.size();
+        if(rays.empty())
+            continue;
+
+        // timed runs - no diagnostics, so this is the real kernel
+        std::vector<float> times;
+        for(int run = -1; run < runs; run++) {
+            Timer t;
+            #pragma omp parallel for schedule(dynamic, 256)
+            for(int i = 0; i < (int)rays.size(); i++) {
+                NullCollector diag;
+                replayRay(rays[i], bvh, s.primitives, trav, test, diag);
+            }
+            float time = t.sample();
+            if(run >= 0)
+                times.push_back(time);
+        }
+        stats.time = percentile(times, 50.0f);
+
+        // then once more collecting stats, and the checksum. mix in each ray's position so a
+        // swapped pair of results still changes the sum
+        uint64_t nodes = 0, triangles = 0, hits = 0, checksum = 0;
+        #pragma omp parallel for schedule(dynamic, 256) reduction(+:nodes, triangles, hits, checksum)
+        for(int i = 0; i < (int)rays.size(); i++) {
+            DiagnosticCollector diag;
+            uint32_t result = replayRay(rays[i], bvh, s.primitives, trav, test, diag);
+            nodes += diag.splitsTraversed + diag.leavesChecked;
+            triangles += diag.trianglesChecked;
+            hits += result ? 1 : 0;
+            checksum += hash32(hash32((uint32_t)i ^ ((uint32_t)k << 28)) ^ result);
+        }
+        stats.nodes = nodes;
+        stats.triangles = triangles;
+        stats.hits = hits;
+        res.checksum += checksum;
+
+        res.total.rays += stats.rays;
+        res.total.time += stats.time;
+        res.total.nodes += stats.nodes;
+        res.total.triangles += stats.triangles;
+        res.total.hits += stats.hits;
+    }
+
+    return res;
+}
+
+inline void printReplayStats(char const* name, ReplayStats const& stats) {
+    if(stats.rays == 0)
+        return;
+    printf("  %-10s %10llu rays %8.3f Mrays/s %7.2f nodes/ray %7.2f tris/ray %5.1f%% hit\n", name,
+           (unsigned long long)stats.rays, mraysPerSec(stats.rays, stats.time),
+           (double)stats.nodes / stats.rays, (double)stats.triangles / stats.rays,
+           100.0 * stats.hits / stats.rays);
+}
+
+inline void writeReplayStatsJson(std::ostream& os, ReplayStats const& stats) {
+    os << "{\"rays\" : " << stats.rays << ", \"time\" : " << stats.time;
+    os << ", \"mrays_per_sec\" : " << mraysPerSec(stats.rays, stats.time);
+    os << ", \"nodes_per_ray\" : " << (stats.rays ? (double)stats.nodes / stats.rays : 0.0);
+    os << ", \"tris_per_ray\" : " << (stats.rays ? (double)stats.triangles / stats.rays : 0.0);
+    os << ", \"hits\" : " << stats.hits << "}";
+}
+
+inline void writeReplayJson(std::ostream& os, std::string const& sceneFile, std::string const& rayFile,
+                            std::vector<ReplayResult> const& results, BenchOptions const& opts) {
+    os << "{\n";
+    os << "  \"scene\" : \"" << sceneFile << "\", \"ray_file\" : \"" << rayFile << "\", \"runs\" : " << opts.runs << ",\n";
+    os << "  \"results\" : [\n";
+    for(unsigned int i = 0; i < results.size(); i++) {
+        ReplayResult const& r = results[i];
+        char checksum[32];
+        snprintf(checksum, sizeof(checksum), "%016llx", (unsigned long long)r.checksum);
+
+        os << "    {\"bvh\" : \"" << GetBVHMethodStr(r.method) << "\"";
+        os << ", \"node_format\" : \"" << GetNodeFormatStr(r.nodeFormat) << "\"";
+        os << ", \"traversal\" : \"" << GetTraversalModeStr(r.traversalMode) << "\"";
+        os << ", \"triangle_test\" : \"" << GetTriangleTestStr(r.triangleTest) << "\"";
+        os << ", \"checksum\" : \"" << checksum << "\"";
+        os << ", \"total\" : ";
+        writeReplayStatsJson(os, r.total);
+        for(int k = 0; k < RAY_KIND_COUNT; k++) {
+            os << ", \"" << GetRayKindStr((RayKind)k) << "\" : ";
+            writeReplayStatsJson(os, r.perKind[k]);
+        }
+        os << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n";
+    os << "}\n";
+}
+
+// replay @rayFile against every method in opts.methods, node format in opts.nodeFormats and triangle
+// test in opts.triangleTests, with both traversal modes
+int replayRayFile(std::string const& inputDir, std::string const& sceneFile, BenchOptions const& opts,
+                  std::string const& rayFile) {
+    std::vector<RecordedRay> rays;
+    if(!readRayFile(rayFile, rays))
+        return -1;
+
+    Scene s;
+    if(!loadBenchScene(inputDir, sceneFile, opts, s))
+        return -1;
+
+    // replay each kind separately, so eg coherent primaries and incoherent bounces can be told apart
+    std::vector<std::vector<RecordedRay>> byKind(RAY_KIND_COUNT);
+    for(auto const& r : rays) {
+        if(r.kind >= RAY_KIND_COUNT) {
+            std::cout << "ERROR: bad ray kind in " << rayFile << std::endl;
+            return -1;
+        }
+        byKind[r.kind].push_back(r);
+    }
+    std::cout << "replaying " << rays.size() << " rays from " << rayFile << std::endl;
+
+    std::vector<ReplayResult> results;
+    for(BVHMethod method : opts.methods) {
+        BVH* bvh = buildBVH(s, method, opts.bvhOptions);
+
+        // the same tree in each format, so only the node format differs
+        for(NodeFormat format : opts.nodeFormats) {
+            printQuantizeStats(quantizeBVH(*bvh, format));
+
+            for(TraversalMode trav : {TraversalMode::Ordered, TraversalMode::Distance, TraversalMode::Unordered}) {
+                for(TriangleTest test : opts.triangleTests) {
+                    results.push_back(replayRays(byKind, s, *bvh, trav, test, opts.runs));
+                    ReplayResult& r = results.back();
+                    r.method = method;
+
+                    printf("replay %s %s %s %s checksum %016llx\n", GetBVHMethodStr(method), GetNodeFormatStr(format),
+                           GetTraversalModeStr(trav), GetTriangleTestStr(test), (unsigned long long)r.checksum);
+                    for(int k = 0; k < RAY_KIND_COUNT; k++)
+                        printReplayStats(GetRayKindStr((RayKind)k), r.perKind[k]);
+                    printReplayStats("total", r.total);
+                }
+            }
+        }
+
+        delete bvh;
+    }
+
+    std::ofstream out(opts.outputFile);
+    writeReplayJson(out, sceneFile, rayFile, results, opts);
+    if(!out) {
+        std::cout << "ERROR: couldn't write " << opts.outputFile << std::endl;
+        return -1;
+    }
+    std::cout << "wrote replay results to " << opts.outputFile << std::endl;
+
+    // every variant should agree on what each ray hit
+    for(auto const& r : results) {
+        if(r.checksum != results.front().checksum) {
+            std::cout << "WARNING: hit checksums differ between variants" << std::endl;
+            break;
+        }
+    }
+    return 0;
+}
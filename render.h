@@ -1,11 +1,16 @@
 #pragma once
 
 #include "bvh.h"
+#include "display.h"
 #include "params.h"
+#include "perf_counters.h"
+#include "profile.h"
 #include "scene.h"
 #include "trace.h"
 #include "pathtrace.h"
 
+#include <atomic>
+
 // This file contains the render main loop, and all the pixel colouring code (ie the diagnostic visualisations)
 
 Color value_to_color(float x){
@@ -16,24 +21,41 @@ Color value_to_color(float x){
     else         {x-=4; return Color(  1,1-x,  0);} // yellow-> red
 }
 
-// Do a recursive ray trace (ie the default output)
+// a camera ray's hit, waiting to be shaded - see renderDeferredLoop
+struct DeferredHit {
+    DeferredHit(Ray const& r) : ray(r), mat(0) {}
+
+    Ray ray;
+    MiniIntersection hit;
+    FancyIntersection fancy;    // these two only for hits
+    int mat;                    // already checkered, see ShadingTable::resolve
+};
+
+// Do a whitted ray trace (ie the default output)
 struct StandardRenderer {
     static Color renderPixel(Ray const& r, Scene const& s, BVH const& bvh, Params const& p, int _, Color const& __) {
         Color col = trace(r, bvh, s.primitives, s.lights, BLACK, p);
         return colorClamp(col);
     }
+
+    // the same, with the camera ray already intersected
+    static Color shadePixel(DeferredHit const& d, Scene const& s, BVH const& bvh, Params const& p, int _, Color const& __) {
+        if(!d.hit.hit())
+            return BLACK;
+        Color col = shadeHit(d.ray, d.hit.distance, d.fancy, d.mat, bvh, s.primitives, s.lights, BLACK, p);
+        return colorClamp(col);
+    }
 };
 
 // render surface normals
 struct NormalRenderer {
     static Color renderPixel(Ray const& r, Scene const& s, BVH const& bvh, Params const& p, int _, Color const& __) {
-        auto hit = findClosestIntersectionBVH(bvh, s.primitives, r, p.traversalMode);
+        auto hit = findClosestIntersectionBVH(bvh, s.primitives, r, p.traversalMode, p.triangleTest);
 
         if(hit.distance < INFINITY) {
             // we intersected. calc normal and convert to a col
-            TrianglePos const& pos = s.primitives.pos[hit.triangle];
             TriangleExtra const& extra = s.primitives.extra[hit.triangle];
-            auto fancy = FancyIntersect(hit.distance, pos, extra, r, p.smoothing);
+            auto fancy = FancyIntersect(hit, extra, r, p.smoothing);
             return Color((1.f+fancy.normal.x)/2.f, (1.f+fancy.normal.y)/2.f,  (1.f+fancy.normal.z)/2.f);
         } else {
             // no intersection
@@ -42,7 +64,7 @@ struct NormalRenderer {
     }
 };
 
-// do a recursive ray trace (ala StandardRenderer), but render the time taken as a color
+// do a whitted ray trace (ala StandardRenderer), but render the time taken as a color
 struct PerformanceRenderer {
     static Color renderPixel(Ray const& r, Scene const& s, BVH const& bvh, Params const& p, int _, Color const& __) {
         auto start = std::chrono::high_resolution_clock::now();
@@ -70,7 +92,7 @@ struct BVHDiagRenderer {
     static Color renderPixel(Ray const& r, Scene const& s, BVH const& bvh, Params const& p, int _, Color const& __) {
         DiagnosticCollector diag;
 
-        auto hit = findClosestIntersectionBVH(bvh, s.primitives, r, diag, p.traversalMode);
+        auto hit = findClosestIntersectionBVH(bvh, s.primitives, r, diag, p.traversalMode, p.triangleTest);
 
         unsigned int intensity = 0; 
         switch(p.visMode) {
@@ -93,6 +115,16 @@ struct BVHDiagRenderer {
 struct PathRenderer {
     static Color renderPixel(Ray const& r, Scene const& s, BVH const& bvh, Params const& p, int passes, Color const& prev) {
         Color new_ = pathTrace(r, bvh, s, p);
+        return accumulate(new_, passes, prev);
+    }
+
+    // the same, with the camera ray already intersected
+    static Color shadePixel(DeferredHit const& d, Scene const& s, BVH const& bvh, Params const& p, int passes, Color const& prev) {
+        Color new_ = d.hit.hit() ? pathShadeHit(d.ray, d.fancy, d.mat, bvh, s, p) : BLACK;
+        return accumulate(new_, passes, prev);
+    }
+
+    static Color accumulate(Color const& new_, int passes, Color const& prev) {
         if(passes == 0) return new_;
         float total = (float)passes;
         Color old = prev*(total-1.f);
@@ -100,55 +132,227 @@ struct PathRenderer {
     }
 };
 
-// openMP works a bit differently on windows - hence the two versions of this function
 // main render loop
 // assumes screenbuffer is big enough to handle the width*height pixels (per the camera)
+// work is handed out a row at a time. if @display is given, each row is also converted for display
+// as soon as it's finished. If @cancel is given, and gets set mid-frame, the remaining rows are skipped.
+// returns false if the frame was cancelled (in which case the buffers are only partially updated)
 template<class PixelRenderer>
-inline void renderLoop(Scene const& s, BVH const& bvh, Params const& p, ScreenBuffer& screenBuffer, int passes) {
+inline bool renderLoop(Scene const& s, BVH const& bvh, Params const& p, ScreenBuffer& screenBuffer, int passes,
+                       DisplayBuffer* display, std::atomic<bool> const* cancel) {
     int const width  = s.camera.width;
     int const height = s.camera.height;
 
     assert(screenBuffer.size() == width * height);
+    assert(!display || display->size() == screenBuffer.size());
 
-#ifndef WIN32
-    #pragma omp parallel for schedule(auto) collapse(2)
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-#else
-	#pragma omp parallel for
+    #pragma omp parallel for schedule(dynamic)
     for (int y = 0; y < height; y++) {
+        // can't break out of an omp loop, so just skip the rest
+        if(cancel && cancel->load(std::memory_order_relaxed))
+            continue;
+
+        unsigned int const rowStart = (height-y-1) * width;
+        seedPathRng(p.seed, passes, y);
+
         for (int x = 0; x < width; x++) {
-#endif
             Ray r = s.camera.makeRay(x, y);
-            unsigned int idx = (height-y-1) * width+ x;
+            unsigned int idx = rowStart + x;
             Color pixel = PixelRenderer::renderPixel(r, s, bvh, p, passes, screenBuffer[idx]);
             
             screenBuffer[idx] = pixel;
         }
+
+        // display buffer is top row first
+        if(display)
+            toneMapRow(&screenBuffer[rowStart], &(*display)[y * width], width, p.colorCorrection);
+    }
+
+    return !(cancel && cancel->load());
+}
+
+// deferred shading (ShadingMode::Deferred), for the renderers with a shadePixel().
+// Shading straight after intersecting means each pixel runs whichever shading path (checkered, dielectric
+// Fresnel, Beer absorption...) on whichever material its ray happened to hit. Instead, a tile's camera rays
+// are all intersected first, then the hits are radix sorted by material flags and then material, and shaded
+// in that order - so runs of pixels take the same path through the shader, on the same material data.
+// Only the camera hits are deferred: the secondary rays the shader traces are still traced on the spot.
+// Whitted images are identical to immediate shading. The path tracer's rng is seeded per tile here rather
+// than per row, so its noise differs.
+const int DEFERRED_TILE_SIZE = 16;
+
+// hits with the same key shade the same way: the flags pick the path through the shader, the material
+// index the data. misses go last
+inline uint32_t deferredShadingKey(ShadingTable const& mats, DeferredHit const& d) {
+    if(!d.hit.hit())
+        return 0xffffffffu;
+    assert((unsigned int)d.mat < (1u << 24));
+    return ((uint32_t)mats.flags[d.mat] << 24) | (uint32_t)d.mat;
+}
+
+template<class PixelRenderer>
+inline bool renderDeferredLoop(Scene const& s, BVH const& bvh, Params const& p, ScreenBuffer& screenBuffer, int passes,
+                               DisplayBuffer* display, std::atomic<bool> const* cancel) {
+    int const width  = s.camera.width;
+    int const height = s.camera.height;
+    int const tilesX = (width + DEFERRED_TILE_SIZE - 1) / DEFERRED_TILE_SIZE;
+    int const tilesY = (height + DEFERRED_TILE_SIZE - 1) / DEFERRED_TILE_SIZE;
+
+    assert(screenBuffer.size() == width * height);
+    assert(!display || display->size() == screenBuffer.size());
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int tile = 0; tile < tilesX * tilesY; tile++) {
+        if(cancel && cancel->load(std::memory_order_relaxed))
+            continue;
+
+        int const x0 = (tile % tilesX) * DEFERRED_TILE_SIZE;
+        int const y0 = (tile / tilesX) * DEFERRED_TILE_SIZE;
+        int const x1 = std::min(x0 + DEFERRED_TILE_SIZE, width);
+        int const y1 = std::min(y0 + DEFERRED_TILE_SIZE, height);
+        int const tileWidth = x1 - x0;
+
+        seedPathRng(p.seed, passes, tile);
+
+        // intersect everything, in pixel order
+        std::vector<DeferredHit> hits;
+        std::vector<uint32_t> keys, order;
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                hits.emplace_back(s.camera.makeRay(x, y));
+                DeferredHit& d = hits.back();
+
+                d.hit = findClosestIntersectionBVH(bvh, s.primitives, d.ray, p.traversalMode, p.triangleTest);
+                if(d.hit.hit()) {
+                    d.fancy = FancyIntersect(d.hit, s.primitives.extra[d.hit.triangle], d.ray, p.smoothing);
+                    d.mat = s.primitives.shading.resolve(d.fancy.mat, d.fancy.impact);
+                }
+
+                keys.push_back(deferredShadingKey(s.primitives.shading, d));
+                order.push_back(order.size());
+            }
+        }
+
+        // then shade them, a material at a time
+        radixSortByKey(keys, order);
+        for (uint32_t i : order) {
+            int const x = x0 + i % tileWidth;
+            int const y = y0 + i / tileWidth;
+            unsigned int const idx = (height-y-1) * width + x;
+            screenBuffer[idx] = PixelRenderer::shadePixel(hits[i], s, bvh, p, passes, screenBuffer[idx]);
+        }
+
+        if(display) {
+            for (int y = y0; y < y1; y++) {
+                unsigned int const rowStart = (height-y-1) * width;
+                toneMapRow(&screenBuffer[rowStart + x0], &(*display)[y * width + x0], tileWidth, p.colorCorrection);
+            }
+        }
     }
+
+    return !(cancel && cancel->load());
+}
+
+// hardware performance counter vis modes.
+// Reading the counters is a syscall, which would swamp a single pixel's work, so the frame is rendered
+// in small tiles instead of rows, with the counters read either side of each tile. Every pixel in a tile
+// gets coloured by the tile's average. The pixels themselves are rendered as per StandardRenderer.
+// A summary of the whole frame is left in lastPerfFrame().
+const int PERF_TILE_SIZE = 8;
+
+inline Color perfCountersToColor(PerfValues const& v, unsigned int pixels, Params const& p) {
+    if(p.visMode == VisMode::IPC) {
+        uint64_t cycles = v.get(PerfEvent::Cycles);
+        float ipc = cycles ? (float)v.get(PerfEvent::Instructions) / cycles : 0.0f;
+        return value_to_color(ipc / 4.0f); // ie red is a 4-wide core flat out
+    }
+
+    float misses = (float)v.get(PerfEvent::L1DMisses) / pixels;
+    return value_to_color(p.visScale * 0.001f * misses);
+}
+
+inline bool renderPerfCountersLoop(Scene const& s, BVH const& bvh, Params const& p, ScreenBuffer& screenBuffer,
+                                   DisplayBuffer* display, std::atomic<bool> const* cancel) {
+    int const width  = s.camera.width;
+    int const height = s.camera.height;
+    int const tilesX = (width + PERF_TILE_SIZE - 1) / PERF_TILE_SIZE;
+    int const tilesY = (height + PERF_TILE_SIZE - 1) / PERF_TILE_SIZE;
+
+    assert(screenBuffer.size() == width * height);
+    assert(!display || display->size() == screenBuffer.size());
+
+    std::vector<PerfValues> tileValues(tilesX * tilesY);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int tile = 0; tile < tilesX * tilesY; tile++) {
+        if(cancel && cancel->load(std::memory_order_relaxed))
+            continue;
+
+        int const x0 = (tile % tilesX) * PERF_TILE_SIZE;
+        int const y0 = (tile / tilesX) * PERF_TILE_SIZE;
+        int const x1 = std::min(x0 + PERF_TILE_SIZE, width);
+        int const y1 = std::min(y0 + PERF_TILE_SIZE, height);
+
+        PerfCounters const& counters = threadPerfCounters();
+        PerfValues const before = counters.read();
+
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                Ray r = s.camera.makeRay(x, y);
+                trace(r, bvh, s.primitives, s.lights, BLACK, p);
+            }
+        }
+
+        PerfValues const delta = counters.read() - before;
+        tileValues[tile] = delta;
+
+        Color const col = perfCountersToColor(delta, (x1 - x0) * (y1 - y0), p);
+        for (int y = y0; y < y1; y++) {
+            unsigned int const rowStart = (height-y-1) * width;
+            for (int x = x0; x < x1; x++)
+                screenBuffer[rowStart + x] = col;
+
+            if(display)
+                toneMapRow(&screenBuffer[rowStart + x0], &(*display)[y * width + x0], x1 - x0, p.colorCorrection);
+        }
+    }
+
+    PerfFrameSummary& summary = lastPerfFrame();
+    summary = PerfFrameSummary();
+    for(auto const& v : tileValues)
+        summary.totals += v;
+    for(int i = 0; i < PERF_EVENT_COUNT; i++)
+        summary.available[i] = threadPerfCounters().has((PerfEvent)i);
+    summary.pixels = (uint64_t)width * height;
+    summary.tiles = tilesX * tilesY;
+
+    return !(cancel && cancel->load());
 }
 
 // select the appropriate pixel renderer and launch the main loop
-inline void renderFrame(Scene& s, BVH const& bvh, Params const& p, ScreenBuffer& screenBuffer, int passes){
+// @display and @cancel are optional - see renderLoop()
+inline bool renderFrame(Scene& s, BVH const& bvh, Params const& p, ScreenBuffer& screenBuffer, int passes,
+                        DisplayBuffer* display = nullptr, std::atomic<bool> const* cancel = nullptr){
+    ProfileZone zone("render");
     switch(p.visMode) {
     case VisMode::PathTrace:
-        renderLoop<PathRenderer>(s, bvh, p, screenBuffer, passes);
-        break;
+        if(p.shadingMode == ShadingMode::Deferred)
+            return renderDeferredLoop<PathRenderer>(s, bvh, p, screenBuffer, passes, display, cancel);
+        return renderLoop<PathRenderer>(s, bvh, p, screenBuffer, passes, display, cancel);
     case VisMode::PathMicroseconds:
-        renderLoop<PathPerformanceRenderer>(s, bvh, p, screenBuffer, passes);
-        break;
+        return renderLoop<PathPerformanceRenderer>(s, bvh, p, screenBuffer, passes, display, cancel);
     case VisMode::Default:
-        renderLoop<StandardRenderer>(s, bvh, p, screenBuffer, passes);
-        break;
+        if(p.shadingMode == ShadingMode::Deferred)
+            return renderDeferredLoop<StandardRenderer>(s, bvh, p, screenBuffer, passes, display, cancel);
+        return renderLoop<StandardRenderer>(s, bvh, p, screenBuffer, passes, display, cancel);
     case VisMode::Normal:
-        renderLoop<NormalRenderer>(s, bvh, p, screenBuffer, passes);
-        break;
+        return renderLoop<NormalRenderer>(s, bvh, p, screenBuffer, passes, display, cancel);
     case VisMode::Microseconds:
-        renderLoop<PerformanceRenderer>(s, bvh, p, screenBuffer, passes);
-        break;
+        return renderLoop<PerformanceRenderer>(s, bvh, p, screenBuffer, passes, display, cancel);
+    case VisMode::CacheMisses:
+    case VisMode::IPC:
+        return renderPerfCountersLoop(s, bvh, p, screenBuffer, display, cancel);
     default:
-        renderLoop<BVHDiagRenderer>(s, bvh, p, screenBuffer, passes);
-        break;
+        return renderLoop<BVHDiagRenderer>(s, bvh, p, screenBuffer, passes, display, cancel);
     }
 }
-
@@ -0,0 +1,191 @@
+#pragma once
+
+#include "bvh.h"
+#include "camera.h"
+#include "display.h"
+#include "params.h"
+#include "render.h"
+#include "scene.h"
+#include "timer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Background renderer for interactive mode.
+// The UI thread hands over a job (camera + params), and the worker renders it progressively:
+// first at 1/8th resolution, then 1/4, 1/2 and finally full resolution. Progressive vis modes
+// (ie path tracing) then keep accumulating passes at full res until the next job arrives.
+// Every completed image is published, and the UI picks up whichever is the latest.
+// A new job cancels the current frame mid-render, so the worker restarts almost instantly.
+struct RenderWorker {
+    // resolution divisors for the progressive levels - the last must be 1
+    static constexpr int LEVEL_SCALES[] = {8, 4, 2, 1};
+    static constexpr int LEVEL_COUNT = sizeof(LEVEL_SCALES) / sizeof(LEVEL_SCALES[0]);
+
+    // a finished image, ready for display
+    struct Image {
+        Image() : width(0), height(0), scale(0), passes(0), renderTime(0.0f) {}
+
+        DisplayBuffer pixels;
+        int width, height;
+        int scale;        // resolution divisor this was rendered at
+        int passes;       // number of passes accumulated (for progressive modes)
+        float renderTime; // seconds taken to render this image (ie the last pass)
+    };
+
+    // @s: the worker owns s.camera from here on. The UI thread must not touch the scene while
+    // the worker is running.
+    RenderWorker(Scene& s) :
+        scene(s),
+        bvh(nullptr),
+        jobPending(false),
+        imageFresh(false),
+        busy(false),
+        quit(false),
+        cancel(false)
+    {
+        worker = std::thread(&RenderWorker::workerLoop, this);
+    }
+
+    ~RenderWorker() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            quit = true;
+            cancel = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+
+    RenderWorker(RenderWorker const&) = delete;
+    RenderWorker& operator=(RenderWorker const&) = delete;
+
+    // abandon whatever we're doing, and start rendering this instead. @camera must be built
+    // at full resolution.
+    void restart(Camera const& camera, Params const& params, BVH const* _bvh) {
+        assert(_bvh);
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobCamera = camera;
+            jobParams = params;
+            bvh = _bvh;
+            jobPending = true;
+            cancel = true;
+        }
+        wake.notify_all();
+    }
+
+    // stop rendering, and wait until the worker is idle. Needed before eg deleting the BVH
+    // call restart() to get going again.
+    void pause() {
+        std::unique_lock<std::mutex> lock(mutex);
+        jobPending = false;
+        bvh = nullptr;
+        cancel = true;
+        idle.wait(lock, [this]{ return !busy; });
+    }
+
+    // if there's an image newer than the last one we took, swap it into @img and return true.
+    // @img's old buffer is recycled by the worker.
+    bool takeLatest(Image& img) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if(!imageFresh)
+            return false;
+
+        std::swap(img, latest);
+        imageFresh = false;
+        return true;
+    }
+
+private:
+    // render a single pass at the given level. returns false if cancelled
+    bool renderPass(Camera const& camera, Params const& params, BVH const& bvh, int scale, int passes) {
+        Image& img = back;
+        img.width = std::max(1, camera.width / scale);
+        img.height = std::max(1, camera.height / scale);
+        img.scale = scale;
+        img.passes = passes + 1;
+
+        scene.camera = camera;
+        scene.camera.width = img.width;
+        scene.camera.height = img.height;
+        scene.camera.buildCamera();
+
+        screenBuffer.resize(img.width * img.height);
+        img.pixels.resize(img.width * img.height);
+
+        Timer t;
+        if(!renderFrame(scene, bvh, params, screenBuffer, passes, &img.pixels, &cancel))
+            return false;
+        img.renderTime = t.sample();
+
+        // hardware counter modes - print a summary of each full res frame
+        if(scale == 1 && IsPerfCounterMode(params.visMode))
+            printPerfFrameSummary(lastPerfFrame());
+
+        // publish
+        std::unique_lock<std::mutex> lock(mutex);
+        std::swap(back, latest);
+        imageFresh = true;
+        return true;
+    }
+
+    void workerLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while(true) {
+            wake.wait(lock, [this]{ return jobPending || quit; });
+            if(quit)
+                return;
+
+            // grab a snapshot of the job, so the UI can carry on changing things
+            Camera camera = jobCamera;
+            Params params = jobParams;
+            BVH const* jobBVH = bvh;
+            jobPending = false;
+            cancel = false;
+            busy = true;
+            lock.unlock();
+
+            bool completed = true;
+            for(int level = 0; level < LEVEL_COUNT && completed; level++) {
+                completed = renderPass(camera, params, *jobBVH, LEVEL_SCALES[level], 0);
+            }
+
+            // keep refining progressive modes until interrupted
+            for(int passes = 1; completed && IsProgressive(params.visMode); passes++) {
+                completed = renderPass(camera, params, *jobBVH, 1, passes);
+            }
+
+            lock.lock();
+            busy = false;
+            idle.notify_all();
+        }
+    }
+
+    Scene& scene;
+    BVH const* bvh;
+
+    // current job - protected by mutex
+    Camera jobCamera;
+    Params jobParams;
+    bool jobPending;
+
+    // images. back is the one being rendered (owned by the worker), latest is the most recently
+    // published one - protected by mutex
+    Image back, latest;
+    bool imageFresh;
+    ScreenBuffer screenBuffer; // worker only
+
+    bool busy;  // worker is rendering a job
+    bool quit;
+    std::atomic<bool> cancel; // set to abandon the current frame
+
+    std::mutex mutex;
+    std::condition_variable wake; // new job, or quitting
+    std::condition_variable idle; // worker has finished with a job
+    std::thread worker;
+};
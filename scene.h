@@ -4,10 +4,14 @@
 #include "lighting.h"
 #include "primitive.h"
 
+#include <vector>
+
 struct Scene{
     Camera camera;
     Primitives primitives;
     Lights lights;
+    // optional keyframes for batch mode - empty if the scene file doesn't define a path
+    std::vector<CameraPose> cameraPath;
 };
 
 
@@ -0,0 +1,322 @@
+#pragma once
+
+#include "bvh.h"
+#include "bvh_build_factory.h"
+#include "loader.h"
+#include "output.h"
+#include "params.h"
+#include "render.h"
+#include "scene.h"
+#include "timer.h"
+
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// Render server mode - a long lived process that renders jobs submitted over a unix domain socket.
+// Loaded scenes and their BVHes are kept in an LRU cache, so repeated jobs on the same scene skip
+// scene loading and BVH building altogether.
+//
+// Protocol: the client sends one job per line, as a json object:
+//   {"scene" : "teapot.scene", "camera" : {<as printCamera()>}, "width" : 320, "height" : 240,
+//    "spp" : 1, "vis_mode" : "0", "bvh" : "SBVH"}
+// only "scene" is required. For each job, the server replies with a single json header line:
+//   {"status" : "ok", "width" : 320, "height" : 240, "format" : "tga", "bytes" : <N>, "render_time" : <sec>}
+// followed by exactly N bytes of image data. On failure, the reply is just the line
+//   {"status" : "error", "message" : "..."}
+// A connection can submit any number of jobs; jobs are processed in order, one at a time.
+// Jobs past the limits in loader.h, and lines over SERVER_MAX_LINE, get an error reply.
+
+// a loaded scene + BVH, ready to render
+struct CachedScene {
+    CachedScene() : bvh(nullptr), maxDepth(0) {}
+    ~CachedScene() { delete bvh; }
+
+    CachedScene(CachedScene const&) = delete;
+    CachedScene& operator=(CachedScene const&) = delete;
+
+    Scene scene;
+    BVH* bvh;
+    unsigned int maxDepth;
+};
+
+// LRU cache of scenes, keyed by scene path and BVH method
+struct SceneCache {
+    typedef std::pair<std::string, BVHMethod> Key;
+    typedef std::pair<Key, std::shared_ptr<CachedScene>> Entry;
+
+    SceneCache(std::string const& _inputDir, unsigned int _capacity) :
+        inputDir(_inputDir),
+        capacity(_capacity),
+        hits(0),
+        misses(0)
+    {
+        assert(capacity > 0);
+    }
+
+    // find (or load) a scene. returns null if it fails to load.
+    std::shared_ptr<CachedScene> get(std::string const& sceneFile, BVHMethod method) {
+        Key key(sceneFile, method);
+
+        auto it = index.find(key);
+        if(it != index.end()) {
+            hits++;
+            // move to the front - ie most recently used
+            entries.splice(entries.begin(), entries, it->second);
+            return it->second->second;
+        }
+
+        misses++;
+        std::shared_ptr<CachedScene> cached = std::make_shared<CachedScene>();
+        if(!setupScene(inputDir, sceneFile, cached->scene) || cached->scene.primitives.pos.size() == 0)
+            return nullptr;
+
+        cached->bvh = buildBVH(cached->scene, method);
+        cached->maxDepth = cached->bvh->maxDepth;
+
+        entries.emplace_front(key, cached);
+        index[key] = entries.begin();
+
+        // evict least recently used. shared_ptr keeps it alive if it's still being rendered
+        while(entries.size() > capacity) {
+            std::cout << "scene cache evicting " << entries.back().first.first;
+            std::cout << " (" << GetBVHMethodStr(entries.back().first.second) << ")" << std::endl;
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+
+        return cached;
+    }
+
+    std::string inputDir;
+    unsigned int capacity;
+    std::list<Entry> entries; // most recently used at the front
+    std::map<Key, std::list<Entry>::iterator> index;
+
+    // a few stats
+    unsigned int hits;
+    unsigned int misses;
+};
+
+// escape a string for embedding in a json reply. only needs to cope with our own error messages
+inline std::string jsonEscape(std::string const& str) {
+    std::string res;
+    for(char c : str) {
+        if(c == '"' || c == '\\')
+            res.push_back('\\');
+        if(c == '\n')
+            c = ' ';
+        res.push_back(c);
+    }
+    return res;
+}
+
+// render a single job, encode the result into @image (as a TGA).
+// returns false and sets @err on failure
+bool renderJob(SceneCache& cache, RenderJob const& job, ScreenBuffer& screenBuffer,
+               std::vector<char>& image, std::string& err) {
+    Params p;
+
+    VisMode visMode;
+    if(!ParseVisMode(job.visMode, visMode)) {
+        err = "unknown vis mode " + job.visMode;
+        return false;
+    }
+    p.setVisMode(visMode);
+
+    if(!ParseBVHMethod(job.bvhMethod, p.bvhMethod)) {
+        err = "unknown bvh method " + job.bvhMethod;
+        return false;
+    }
+
+    std::shared_ptr<CachedScene> cached = cache.get(job.sceneFile, p.bvhMethod);
+    if(!cached) {
+        err = "failed to load scene " + job.sceneFile;
+        return false;
+    }
+
+    p.autoSetVisScale((float)cached->maxDepth);
+
+    Scene& s = cached->scene;
+    s.camera.width = job.width;
+    s.camera.height = job.height;
+    if(job.hasCamera)
+        s.camera.setPose(job.camera);
+    else
+        s.camera.resetView();
+
+    // parseRenderJob has capped the size, but the product can still be past an int
+    screenBuffer.resize((size_t)job.width * (size_t)job.height);
+
+    int const passes = IsProgressive(p.visMode) ? job.spp : 1;
+    for(int pass = 0; pass < passes; pass++)
+        renderFrame(s, *cached->bvh, p, screenBuffer, pass);
+
+    // progressive modes don't clamp per pixel
+    for(auto& c : screenBuffer)
+        c = colorClamp(c);
+
+    EncodeTgaImage(job.width, job.height, screenBuffer, image);
+    return true;
+}
+
+#ifndef WIN32
+
+// write all of @len bytes, or fail
+inline bool sendAll(int fd, char const* data, size_t len) {
+    while(len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if(sent <= 0)
+            return false;
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+inline bool sendString(int fd, std::string const& str) {
+    return sendAll(fd, str.data(), str.size());
+}
+
+// the longest job line we'll take. a job is a small json object, so anything longer is junk (or a
+// client that never sends a newline)
+size_t const SERVER_MAX_LINE = 64 * 1024;
+
+// process jobs from a single client until it disconnects
+void serveClient(int fd, SceneCache& cache) {
+    std::string pending;
+    char readBuf[4096];
+    ScreenBuffer screenBuffer;
+    std::vector<char> image;
+    bool overlong = false;  // dropping the rest of a line that's too long
+
+    while(true) {
+        // got a whole line?
+        auto eol = pending.find('\n');
+        if(eol == std::string::npos) {
+            if(pending.size() > SERVER_MAX_LINE) {
+                // throw away what we have, and everything up to the next newline
+                pending.clear();
+                overlong = true;
+            }
+            ssize_t got = recv(fd, readBuf, sizeof(readBuf), 0);
+            if(got <= 0)
+                return; // client's gone
+            pending.append(readBuf, got);
+            continue;
+        }
+
+        std::string line = pending.substr(0, eol);
+        pending.erase(0, eol + 1);
+
+        if(overlong || line.size() > SERVER_MAX_LINE) {
+            overlong = false;
+            std::cout << "job failed - line too long" << std::endl;
+            std::string reply = "{\"status\" : \"error\", \"message\" : \"job line longer than " +
+                                std::to_string(SERVER_MAX_LINE) + " bytes\"}\n";
+            if(!sendString(fd, reply))
+                return;
+            continue;
+        }
+
+        if(line.find_first_not_of(" \t\r") == std::string::npos)
+            continue; // blank line
+
+        Timer t;
+        RenderJob job;
+        std::string err;
+        std::stringstream reply;
+
+        // one bad job (eg out of memory for its buffer) mustn't take the whole server down
+        bool ok = false;
+        try {
+            ok = parseRenderJob(line, job, err) && renderJob(cache, job, screenBuffer, image, err);
+        } catch (std::exception const& e) {
+            err = std::string("exception rendering job - ") + e.what();
+            ok = false;
+        }
+
+        if(ok) {
+            float renderTime = t.sample();
+            reply << "{\"status\" : \"ok\", \"width\" : " << job.width << ", \"height\" : " << job.height;
+            reply << ", \"format\" : \"tga\", \"bytes\" : " << image.size();
+            reply << ", \"render_time\" : " << renderTime << "}\n";
+
+            std::cout << "job " << job.sceneFile << " " << job.width << "x" << job.height;
+            std::cout << " done in " << renderTime << " sec";
+            std::cout << " (cache hits " << cache.hits << " misses " << cache.misses << ")" << std::endl;
+
+            if(!sendString(fd, reply.str()) || !sendAll(fd, image.data(), image.size()))
+                return;
+        } else {
+            std::cout << "job failed - " << err << std::endl;
+            reply << "{\"status\" : \"error\", \"message\" : \"" << jsonEscape(err) << "\"}\n";
+            if(!sendString(fd, reply.str()))
+                return;
+        }
+    }
+}
+
+// main loop when in server mode
+// @inputDir: scene files in jobs are relative to this
+// @socketPath: unix domain socket to listen on. any existing file here is removed
+// @cacheSize: max number of scene/BVH pairs to keep loaded
+int serverLoop(std::string const& inputDir, std::string const& socketPath, unsigned int cacheSize) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if(socketPath.size() >= sizeof(addr.sun_path)) {
+        std::cout << "ERROR: socket path too long" << std::endl;
+        return -1;
+    }
+    socketPath.copy(addr.sun_path, socketPath.size());
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listenFd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    unlink(socketPath.c_str());
+    if(bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, 8) < 0) {
+        perror("bind/listen");
+        close(listenFd);
+        return -1;
+    }
+
+    std::cout << "render server listening on " << socketPath << std::endl;
+
+    SceneCache cache(inputDir, cacheSize);
+
+    while(true) {
+        int fd = accept(listenFd, nullptr, nullptr);
+        if(fd < 0) {
+            perror("accept");
+            continue;
+        }
+
+        serveClient(fd, cache);
+        close(fd);
+    }
+
+    return 0;
+}
+
+#else
+
+int serverLoop(std::string const& inputDir, std::string const& socketPath, unsigned int cacheSize) {
+    std::cout << "ERROR: server mode is not supported on windows" << std::endl;
+    return -1;
+}
+
+#endif
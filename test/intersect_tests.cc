@@ -0,0 +1,191 @@
+#include "primitive.h"
+#include "utils.h"
+
+#include "glm/glm.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <cmath>
+#include <random>
+
+// moller_trumbore and watertight checked against the same algorithm done in doubles, on random triangles
+// and rays - distances and barycentrics. Cases too close to an edge (or too close to parallel) to call
+// either way are skipped.
+
+struct ReferenceHit {
+    bool decisive;  // far enough from an edge that float and double must agree
+    bool hit;
+    double distance;
+    double u, v;    // barycentrics, per MiniIntersection
+};
+
+ReferenceHit referenceIntersect(TrianglePos const& tri, Ray const& ray) {
+    ReferenceHit res = {false, false, 0.0, 0.0, 0.0};
+
+    glm::dvec3 v0(tri.v[0]), v1(tri.v[1]), v2(tri.v[2]);
+    glm::dvec3 origin(ray.origin), dir(ray.direction);
+
+    glm::dvec3 e1 = v1 - v0;
+    glm::dvec3 e2 = v2 - v0;
+    glm::dvec3 p = glm::cross(dir, e2);
+    double det = glm::dot(e1, p);
+
+    // nearly parallel - the float version legitimately bails out early
+    if(std::abs(det) < 1e-3)
+        return res;
+
+    glm::dvec3 t = origin - v0;
+    double u = glm::dot(t, p) / det;
+    glm::dvec3 q = glm::cross(t, e1);
+    double v = glm::dot(dir, q) / det;
+    double dist = glm::dot(e2, q) / det;
+
+    double const margin = 1e-3;
+    bool inside = u > margin && v > margin && u + v < 1.0 - margin;
+    bool outside = u < -margin || v < -margin || u + v > 1.0 + margin;
+
+    if(outside) {
+        res.decisive = true;
+        res.hit = false;
+    } else if(inside) {
+        // behind (or right on) the origin is a miss, and too close to call in between
+        res.decisive = std::abs(dist) > margin;
+        res.hit = dist > 0.0;
+        res.distance = dist;
+        res.u = u;
+        res.v = v;
+    }
+    return res;
+}
+
+Ray testRay(glm::vec3 const& origin, glm::vec3 const& direction) {
+    return Ray(origin, direction, 0, 1);
+}
+
+glm::vec3 randomPoint(std::mt19937& rng, float range) {
+    std::uniform_real_distribution<float> d(-range, range);
+    return glm::vec3(d(rng), d(rng), d(rng));
+}
+
+// check @intersect against the double reference on random triangles and rays
+template<class Intersect>
+void checkAgainstReference(Intersect intersect) {
+    std::mt19937 rng(1337);
+
+    int decisive = 0, hits = 0;
+    for(int i = 0; i < 200000; i++) {
+        TrianglePos tri(randomPoint(rng, 10.0f), randomPoint(rng, 10.0f), randomPoint(rng, 10.0f));
+
+        // aim most rays at the triangle, so there's a decent mix of hits and misses
+        glm::vec3 origin = randomPoint(rng, 20.0f);
+        glm::vec3 target = (tri.v[0] + tri.v[1] + tri.v[2]) / 3.0f + randomPoint(rng, 4.0f);
+        Ray ray = testRay(origin, glm::normalize(target - origin));
+
+        ReferenceHit ref = referenceIntersect(tri, ray);
+        if(!ref.decisive)
+            continue;
+        decisive++;
+
+        float u = -1.0f, v = -1.0f;
+        float dist = intersect(tri, ray, u, v);
+        if(ref.hit) {
+            hits++;
+            BOOST_REQUIRE_MESSAGE(dist < INFINITY, "missed " << tri << " ref distance " << ref.distance);
+            BOOST_REQUIRE_MESSAGE(std::abs(dist - ref.distance) <= 1e-4 * std::max(1.0, ref.distance),
+                                  "distance " << dist << " ref " << ref.distance << " for " << tri);
+            BOOST_REQUIRE_MESSAGE(std::abs(u - ref.u) <= 1e-4 && std::abs(v - ref.v) <= 1e-4,
+                                  "barycentrics " << u << "," << v << " ref " << ref.u << "," << ref.v << " for " << tri);
+        } else {
+            BOOST_REQUIRE_MESSAGE(dist == INFINITY, "hit " << tri << " at " << dist << ", ref says miss");
+        }
+    }
+
+    // make sure the test actually tested something
+    BOOST_CHECK(decisive > 100000);
+    BOOST_CHECK(hits > 10000);
+}
+
+float mollerTrumboreWithUV(TrianglePos const& tri, Ray const& ray, float& u, float& v) {
+    return moller_trumbore(tri, ray, u, v);
+}
+
+float watertightWithUV(TrianglePos const& tri, Ray const& ray, float& u, float& v) {
+    return watertight(tri, ray, WatertightRay(ray), u, v);
+}
+
+float watertightTest(TrianglePos const& tri, Ray const& ray) {
+    return watertight(tri, ray, WatertightRay(ray));
+}
+
+BOOST_AUTO_TEST_CASE(moller_trumbore_matches_double_reference)
+{
+    checkAgainstReference(mollerTrumboreWithUV);
+}
+
+BOOST_AUTO_TEST_CASE(watertight_matches_double_reference)
+{
+    checkAgainstReference(watertightWithUV);
+}
+
+BOOST_AUTO_TEST_CASE(moller_trumbore_edge_cases)
+{
+    TrianglePos tri(glm::vec3(0, 0, 0), glm::vec3(1, 0, 0), glm::vec3(0, 1, 0));
+
+    // straight on
+    BOOST_CHECK_CLOSE(moller_trumbore(tri, testRay(glm::vec3(0.25f, 0.25f, -2), glm::vec3(0, 0, 1))), 2.0f, 1e-4f);
+    // from the back - no culling
+    BOOST_CHECK_CLOSE(moller_trumbore(tri, testRay(glm::vec3(0.25f, 0.25f, 3), glm::vec3(0, 0, -1))), 3.0f, 1e-4f);
+    // pointing away
+    BOOST_CHECK(moller_trumbore(tri, testRay(glm::vec3(0.25f, 0.25f, -2), glm::vec3(0, 0, -1))) == INFINITY);
+    // parallel, in the plane
+    BOOST_CHECK(moller_trumbore(tri, testRay(glm::vec3(-1, 0.25f, 0), glm::vec3(1, 0, 0))) == INFINITY);
+    // just outside the hypotenuse
+    BOOST_CHECK(moller_trumbore(tri, testRay(glm::vec3(0.51f, 0.51f, -2), glm::vec3(0, 0, 1))) == INFINITY);
+}
+
+BOOST_AUTO_TEST_CASE(watertight_edge_cases)
+{
+    TrianglePos tri(glm::vec3(0, 0, 0), glm::vec3(1, 0, 0), glm::vec3(0, 1, 0));
+
+    // same as moller_trumbore's
+    BOOST_CHECK_CLOSE(watertightTest(tri, testRay(glm::vec3(0.25f, 0.25f, -2), glm::vec3(0, 0, 1))), 2.0f, 1e-4f);
+    BOOST_CHECK_CLOSE(watertightTest(tri, testRay(glm::vec3(0.25f, 0.25f, 3), glm::vec3(0, 0, -1))), 3.0f, 1e-4f);
+    BOOST_CHECK(watertightTest(tri, testRay(glm::vec3(0.25f, 0.25f, -2), glm::vec3(0, 0, -1))) == INFINITY);
+    BOOST_CHECK(watertightTest(tri, testRay(glm::vec3(-1, 0.25f, 0), glm::vec3(1, 0, 0))) == INFINITY);
+    BOOST_CHECK(watertightTest(tri, testRay(glm::vec3(0.51f, 0.51f, -2), glm::vec3(0, 0, 1))) == INFINITY);
+
+    // a sliver far too thin for moller_trumbore's determinant epsilon is still hit
+    TrianglePos sliver(glm::vec3(0, 0, 0), glm::vec3(1, 0, 0), glm::vec3(0, 1e-4f, 0));
+    BOOST_CHECK_CLOSE(watertightTest(sliver, testRay(glm::vec3(0.25f, 2e-5f, -2), glm::vec3(0, 0, 1))), 2.0f, 1e-4f);
+}
+
+// rays at the shared edge of two triangles (or the shared vertex of a fan) must hit one of them -
+// the gaps moller_trumbore can leave there show up as light leaks
+BOOST_AUTO_TEST_CASE(watertight_no_gaps)
+{
+    std::mt19937 rng(1337);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    int gaps = 0;
+    for(int i = 0; i < 100000; i++) {
+        // a random quad, split along its diagonal. convex, so anything through it hits one half
+        glm::vec3 a = randomPoint(rng, 10.0f), b = randomPoint(rng, 10.0f), c = randomPoint(rng, 10.0f);
+        glm::vec3 d = a + (b - a) + (c - a);
+        TrianglePos t0(a, b, c), t1(b, d, c);
+
+        // aimed at a point on the shared edge b-c, well inside the quad
+        glm::vec3 target = b + (c - b) * (0.1f + 0.8f * unit(rng));
+        glm::vec3 origin = target + randomPoint(rng, 20.0f);
+        Ray ray = testRay(origin, glm::normalize(target - origin));
+
+        // nearly edge on, the distance itself is meaningless
+        glm::vec3 const n = glm::normalize(glm::cross(b - a, c - a));
+        if(std::abs(glm::dot(n, ray.direction)) < 0.05f)
+            continue;
+
+        if(watertightTest(t0, ray) == INFINITY && watertightTest(t1, ray) == INFINITY)
+            gaps++;
+    }
+
+    BOOST_CHECK_EQUAL(gaps, 0);
+}
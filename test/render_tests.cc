@@ -0,0 +1,536 @@
+#include "bvh_build_factory.h"
+#include "bvh_diag.h"
+#include "bvh_quantize.h"
+#include "bvh_traverse.h"
+#include "loader.h"
+#include "output.h"
+#include "ray_record.h"
+#include "render.h"
+
+#include <boost/test/unit_test.hpp>
+
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <sstream>
+
+// End to end checks on real scenes: every BVH method, node format, traversal mode and triangle test must find
+// the same hits as a brute force search, and rendered images must match the golden images in test/golden.
+//
+// Set RAY_UPDATE_GOLDEN=1 in the environment to (re)write the golden images instead of checking them.
+// Only do that when an image change is intended, and look at the new images before committing them.
+
+#ifndef RAY_TEST_DATA_DIR
+#define RAY_TEST_DATA_DIR "data"
+#endif
+
+#ifndef RAY_TEST_GOLDEN_DIR
+#define RAY_TEST_GOLDEN_DIR "test/golden"
+#endif
+
+// small, so the brute force checks (and the single leaf BVHs some methods build) stay quick
+int const TEST_WIDTH = 64;
+int const TEST_HEIGHT = 48;
+
+bool loadTestScene(std::string const& sceneFile, Scene& s) {
+    if(!setupScene(RAY_TEST_DATA_DIR, sceneFile, s) || s.primitives.pos.empty())
+        return false;
+
+    s.camera.width = TEST_WIDTH;
+    s.camera.height = TEST_HEIGHT;
+    s.camera.resetView();
+    return true;
+}
+
+std::vector<BVHMethod> allBVHMethods() {
+    std::vector<BVHMethod> res;
+    for(int i = 0; i < (int)BVHMethod::_MAX; i++)
+        res.push_back((BVHMethod)i);
+    return res;
+}
+
+std::vector<TriangleTest> allTriangleTests() {
+    std::vector<TriangleTest> res;
+    for(int i = 0; i < (int)TriangleTest::_MAX; i++)
+        res.push_back((TriangleTest)i);
+    return res;
+}
+
+float intersectTriangle(TriangleTest test, TrianglePos const& t, Ray const& ray) {
+    return test == TriangleTest::Watertight ? watertight(t, ray, WatertightRay(ray)) : moller_trumbore(t, ray);
+}
+
+// the same tests traverseTriangles does, on every triangle in the scene
+MiniIntersection bruteForceClosest(Primitives const& prims, Ray const& ray, TriangleTest test) {
+    MiniIntersection hit;
+    for(unsigned int i = 0; i < prims.pos.size(); i++) {
+        float distance = intersectTriangle(test, prims.pos[i], ray);
+        if(distance > 0 && distance < hit.distance) {
+            hit.distance = distance;
+            hit.triangle = i;
+        }
+    }
+    return hit;
+}
+
+bool bruteForceAny(Primitives const& prims, Ray const& ray, float maxDist, TriangleTest test) {
+    for(auto const& t : prims.pos) {
+        float distance = intersectTriangle(test, t, ray);
+        if(distance > 0 && distance < maxDist)
+            return true;
+    }
+    return false;
+}
+
+// random rays from in and around the scene bounds, in random directions. every other one is an any
+// hit query, with a random max distance
+std::vector<RecordedRay> makeRandomRays(Scene const& s, int count) {
+    AABB bounds;
+    for(auto const& t : s.primitives.pos)
+        bounds = unionTriangle(bounds, t);
+    glm::vec3 const centre = centroidAABB(bounds);
+    glm::vec3 const extent = (bounds.high - bounds.low) * 0.6f;
+    float const diagonal = glm::length(bounds.high - bounds.low);
+
+    std::mt19937 rng(1337);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+    std::vector<RecordedRay> rays;
+    for(int i = 0; i < count; i++) {
+        glm::vec3 origin = centre + extent * glm::vec3(unit(rng), unit(rng), unit(rng));
+
+        glm::vec3 dir;
+        do {
+            dir = glm::vec3(unit(rng), unit(rng), unit(rng));
+        } while(glm::length(dir) > 1.0f || glm::length(dir) < 0.01f);
+
+        bool const anyHit = (i & 1) != 0;
+        float const maxDist = anyHit ? (unit(rng) + 1.0f) * 0.5f * diagonal : 0.0f;
+        Ray ray(origin, glm::normalize(dir), 0, STARTING_TTL, anyHit ? RayKind::Shadow : RayKind::Primary);
+        rays.emplace_back(ray, maxDist, anyHit);
+    }
+    return rays;
+}
+
+// every ray cast by a normal (whitted) render of the scene
+std::vector<RecordedRay> makeRecordedRays(Scene& s) {
+    Params p;
+    BVH* bvh = buildBVH(s, BVHMethod::SBVH);
+    ScreenBuffer screenBuffer(TEST_WIDTH * TEST_HEIGHT);
+
+    startRayRecording();
+    renderFrame(s, *bvh, p, screenBuffer, 0);
+    std::vector<RecordedRay> rays = stopRayRecording();
+
+    delete bvh;
+    return rays;
+}
+
+// check every method x node format x traversal mode x triangle test against brute force, for a set of rays
+void checkTraversal(Scene& s, std::vector<RecordedRay> const& rays) {
+    BOOST_REQUIRE(!rays.empty());
+
+    // brute force once up front, with each triangle test - they can legitimately disagree on rays
+    // that graze an edge
+    std::vector<TriangleTest> const tests = allTriangleTests();
+    std::vector<std::vector<MiniIntersection>> closest(tests.size(), std::vector<MiniIntersection>(rays.size()));
+    std::vector<std::vector<bool>> any(tests.size(), std::vector<bool>(rays.size()));
+    for(unsigned int t = 0; t < tests.size(); t++) {
+        for(unsigned int i = 0; i < rays.size(); i++) {
+            Ray ray = rays[i].toRay();
+            if(rays[i].anyHit)
+                any[t][i] = bruteForceAny(s.primitives, ray, rays[i].maxDist, tests[t]);
+            else
+                closest[t][i] = bruteForceClosest(s.primitives, ray, tests[t]);
+        }
+    }
+
+    for(BVHMethod method : allBVHMethods()) {
+        BVH* bvh = buildBVH(s, method);
+
+        for(int f = 0; f < (int)NodeFormat::_MAX; f++) {
+            // quantized bounds are conservative, so must find exactly the same hits
+            NodeFormat const format = (NodeFormat)f;
+            quantizeBVH(*bvh, format);
+
+            for(TraversalMode trav : {TraversalMode::Ordered, TraversalMode::Distance, TraversalMode::Unordered})
+            for(unsigned int t = 0; t < tests.size(); t++) {
+                BOOST_TEST_CONTEXT(GetBVHMethodStr(method) << " " << GetNodeFormatStr(format) << " "
+                                   << GetTraversalModeStr(trav) << " " << GetTriangleTestStr(tests[t])) {
+                    unsigned int mismatches = 0;
+
+                    for(unsigned int i = 0; i < rays.size(); i++) {
+                        Ray ray = rays[i].toRay();
+                        if(rays[i].anyHit) {
+                            bool hit = findAnyIntersectionBVH(*bvh, s.primitives, ray, rays[i].maxDist, trav, tests[t]);
+                            if(hit != any[t][i])
+                                mismatches++;
+                        } else {
+                            // triangles can legitimately tie on distance (eg shared edges), so only the
+                            // distance has to match exactly
+                            MiniIntersection hit = findClosestIntersectionBVH(*bvh, s.primitives, ray, trav, tests[t]);
+                            MiniIntersection const& expected = closest[t][i];
+                            if(hit.hit() != expected.hit() || (hit.hit() && hit.distance != expected.distance))
+                                mismatches++;
+                        }
+                    }
+
+                    BOOST_CHECK_MESSAGE(mismatches == 0, mismatches << " of " << rays.size() << " rays differ from brute force");
+                }
+            }
+        }
+
+        delete bvh;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(traversal_random_rays)
+{
+    for(std::string scene : {"cube.scene", "teapot.scene"}) {
+        BOOST_TEST_CONTEXT(scene) {
+            Scene s;
+            BOOST_REQUIRE(loadTestScene(scene, s));
+            checkTraversal(s, makeRandomRays(s, 4000));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(traversal_recorded_rays)
+{
+    for(std::string scene : {"cube.scene", "teapot.scene"}) {
+        BOOST_TEST_CONTEXT(scene) {
+            Scene s;
+            BOOST_REQUIRE(loadTestScene(scene, s));
+            checkTraversal(s, makeRecordedRays(s));
+        }
+    }
+}
+
+// validateBVH is always compiled in, so this runs on release builds too
+BOOST_AUTO_TEST_CASE(bvh_invariants)
+{
+    for(std::string scene : {"cube.scene", "teapot.scene", "bunny.scene"}) {
+        Scene s;
+        BOOST_REQUIRE(loadTestScene(scene, s));
+
+        for(BVHMethod method : allBVHMethods()) {
+            BOOST_TEST_CONTEXT(scene << " " << GetBVHMethodStr(method)) {
+                BVH* bvh = buildBVH(s, method);
+                std::ostringstream errors;
+                BOOST_CHECK_MESSAGE(validateBVH(*bvh, s.primitives.pos, errors), errors.str());
+                delete bvh;
+            }
+        }
+    }
+}
+
+// the light grid may give a point lights that can't reach it, but never leave out one that can
+// rays from right next to a box, aimed just inside one of its corners, must hit it - however far from
+// the world origin the two are, as that's where the slab test's rounding is worst
+BOOST_AUTO_TEST_CASE(slab_test_keeps_grazing_rays_far_from_origin)
+{
+    std::mt19937 rng(1337);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+    int missed = 0;
+    for(float offset : {0.0f, 1e2f, 1e4f, 1e5f}) {
+        for(int i = 0; i < 20000; i++) {
+            glm::vec3 const centre = offset * glm::vec3(unit(rng), unit(rng), unit(rng));
+            glm::vec3 const half = glm::vec3(0.5f) + 0.4f * glm::vec3(unit(rng), unit(rng), unit(rng));
+            AABB const box(centre - half, centre + half);
+
+            // a corner, moved in by half an ulp of the coordinates at 1e4
+            glm::vec3 corner;
+            glm::vec3 inward;
+            for(int axis = 0; axis < 3; axis++) {
+                bool const high = unit(rng) > 0.0f;
+                corner[axis] = high ? box.high[axis] : box.low[axis];
+                inward[axis] = high ? -1.0f : 1.0f;
+            }
+            glm::vec3 const target = corner + inward * 5e-4f;
+
+            // from a few box sizes away, on the outside
+            glm::vec3 dir;
+            do {
+                dir = glm::vec3(unit(rng), unit(rng), unit(rng));
+            } while(glm::length(dir) > 1.0f || glm::length(dir) < 0.1f);
+            glm::vec3 const origin = target - glm::normalize(dir) * 4.0f;
+            Ray const ray(origin, glm::normalize(target - origin), 0, STARTING_TTL);
+
+            PrecomputedRay const pr(ray, 0.0f, INFINITY);
+            float pairA, pairB;
+            rayIntersectsAABBPair(box, box, pr, pairA, pairB);
+            if(rayIntersectsAABB(box, pr) == INFINITY || pairA == INFINITY)
+                missed++;
+        }
+    }
+    BOOST_CHECK_EQUAL(missed, 0);
+}
+
+BOOST_AUTO_TEST_CASE(light_grid_finds_reaching_lights)
+{
+    for(std::string scene : {"spots.scene", "teapot-plane.scene", "cubes-plane.scene"}) {
+        Scene s;
+        BOOST_REQUIRE(loadTestScene(scene, s));
+
+        AABB bounds;
+        for(auto const& t : s.primitives.pos)
+            bounds = unionTriangle(bounds, t);
+        glm::vec3 const low = bounds.low, high = bounds.high;
+
+        // plenty more lights than the scene has, in and around it, spots pointing every which way. each
+        // bright enough to reach a good way into the scene, but not all of it
+        std::mt19937 rng(1337);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        glm::vec3 const size = high - low;
+        s.lights.cutoff = 0.01f;
+        for(int i = 0; i < 200; i++) {
+            glm::vec3 pos = low - size * 0.5f + size * 2.0f * glm::vec3(unit(rng), unit(rng), unit(rng));
+            FalloffKind falloff = (i & 2) ? FK_LOG : FK_LINEAR;
+            float reach = glm::length(size) * (0.1f + 0.6f * unit(rng));
+            float intensity = s.lights.cutoff * (falloff == FK_LOG ? reach * reach : reach);
+
+            if(i & 1) {
+                s.lights.pointLights.emplace_back(pos, Color(intensity), falloff);
+            } else {
+                glm::vec3 dir = glm::normalize(glm::vec3(unit(rng), unit(rng), unit(rng)) - 0.5f + 1e-3f);
+                float outer = 0.05f + 1.5f * unit(rng);
+                s.lights.spotLights.emplace_back(pos, dir, Color(intensity), falloff, outer * 0.5f, outer);
+            }
+        }
+        buildLightGrid(s.lights, low, high);
+
+        int reached = 0, unreached = 0;
+        for(int i = 0; i < 20000; i++) {
+            // somewhere on a triangle, where shading actually happens
+            TrianglePos const& t = s.primitives.pos[rng() % s.primitives.pos.size()];
+            float a = unit(rng), b = unit(rng);
+            if(a + b > 1.0f) {
+                a = 1.0f - a;
+                b = 1.0f - b;
+            }
+            glm::vec3 const point = t.v[0] + a * (t.v[1] - t.v[0]) + b * (t.v[2] - t.v[0]);
+
+            std::vector<bool> foundSpot(s.lights.spotLights.size(), false);
+            std::vector<bool> foundPoint(s.lights.pointLights.size(), false);
+            s.lights.grid.forEachLight(point, [&](uint32_t ref) {
+                if(ref & LIGHT_REF_SPOT)
+                    foundSpot[ref & ~LIGHT_REF_SPOT] = true;
+                else
+                    foundPoint[ref] = true;
+            });
+
+            for(size_t l = 0; l < s.lights.spotLights.size(); l++) {
+                SpotLight const& light = s.lights.spotLights[l];
+                glm::vec3 const toPoint = glm::normalize(point - light.pos);
+                // per calcLightOutput, both ways along the axis
+                if(glm::length(point - light.pos) > light.radius ||
+                   std::abs(glm::dot(toPoint, light.pointDir)) < light.cosOuterAngle) {
+                    unreached++;
+                    continue;
+                }
+                reached++;
+                BOOST_REQUIRE_MESSAGE(foundSpot[l], scene << ": spot " << l << " missing at " << point.x << ","
+                                                          << point.y << "," << point.z);
+            }
+
+            for(size_t l = 0; l < s.lights.pointLights.size(); l++) {
+                if(glm::length(point - s.lights.pointLights[l].pos) > s.lights.pointLights[l].radius) {
+                    unreached++;
+                    continue;
+                }
+                reached++;
+                BOOST_REQUIRE_MESSAGE(foundPoint[l], scene << ": point light " << l << " missing at " << point.x
+                                                           << "," << point.y << "," << point.z);
+            }
+        }
+        // and the radii actually cut some off
+        BOOST_CHECK(reached > 100000);
+        BOOST_CHECK(unreached > 100000);
+    }
+}
+
+// the tolerance for golden images, in 8 bit levels per channel. small differences are expected
+// between compilers, flags and cpus, so allow a few bad pixels, and a small average error
+int const GOLDEN_PIXEL_TOLERANCE = 8;
+float const GOLDEN_BAD_PIXEL_FRACTION = 0.005f;
+float const GOLDEN_MEAN_TOLERANCE = 0.5f;
+
+bool readFile(std::string const& fname, std::vector<char>& data) {
+    std::ifstream in(fname, std::ios::binary);
+    if(!in)
+        return false;
+    data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return true;
+}
+
+// render @sceneFile in @visMode with every BVH method, and compare each to its golden image
+void checkGolden(std::string const& sceneFile, VisMode visMode, std::string const& goldenName,
+                 ShadingMode shadingMode = ShadingMode::Immediate) {
+    Scene s;
+    BOOST_REQUIRE(loadTestScene(sceneFile, s));
+
+    std::string const goldenFile = std::string(RAY_TEST_GOLDEN_DIR) + "/" + goldenName + ".tga";
+    bool const update = getenv("RAY_UPDATE_GOLDEN") != nullptr;
+
+    Params p;
+    p.setVisMode(visMode);
+    p.shadingMode = shadingMode;
+
+    for(BVHMethod method : allBVHMethods()) {
+        BOOST_TEST_CONTEXT(goldenName << " " << GetBVHMethodStr(method)) {
+            BVH* bvh = buildBVH(s, method);
+            ScreenBuffer screenBuffer(TEST_WIDTH * TEST_HEIGHT);
+            renderFrame(s, *bvh, p, screenBuffer, 0);
+            delete bvh;
+
+            for(auto& c : screenBuffer)
+                c = colorClamp(c);
+
+            std::vector<char> image;
+            EncodeTgaImage(TEST_WIDTH, TEST_HEIGHT, screenBuffer, image);
+
+            // every method should give the same image, so the first one makes the golden
+            if(update && method == (BVHMethod)0) {
+                BOOST_REQUIRE(WriteFile(goldenFile, image));
+                BOOST_TEST_MESSAGE("updated " << goldenFile);
+                continue;
+            }
+
+            std::vector<char> golden;
+            BOOST_REQUIRE_MESSAGE(readFile(goldenFile, golden), "missing golden image " << goldenFile);
+            BOOST_REQUIRE_EQUAL(golden.size(), image.size());
+
+            int const header = 18;
+            BOOST_REQUIRE(std::equal(image.begin(), image.begin() + header, golden.begin()));
+
+            unsigned int badPixels = 0;
+            double totalError = 0.0;
+            for(unsigned int px = header; px < image.size(); px += 3) {
+                int worst = 0;
+                for(unsigned int c = 0; c < 3; c++) {
+                    int diff = std::abs((int)(unsigned char)image[px + c] - (int)(unsigned char)golden[px + c]);
+                    worst = std::max(worst, diff);
+                    totalError += diff;
+                }
+                if(worst > GOLDEN_PIXEL_TOLERANCE)
+                    badPixels++;
+            }
+
+            unsigned int const pixels = TEST_WIDTH * TEST_HEIGHT;
+            float const meanError = (float)(totalError / (pixels * 3));
+            BOOST_CHECK_MESSAGE(badPixels <= GOLDEN_BAD_PIXEL_FRACTION * pixels,
+                                badPixels << " pixels differ by more than " << GOLDEN_PIXEL_TOLERANCE);
+            BOOST_CHECK_MESSAGE(meanError <= GOLDEN_MEAN_TOLERANCE, "mean error " << meanError);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(golden_cube)
+{
+    checkGolden("cube.scene", VisMode::Default, "cube");
+}
+
+BOOST_AUTO_TEST_CASE(golden_teapot)
+{
+    checkGolden("teapot.scene", VisMode::Default, "teapot");
+}
+
+BOOST_AUTO_TEST_CASE(golden_teapot_deferred)
+{
+    // shading order mustn't change the picture
+    checkGolden("teapot.scene", VisMode::Default, "teapot", ShadingMode::Deferred);
+}
+
+BOOST_AUTO_TEST_CASE(golden_teapot_normals)
+{
+    // no path traced golden - a tiny float difference changes a bounce, and the noise with it, so
+    // it can't be compared between builds
+    checkGolden("teapot.scene", VisMode::Normal, "teapot-normals");
+}
+
+// the recursive Whitted trace the ray queue replaced: everything a hit spawns is traced right away, until
+// the ttl runs out. only rays too faint on their own (not just on the way to the pixel) are dropped
+Color traceRecursive(Ray const& ray, Scene const& s, BVH const& bvh, Params const& p) {
+    if(ray.ttl <= 0)
+        return BLACK;
+
+    MiniIntersection hit = findClosestIntersectionBVH(bvh, s.primitives, ray, p.traversalMode, p.triangleTest);
+    if(!hit.hit())
+        return BLACK;
+
+    FancyIntersection fancy = FancyIntersect(hit, s.primitives.extra[hit.triangle], ray, p.smoothing);
+    int const mat = s.primitives.shading.resolve(fancy.mat, fancy.impact);
+
+    RayQueue spawned;
+    Color color = shadeSurface(ray, hit.distance, fancy, mat, Color(1.f), bvh, s.primitives, s.lights, p, spawned);
+    for(WeightedRay const& wr : spawned.rays)
+        color += wr.weight * traceRecursive(wr.ray, s, bvh, p);
+    return color;
+}
+
+BOOST_AUTO_TEST_CASE(ray_queue_matches_recursive_trace)
+{
+    // three glass spheres one inside the other, so every pixel on them spawns rays by the dozen
+    Scene s;
+    BOOST_REQUIRE(loadTestScene("nested-glass.scene", s));
+
+    Params p;
+    BVH* bvh = buildBVH(s, BVHMethod::SBVH);
+    ScreenBuffer screenBuffer(TEST_WIDTH * TEST_HEIGHT);
+    renderFrame(s, *bvh, p, screenBuffer, 0);
+
+    // pruning faint rays may only lose what they'd have added - not much
+    unsigned int badPixels = 0;
+    double totalError = 0.0;
+    for(int y = 0; y < TEST_HEIGHT; y++) {
+        for(int x = 0; x < TEST_WIDTH; x++) {
+            Color const expected = colorClamp(traceRecursive(s.camera.makeRay(x, y), s, *bvh, p));
+            Color const actual = colorClamp(screenBuffer[(TEST_HEIGHT - y - 1) * TEST_WIDTH + x]);
+            float const worst = 255.0f * std::max(std::abs(expected.r - actual.r),
+                                                  std::max(std::abs(expected.g - actual.g),
+                                                           std::abs(expected.b - actual.b)));
+            if(worst > GOLDEN_PIXEL_TOLERANCE)
+                badPixels++;
+            totalError += 255.0 * (std::abs(expected.r - actual.r) + std::abs(expected.g - actual.g) +
+                                   std::abs(expected.b - actual.b));
+        }
+    }
+    delete bvh;
+
+    unsigned int const pixels = TEST_WIDTH * TEST_HEIGHT;
+    float const meanError = (float)(totalError / (pixels * 3));
+    BOOST_TEST_MESSAGE("ray queue vs recursive: " << badPixels << " bad pixels, mean error " << meanError);
+    BOOST_CHECK_MESSAGE(badPixels <= GOLDEN_BAD_PIXEL_FRACTION * pixels,
+                        badPixels << " pixels differ by more than " << GOLDEN_PIXEL_TOLERANCE);
+    BOOST_CHECK_MESSAGE(meanError <= GOLDEN_MEAN_TOLERANCE, "mean error " << meanError);
+}
+
+BOOST_AUTO_TEST_CASE(ray_queue_prunes_and_caps)
+{
+    Ray const ray(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, 1.0f), 0, STARTING_TTL, RayKind::Secondary);
+
+    RayQueue queue;
+    queue.push(ray, Color(TRACE_MIN_WEIGHT * 0.5f));
+    BOOST_CHECK(queue.empty());
+
+    // any one bright channel is enough
+    queue.push(ray, Color(0.0f, TRACE_MIN_WEIGHT, 0.0f));
+    BOOST_CHECK(!queue.empty());
+
+    for(unsigned int i = 0; i < TRACE_MAX_RAYS + 10; i++)
+        queue.push(ray, Color(1.0f));
+    BOOST_CHECK_EQUAL(queue.cast, TRACE_MAX_RAYS);
+    BOOST_CHECK_EQUAL(queue.rays.size(), TRACE_MAX_RAYS);
+
+    // popping doesn't free up room, the cap's on rays per pixel
+    while(!queue.empty())
+        queue.pop();
+    queue.push(ray, Color(1.0f));
+    BOOST_CHECK(queue.empty());
+
+    queue.reset();
+    queue.push(ray, Color(1.0f));
+    BOOST_CHECK(!queue.empty());
+}
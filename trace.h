@@ -7,6 +7,7 @@
 
 #include "glm/gtx/vector_query.hpp"
 
+#include <algorithm>
 #include <cmath>
 #include <chrono>
 #include <vector>
@@ -16,28 +17,29 @@ inline Color calcLightOutput(PointLight const& light,
                      float distance, 
                      Ray const& ray, 
                      FancyIntersection const& hit, 
-                     Material const& mat,
+                     ShadingTable const& mats,
+                     int mat,
                      glm::vec3 const& lightDir) {
 
-    assert(isFinite(mat.diffuseColor));
-    assert(isFinite(mat.specular_highlight));
+    assert(isFinite(mats.diffuseColor[mat]));
+    assert(isFinite(mats.specular_highlight[mat]));
     assert(isFinite(light.color));
     assert(glm::isNormalized(hit.normal, EPSILON));
     assert(glm::isNormalized(lightDir, EPSILON));
 
     float diff = glm::dot(hit.normal, lightDir);
-    float falloff = 1.0f/distance;
+    float falloff = lightFalloff(light.falloff, distance);
     assert(std::isfinite(diff));
     assert(std::isfinite(falloff));
 
-    Color ret = mat.diffuseColor * light.color * falloff * diff;
+    Color ret = mats.diffuseColor[mat] * light.color * falloff * diff;
     assert(isFinite(ret));
 
-    if(mat.specular_highlight!=BLACK){
+    if(mats.has(mat, MATERIAL_SPECULAR)){
         glm::vec3 refl = glm::reflect(lightDir,hit.normal);
         float dot = glm::dot(ray.direction,refl);
         if(dot>0.f){
-            ret += powf(dot, mat.shininess) * mat.specular_highlight * light.color * falloff;
+            ret += powf(dot, mats.shininess[mat]) * mats.specular_highlight[mat] * light.color * falloff;
         } 
     }
 
@@ -50,7 +52,8 @@ inline Color calcLightOutput(SpotLight const& light,
                      float distance, 
                      Ray const& ray, 
                      FancyIntersection const& hit, 
-                     Material const& mat,
+                     ShadingTable const& mats,
+                     int mat,
                      glm::vec3 const& lightDir) {
 
     float dot = fabs(glm::dot(-lightDir, light.pointDir));
@@ -60,7 +63,7 @@ inline Color calcLightOutput(SpotLight const& light,
     }
 
     float inner = light.cosInnerAngle;
-    Color lout = calcLightOutput(PointLight(light.pos,light.color), distance, ray, hit, mat, lightDir);
+    Color lout = calcLightOutput(PointLight(light.pos,light.color,light.falloff), distance, ray, hit, mats, mat, lightDir);
 
     if(dot > inner){ // inside inner cone
         return lout;
@@ -70,134 +73,298 @@ inline Color calcLightOutput(SpotLight const& light,
     }
 }
 
-template <class LightsType>
-inline Color diffuse(Ray const& ray,
+// a light that can reach the shading point, and what it adds if nothing's in the way
+struct LightSample {
+    glm::vec3 direction;
+    float distance;
+    Color color;
+    float brightness;   // its brightest channel, to sort by
+};
+
+// everything about @light's contribution to @hit but the shadow ray. adds it to @samples if there's
+// anything to add
+template <class LightType>
+inline void sampleLight(LightType const& light,
+                        Ray const& ray,
+                        FancyIntersection const& hit,
+                        ShadingTable const& mats,
+                        int mat,
+                        std::vector<LightSample>& samples){
+    glm::vec3 impact_to_light = light.pos - hit.impact;
+    float light_distance = glm::length(impact_to_light);
+    if(light_distance > light.radius)
+        return;
+    glm::vec3 light_direction = glm::normalize(impact_to_light);
+
+    // behind the surface
+    if(glm::dot(hit.normal, light_direction) <= 0.f)
+        return;
+
+    // (spot lights reject anything outside their cone first thing)
+    Color color = calcLightOutput(light, light_distance, ray, hit, mats, mat, light_direction);
+    float brightest = std::max(color.r, std::max(color.g, color.b));
+    if(brightest > 0.f)
+        samples.push_back({light_direction, light_distance, color, brightest});
+}
+
+// the lights per the light grid, with a shadow ray for each, brightest first - until all the rest
+// together would add less than the scene's cutoff
+inline Color calcTotalDiffuse(Ray const& ray,
               BVH const& bvh,
               Primitives const& primitives,
-              LightsType const& lights,
+              Lights const& lights,
               FancyIntersection const& hit,
-              Material const& mat,
+              int mat,
               Params const& p){
-    Color color = BLACK;
+    // kept between calls, to save allocating on every hit. shadow rays don't shade, so this can't be
+    // reentered
+    static thread_local std::vector<LightSample> samples;
+    samples.clear();
+
+    ShadingTable const& mats = primitives.shading;
+    unsigned int considered = 0;
+    lights.grid.forEachLight(hit.impact, [&](uint32_t ref) {
+        considered++;
+        if(ref & LIGHT_REF_SPOT)
+            sampleLight(lights.spotLights[ref & ~LIGHT_REF_SPOT], ray, hit, mats, mat, samples);
+        else
+            sampleLight(lights.pointLights[ref], ray, hit, mats, mat, samples);
+    });
+
+    std::sort(samples.begin(), samples.end(),
+              [](LightSample const& a, LightSample const& b) { return a.brightness > b.brightness; });
+
+    // the most the samples not yet traced could add, in any one channel
+    float remaining = 0.f;
+    for(auto const& sample : samples)
+        remaining += sample.brightness;
 
-    for(auto const& light : lights){
-        glm::vec3 impact_to_light = light.pos - hit.impact;
-        float light_distance = glm::length(impact_to_light);
-        glm::vec3 light_direction = glm::normalize(impact_to_light);
+    Color color = BLACK;
+    size_t traced = 0;
+    for(auto const& sample : samples){
+        if(remaining < lights.cutoff)
+            break;
+        remaining -= sample.brightness;
+        traced++;
 
-        Ray shadow_ray = Ray(hit.impact + (hit.normal*EPSILON), light_direction, ray.mat, ray.ttl-1);
+        Ray shadow_ray = Ray(hit.impact + (hit.normal*EPSILON), sample.direction, ray.mat, ray.ttl-1, RayKind::Shadow);
 
         // does this shadow ray hit any geometry?
-        bool shadow_hit = findAnyIntersectionBVH(bvh, primitives, shadow_ray, light_distance, p.traversalMode);
+        bool shadow_hit = findAnyIntersectionBVH(bvh, primitives, shadow_ray, sample.distance, p.traversalMode, p.triangleTest);
 
         if(!shadow_hit){
-            color += calcLightOutput(light, light_distance, ray, hit, mat, light_direction);
+            color += sample.color;
         }
     }
+    countShadowSkipped(considered - traced);
+
     assert(isFinite(color));
     return color;
 }
 
-inline Color calcTotalDiffuse(Ray const& ray,
-              BVH const& bvh,
-              Primitives const& primitives,
-              Lights const& lights,
-              FancyIntersection const& hit,
-              Material const& mat,
-              Params const& p){
-
-    Color color = Color(0,0,0);
+// Whitted tracing, without recursion. Every hit can spawn a refraction and a reflection ray, so nested
+// glass would double the rays per bounce, up to 2^STARTING_TTL a pixel. Instead each pixel keeps a queue
+// of the rays still to trace, each with its weight - how much it adds to the pixel, ie the product of
+// the transparencies, reflectivenesses and absorptions on the way to it. The queue's done in breadth
+// order, a ray too faint to matter is never queued, and once a pixel has cast TRACE_MAX_RAYS rays the
+// rest are dropped - the deepest, as it's breadth first. A dropped ray adds nothing to the pixel, not
+// even its share of the background alpha, as there's no telling whether it would have hit anything.
+
+// rays adding less than this to a pixel, in their brightest channel, aren't traced
+float const TRACE_MIN_WEIGHT = 1.0f / 256.0f;
+
+// the most rays (besides shadow rays) to trace for one pixel
+unsigned int const TRACE_MAX_RAYS = 256;
+
+struct WeightedRay {
+    Ray ray;
+    Color weight;
+};
+
+// the rays still to trace for a pixel, from @head on
+struct RayQueue {
+    RayQueue() : head(0), cast(0) {}
+
+    void reset() {
+        rays.clear();
+        head = 0;
+        cast = 0;
+    }
 
-    color += diffuse(ray, bvh, primitives, lights.pointLights, hit, mat, p);
-    color += diffuse(ray, bvh, primitives, lights.spotLights, hit, mat, p);
+    // add @ray, unless it's too faint or the pixel's out of rays
+    void push(Ray const& ray, Color const& weight) {
+        if(std::max(weight.r, std::max(weight.g, weight.b)) < TRACE_MIN_WEIGHT || cast >= TRACE_MAX_RAYS)
+            return;
+        rays.push_back({ray, weight});
+        cast++;
+    }
 
-    assert(isFinite(color));
-    return color;
-}
+    bool empty() const {
+        return head == rays.size();
+    }
 
-Color trace(Ray const& ray,
-            BVH const& bvh,
-            Primitives const& primitives,
-            Lights const& lights,
-            Color const& alpha,
-            Params const& p){
-    assert(isFinite(alpha));
+    WeightedRay const& pop() {
+        return rays[head++];
+    }
 
-    if(ray.ttl<=0) 
-        return alpha;
-    
-    MiniIntersection hit = findClosestIntersectionBVH(bvh, primitives, ray, p.traversalMode);
-    if(!hit.hit()) 
-        return alpha;
+    std::vector<WeightedRay> rays;
+    size_t head;
+    unsigned int cast;  // rays ever queued, since the reset
+};
 
-    TrianglePos const& pos = primitives.pos[hit.triangle];
-    TriangleExtra const& tri = primitives.extra[hit.triangle];
-    FancyIntersection fancy = FancyIntersect(hit.distance, pos, tri, ray, p.smoothing);
+// the queue for the pixel this thread is on. kept between pixels, to save allocating. nothing in
+// tracing one pixel starts another, so one's enough
+inline RayQueue& threadRayQueue() {
+    thread_local RayQueue queue;
+    return queue;
+}
 
+// colour of the hit @fancy, @distance along @ray, on material @mat (ie already checkered, see
+// ShadingTable::resolve), from its lights alone, times @weight. the refraction and reflection rays it
+// casts go on @queue, weighted by what they add to the pixel
+Color shadeSurface(Ray const& ray,
+                   float distance,
+                   FancyIntersection const& fancy,
+                   int mat,
+                   Color const& weight,
+                   BVH const& bvh,
+                   Primitives const& primitives,
+                   Lights const& lights,
+                   Params const& p,
+                   RayQueue& queue){
     assert(glm::isNormalized(fancy.normal, EPSILON));
 
-    Material mat = primitives.materials[fancy.mat];
-    Material raymat = primitives.materials[ray.mat];
+    // indices into the shading table, rather than copies of the materials
+    ShadingTable const& mats = primitives.shading;
+    int const raymat = ray.mat;
 
-    if(mat.checkered >= 0){
-        int x = (int)(fancy.impact.x - EPSILON);
-        int y = (int)(fancy.impact.y - EPSILON);
-        int z = (int)(fancy.impact.z - EPSILON);
-        if((x&1)^(y&1)^(z&1)) 
-            mat = primitives.materials[mat.checkered];
+    // absorption (Beer's law), on the way here - so of everything seen from here
+    Color absorbed = weight;
+    if(ray.mat!=MATERIAL_AIR){
+        Color const& absorb = mats.diffuseColor[raymat];
+        absorbed.r *= expf( -absorb.r * distance);
+        absorbed.g *= expf( -absorb.g * distance);
+        absorbed.b *= expf( -absorb.b * distance);
     }
-	
+
     Color color = BLACK;
 
     // shadows and lighting
-    if(mat.diffuseColor!=BLACK){
-        color += calcTotalDiffuse(ray, bvh, primitives, lights, fancy, mat, p);
+    if(mats.has(mat, MATERIAL_DIFFUSE)){
+        color += absorbed * calcTotalDiffuse(ray, bvh, primitives, lights, fancy, mat, p);
     }
 
     assert(isFinite(color));
 
     // angle-depenent transparancy (for dielectric materials)
-    Color reflectiveness = mat.reflectiveness;
-    float transparency = mat.transparency;
+    Color reflectiveness = mats.reflectiveness[mat];
+    float transparency = mats.transparency[mat];
 
-    if(mat.transparency > 0.f){
-        float n1 = raymat.refraction_index;
-        float n2 = mat.refraction_index;
+    if(mats.has(mat, MATERIAL_TRANSPARENT)){
+        float n1 = mats.refraction_index[raymat];
+        float n2 = mats.refraction_index[mat];
         float r0 = (n1-n2)/(n1+n2); r0*=r0;
         float pow5 = 1.f-glm::dot(fancy.normal, -ray.direction);
         float fr = r0+(1.f-r0)*pow5*pow5*pow5*pow5*pow5;
         reflectiveness += transparency*fr;
         transparency   -= transparency*fr;
     }
-       
+
     // transparency (refraction)
     if(transparency>0.f){
         glm::vec3 refract_direction = 
             glm::refract(ray.direction, fancy.normal, 
-                    raymat.refraction_index/(fancy.internal?1.f:mat.refraction_index));
+                    mats.refraction_index[raymat]/(fancy.internal?1.f:mats.refraction_index[mat]));
         Ray refract_ray = Ray(fancy.impact-(fancy.normal*EPSILON),
                 refract_direction, 
                 //FIXME: exiting a primitive will set the material to air
                 fancy.internal ? MATERIAL_AIR : fancy.mat, 
-                ray.ttl-1);
-        color += transparency * trace(refract_ray, bvh, primitives, lights, alpha, p);
+                ray.ttl-1,
+                RayKind::Secondary);
+        queue.push(refract_ray, transparency * absorbed);
     }
-    
+
     // reflection (mirror)
     if(reflectiveness!=BLACK){
         Ray r = Ray(fancy.impact+fancy.normal*EPSILON,
                     glm::reflect(ray.direction, fancy.normal),
                     ray.mat,
-                    ray.ttl-1);
-        color += reflectiveness * trace(r, bvh, primitives, lights, alpha, p);
+                    ray.ttl-1,
+                    RayKind::Secondary);
+        queue.push(r, reflectiveness * absorbed);
     }
 
-    // absorption (Beer's law)
-    if(ray.mat!=MATERIAL_AIR){
-        color.r *= expf( -raymat.diffuseColor.r * hit.distance);
-        color.g *= expf( -raymat.diffuseColor.g * hit.distance);
-        color.b *= expf( -raymat.diffuseColor.b * hit.distance);
+    return color;
+}
+
+// trace everything on @queue (and everything that spawns), and sum what it adds to the pixel. rays that
+// run out of ttl or hit nothing see @alpha. rays RayQueue::push dropped don't, so a non-black @alpha comes
+// out a little darker behind glass than a full recursive trace would give
+Color traceQueue(RayQueue& queue,
+                 BVH const& bvh,
+                 Primitives const& primitives,
+                 Lights const& lights,
+                 Color const& alpha,
+                 Params const& p){
+    assert(isFinite(alpha));
+
+    Color color = BLACK;
+    while(!queue.empty()){
+        // a copy - pushing can move the queue
+        WeightedRay const wr = queue.pop();
+        Ray const& ray = wr.ray;
+
+        if(ray.ttl<=0){
+            color += wr.weight * alpha;
+            continue;
+        }
+
+        MiniIntersection hit = findClosestIntersectionBVH(bvh, primitives, ray, p.traversalMode, p.triangleTest);
+        if(!hit.hit()){
+            color += wr.weight * alpha;
+            continue;
+        }
+
+        TriangleExtra const& tri = primitives.extra[hit.triangle];
+        FancyIntersection fancy = FancyIntersect(hit, tri, ray, p.smoothing);
+
+        int const mat = primitives.shading.resolve(fancy.mat, fancy.impact);
+        color += shadeSurface(ray, hit.distance, fancy, mat, wr.weight, bvh, primitives, lights, p, queue);
     }
+
+    assert(isFinite(color));
     return color;
 }
 
+// colour of the hit @fancy, @distance along @ray, on material @mat (ie already checkered, see
+// ShadingTable::resolve). the shading half of trace(), so hits can also be shaded in batches
+Color shadeHit(Ray const& ray,
+               float distance,
+               FancyIntersection const& fancy,
+               int mat,
+               BVH const& bvh,
+               Primitives const& primitives,
+               Lights const& lights,
+               Color const& alpha,
+               Params const& p){
+    RayQueue& queue = threadRayQueue();
+    queue.reset();
+    queue.cast = 1; // the camera ray
+
+    Color color = shadeSurface(ray, distance, fancy, mat, Color(1.f), bvh, primitives, lights, p, queue);
+    return color + traceQueue(queue, bvh, primitives, lights, alpha, p);
+}
+
+// colour seen along @ray, with @alpha where there's nothing - as far as it's traced, see traceQueue
+Color trace(Ray const& ray,
+            BVH const& bvh,
+            Primitives const& primitives,
+            Lights const& lights,
+            Color const& alpha,
+            Params const& p){
+    RayQueue& queue = threadRayQueue();
+    queue.reset();
+    queue.push(ray, Color(1.f));
+
+    return traceQueue(queue, bvh, primitives, lights, alpha, p);
+}
@@ -6,6 +6,8 @@
 #include <algorithm>
 #include <array>
 #include <cmath>
+#include <cstdint>
+#include <vector>
 
 float const EPSILON = 1e-6f;
 float const PI    = glm::pi<float>();
@@ -32,6 +34,16 @@ inline uint32_t xorshift32(uint32_t x){
     return x;
 }
 
+// integer hash (the murmur3 finaliser) - for turning a handful of small ints into a decent seed
+inline uint32_t hash32(uint32_t x){
+    x ^= x >> 16;
+    x *= 0x85ebca6b;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35;
+    x ^= x >> 16;
+    return x;
+}
+
 struct Rng{
     Rng(uint32_t seed):state(seed){};
     uint32_t state;
@@ -81,3 +93,38 @@ inline unsigned int largestElem(glm::vec3 const& v) {
                (v.y > v.z ? 1 : 2);
 }
 
+
+// sort @values by @keys (the two are kept in step), with an lsd radix sort a byte at a time. stable.
+// bytes every key has the same of are skipped, so sorting on a few distinct keys is cheap
+inline void radixSortByKey(std::vector<uint32_t>& keys, std::vector<uint32_t>& values) {
+    assert(keys.size() == values.size());
+    unsigned int const n = keys.size();
+    if(n < 2)
+        return;
+
+    std::vector<uint32_t> keysOut(n), valuesOut(n);
+    for(int shift = 0; shift < 32; shift += 8) {
+        unsigned int counts[256] = {0};
+        for(uint32_t k : keys)
+            counts[(k >> shift) & 0xff]++;
+
+        if(counts[(keys[0] >> shift) & 0xff] == n)
+            continue; // all the same, so already in order on this byte
+
+        // counts -> where each digit starts
+        unsigned int start = 0;
+        for(auto& c : counts) {
+            unsigned int const count = c;
+            c = start;
+            start += count;
+        }
+
+        for(unsigned int i = 0; i < n; i++) {
+            unsigned int const dest = counts[(keys[i] >> shift) & 0xff]++;
+            keysOut[dest] = keys[i];
+            valuesOut[dest] = values[i];
+        }
+        keys.swap(keysOut);
+        values.swap(valuesOut);
+    }
+}